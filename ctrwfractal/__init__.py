@@ -15,6 +15,26 @@
 # You should have received a copy of the GNU General Public License
 # along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
 
-from .ctrwfractal import CTRWfractal
+from .ctrwfractal import (
+    CTRWfractal,
+    WalkAnalysis,
+    ageing_tamsd,
+    analyse_tracks,
+    detect_dwells,
+    fit_abc,
+    generate_dataset,
+    laplacian_spectrum,
+    run_sweep,
+)
 
-__all__ = ["CTRWfractal"]
+__all__ = [
+    "CTRWfractal",
+    "WalkAnalysis",
+    "ageing_tamsd",
+    "analyse_tracks",
+    "detect_dwells",
+    "fit_abc",
+    "generate_dataset",
+    "laplacian_spectrum",
+    "run_sweep",
+]
@@ -29,11 +29,33 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <armadillo>
 
+#include "utils/dwell.hpp"
+#include "utils/grid.hpp"
+#include "utils/lattice.hpp"
+#include "utils/npy.hpp"
 #include "utils/pcg_random.hpp"
+#include "utils/summary.hpp"
+#include "utils/tracks.hpp"
 #include "utils/utils.hpp"
+#include "utils/workspace.hpp"
+#include "utils/zarr.hpp"
 
 template <typename T>
 class CTRWfractal
@@ -42,72 +64,74 @@ public:
   CTRWfractal(
       const uint64_t gridSize,
       const uint64_t latticeType,
+      const uint64_t percolationType,
       const double threshold,
+      const bool sweep,
       const uint64_t walkType,
       const uint64_t nWalks,
       const uint64_t nSteps,
       const double beta,
       const double tau0,
       const double noise,
+      const bool accelerate,
+      const arma::Col<T> &walkThresholds,
+      const double switchOn,
+      const double switchOff,
+      const bool dynamicClusters,
+      const bool exclusion,
+      const uint64_t memoryLimit,
       const int64_t randomSeed,
       const int64_t nJobs) : gridSize(gridSize),
                              latticeType(latticeType),
+                             percolationType(percolationType),
                              threshold(threshold),
+                             sweep(sweep),
                              walkType(walkType),
                              nWalks(nWalks),
                              nSteps(nSteps),
                              beta(beta),
                              tau0(tau0),
                              noise(noise),
+                             accelerate(accelerate),
+                             walkThresholds(walkThresholds),
+                             switchOn(switchOn),
+                             switchOff(switchOff),
+                             dynamicClusters(dynamicClusters),
+                             exclusion(exclusion),
+                             memoryLimit(memoryLimit),
                              randomSeed(randomSeed),
                              nJobs(nJobs)
   {
     includeWalks = ((nWalks > 0) && (nSteps > 0));
+    dynamic = ((switchOn > 0.) || (switchOff > 0.));
+    leanAnalysis = false;
+    decompose = false;
+    extendable = false;
+    nAnalysed = 0;
+    walkSeed = 0;
+    verbose = true;
+    progress = &ownProgress; // Until the caller shares one with SetProgress
 
-    if (includeWalks) // Set array sizes
+    if (memoryLimit > 0) // Check the footprint before anything is allocated
     {
-      simLength = (tau0 < 1.0) ? static_cast<uint64_t>(nSteps / tau0) : nSteps;
-
-      walks.set_size(simLength);
-      ctrwTimes.set_size(simLength);
-      trueWalks.set_size(nSteps);
-      eaMSD.set_size(nSteps);
-      eaMSDall.set_size(nSteps - 1, nWalks);
-      taMSD.set_size(nSteps - 1, nWalks);
-      eataMSD.set_size(nSteps - 1);
-      eataMSDall.set_size(nSteps - 1, nWalks);
-      ergodicity.set_size(nSteps - 1);
-    }
-    else
-    {
-      simLength = 0;
-
-      walks.set_size(0);
-      ctrwTimes.set_size(0);
-      trueWalks.set_size(0);
-      eaMSD.set_size(0);
-      eaMSDall.set_size(0, 0);
-      taMSD.set_size(0, 0);
-      eataMSD.set_size(0);
-      eataMSDall.set_size(0, 0);
-      ergodicity.set_size(0);
+      CheckMemory();
     }
 
     if (randomSeed < 0) // Seed with external entropy from std::random_device
     {
-      RNG.seed(pcg_extras::seed_seq_from<std::random_device>());
+      std::random_device rd;
+      seed = (static_cast<uint64_t>(rd()) << 32) | rd();
     }
     else
     {
-      RNG.seed(randomSeed);
+      seed = randomSeed;
     }
+    RNG.seed(seed); // Keep the seed so that it can be recorded
   };
 
   ~CTRWfractal()
   {
-    walks.reset();
-    ctrwTimes.reset();
-    trueWalks.reset();
+    workspace.Release();
     eaMSD.reset();
     eaMSDall.reset();
     taMSD.reset();
@@ -115,17 +139,24 @@ public:
     eataMSDall.reset();
     ergodicity.reset();
     nn.reset();
+    bonds.reset();
+    slotBond.reset();
+    neighbourMask.reset();
     lattice.reset();
     occupation.reset();
     latticeCoords.reset();
+    percolationSweep.reset();
     analysis.reset();
     walksCoords.reset();
+    thresholdWalks.reset();
+    thresholdAnalysis.reset();
   };
 
   void FindNeighbours()
   {
+    progress->Set(Progress::STAGE, Progress::NEIGHBOURS);
     t0 = GetTime();
-    PrintFixed(0, "Searching neighbours...    ");
+    Log(0, "Searching neighbours...    ");
 
     switch (latticeType)
     {
@@ -134,6 +165,7 @@ public:
       N = 4 * gridSize * gridSize;
 
       nn.set_size(neighbourCount, N);
+      ParallelFill(nn, 0, nJobs); // Place the pages before the serial fill below
       firstRow.set_size(2 * gridSize);
       lastRow.set_size(2 * gridSize);
 
@@ -150,6 +182,7 @@ public:
       N = gridSize * gridSize;
 
       nn.set_size(neighbourCount, N);
+      ParallelFill(nn, 0, nJobs); // Place the pages before the serial fill below
       firstRow.set_size(gridSize);
       lastRow.set_size(gridSize);
 
@@ -162,669 +195,3983 @@ public:
       break;
     }
 
+    // Flag the sites on the first (1) and last (2) rows, so that a hop can
+    // be checked for a boundary crossing without searching the rows
+    rowEdges.zeros(N);
+    for (size_t i = 0; i < firstRow.n_elem; i++)
+    {
+      if (firstRow(i) >= 0 && static_cast<uint64_t>(firstRow(i)) < N)
+      {
+        rowEdges(firstRow(i)) |= 1;
+      }
+      if (lastRow(i) >= 0 && static_cast<uint64_t>(lastRow(i)) < N)
+      {
+        rowEdges(lastRow(i)) |= 2;
+      }
+    }
+
+    if (percolationType == 1) // Bond percolation permutes bonds, not sites
+    {
+      FindBonds();
+      nOrder = nBonds;
+    }
+    else
+    {
+      nBonds = 0;
+      nOrder = N;
+    }
+
     EMPTY = (-1 * static_cast<int64_t>(N) - 1); // Define empty index
     lattice.set_size(N);                        // Set array sizes
     clusters.set_size(N);
-    occupation.set_size(N);
+    occupation.set_size(nOrder);
+    neighbourMask.set_size(N);
     latticeCoords.set_size(2, N);
 
-    if (includeWalks)
+    // Interleave the big per-site arrays over the NUMA nodes by first touch
+    ParallelFill(lattice, EMPTY, nJobs);
+    ParallelFill(clusters, EMPTY, nJobs);
+    ParallelFill(occupation, 0, nJobs);
+    ParallelFill(neighbourMask, 0, nJobs);
+    ParallelFill(latticeCoords, 0., nJobs);
+
+    if (sweep)
     {
-      analysis.set_size(nSteps - 1, nWalks + 3);
-      walksCoords.set_size(2, nSteps, nWalks);
+      percolationSweep.set_size(nOrder, 2);
     }
     else
     {
-      analysis.set_size(0, 0);
-      walksCoords.set_size(0, 0, 0);
-      analysis.zeros();
-      walksCoords.zeros();
+      percolationSweep.set_size(0, 0);
     }
 
+    SizeWalkBuffers();
+
     t1 = GetTime();
-    PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
   }
 
   void Permute()
   {
-    PrintFixed(0, "Randomizing occupations... ");
+    Log(0, "Randomizing occupations... ");
+    progress->Set(Progress::STAGE, Progress::PERMUTATION);
     t0 = GetTime();
 
     int64_t j, t_;
 
-    occupation = arma::regspace<arma::ivec>(0, N - 1);
+    ParallelFill(occupation.memptr(), nOrder, [](uint64_t i) { return i; }, nJobs); // In place, keeping the page placement
 
-    for (size_t i = 0; i < N; i++)
+    for (size_t i = 0; i < nOrder; i++)
     {
-      j = i + (N - i) * permConstant * UniformDistribution(RNG);
+      if (i % Progress::blockSize == 0 && Cancelled())
+      {
+        break;
+      }
+
+      j = i + (nOrder - i) * permConstant * UniformDistribution(RNG);
       t_ = occupation(i);
       occupation(i) = occupation(j);
       occupation(j) = t_;
     }
 
     t1 = GetTime();
-    PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
   }
 
   void Percolate()
   {
-    PrintFixed(0, "Running percolation...     ");
+    Log(0, "Running percolation...     ");
+    progress->Set(Progress::STAGE, Progress::PERCOLATION);
     t0 = GetTime();
 
-    int64_t s1, s2;
-    int64_t r1, r2;
-    int64_t big = 0;
-
-    lattice.fill(EMPTY);
-
-    for (uint64_t i = 0; i < (threshold * N) - 1; i++)
+    switch (percolationType)
     {
-      r1 = s1 = occupation[i];
-      lattice(s1) = -1;
-      for (size_t j = 0; j < neighbourCount; j++)
-      {
-        s2 = nn(j, s1);
-        if (lattice(s2) != EMPTY)
-        {
-          r2 = FindRoot(s2);
-          if (r2 != r1)
-          {
-            if (lattice(r1) > lattice(r2))
-            {
-              lattice(r2) += lattice(r1);
-              lattice(r1) = r2;
-              r1 = r2;
-            }
-            else
-            {
-              lattice(r1) += lattice(r2);
-              lattice(r2) = r1;
-            }
-            if (-lattice(r1) > big)
-            {
-              big = -lattice(r1);
-            }
-          }
-        }
-      }
+    case 1:
+      PercolateBonds();
+      break;
+    case 0:
+    default:
+      PercolateSites();
+      break;
     }
 
     t1 = GetTime();
-    PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
   }
 
   void BuildLattice()
   {
-    PrintFixed(0, "Building lattice...        ");
+    Log(0, "Building lattice...        ");
     t0 = GetTime();
 
-    uint64_t count;
+    if (IsPowerOfTwo(gridSize))
+    {
+      LatticeCoordinates(PowerOfTwoGrid(gridSize, N));
+    }
+    else
+    {
+      LatticeCoordinates(GenericGrid(gridSize, N));
+    }
 
     switch (latticeType)
     {
-    case 1: // Populate honeycomb lattice coordinates
-      double xx, yy;
-      uint64_t currentCol, xOffset, yOffset;
-      count = 0;
-
-      for (size_t i = 0; i < 4 * gridSize; i++)
-      {
-        for (size_t j = 0; j < gridSize; j++)
-        {
-          yOffset = (gridSize - j - 1); // Count from top to bottom
-          xOffset = i / 4;              // divmod - remainder for free
-          currentCol = i % 4;
-
-          switch (currentCol)
-          {
-          case 0:
-          default:
-            xx = xOffset * 3;
-            yy = yOffset * sqrt3 + sqrt3o2;
-            break;
-          case 1:
-            xx = xOffset * 3 + 0.5;
-            yy = yOffset * sqrt3;
-            break;
-          case 2:
-            xx = xOffset * 3 + 1.5;
-            yy = yOffset * sqrt3;
-            break;
-          case 3:
-            xx = xOffset * 3 + 2.0;
-            yy = yOffset * sqrt3 + sqrt3o2;
-            break;
-          }
-          latticeCoords(0, count) = xx;
-          latticeCoords(1, count) = yy;
-          count++;
-        }
-      }
-
+    case 1:
       unitCell = arma::max(latticeCoords, 1); // Get unit cell size
       unitCell(0) += 1.5;
       unitCell(1) += sqrt3o2;
+      latticeBasis = {0.5, sqrt3o2}; // Every x is a multiple of 1/2, every y of sqrt(3)/2
+      latticeMetric = {0.25, 0.75};
       break;
-    case 0: // Populate square lattice coordinates
+    case 0:
     default:
-      count = 0;
-
-      for (size_t i = 0; i < gridSize; i++)
-      {
-        for (size_t j = 0; j < gridSize; j++)
-        {
-          latticeCoords(0, count) = i;
-          latticeCoords(1, count) = j;
-          count++;
-        }
-      }
-
       unitCell = arma::max(latticeCoords, 1); // Get unit cell size
       unitCell(0) += 1;
       unitCell(1) += 1;
+      latticeBasis = {1., 1.};
+      latticeMetric = {1., 1.};
       break;
     }
 
     t1 = GetTime();
-    PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
   }
 
   void RandomWalks()
   {
-    PrintFixed(0, "Simulating random walks... ");
+    Log(0, "Simulating random walks... ");
+    progress->Set(Progress::STAGE, Progress::WALKING);
     t0 = GetTime();
 
     PossibleStartPoints(); // Populate start points
 
-    std::uniform_int_distribution<uint32_t> RandSample(0, static_cast<uint32_t>(latticeOnes.n_elem) - 1);
-
-    arma::uvec boundaryDetect(simLength);
-    arma::uvec boundaryTrue(simLength);
-    int64_t boundary1 = static_cast<int64_t>(gridSize);
-    int64_t boundary2 = static_cast<int64_t>(N) - boundary1;
+    if (accelerate) // Lazy walks each draw from a stream of their own, so they can be carried on
+    {
+      walkSeed = RNG();
+    }
 
     for (size_t i = 0; i < nWalks; i++) // Simulate a random walk on the lattice
     {
-      uint64_t countLoop = 0;
-      uint64_t countMax = std::min(N, static_cast<uint64_t>(1E6)); // Maximum attempts to find a starting site
+      if (TickWalks(i))
+      {
+        break;
+      }
+
+      pcg64 stream(walkSeed, i);
+      pcg64 &rng = accelerate ? stream : RNG;
+
+      bool trapped;
+      int64_t pos = StartPoint(rng, trapped); // Random start with >= 1 accessible nearest neighbours
+      int64_t posLast;
 
-      int64_t pos, posLast;
-      bool okStart = false;
-      arma::ivec neighbours;
+      if (noise == 0.) // Walks are final once simulated, so stream them out
+      {
+        StreamWalks(i);
+      }
 
-      do // Search for a random start position
+      if (accelerate) // Only simulate the hops that are observed
       {
-        pos = latticeOnes(RandSample(RNG));
-        neighbours = GetOccupiedNeighbours(pos);
+        const WalkState state = LazyWalk(rng, pos, trapped,
+                                         [&](const int64_t p) { return neighbourMask(p); },
+                                         walksCoords, i, true);
+        SaveState(i, state, rng);
+        continue;
+      }
 
-        if (neighbours.n_elem > 0 || countLoop >= countMax) // Check start position has >= 1 occupied nearest neighbours
-        {
-          okStart = true;
-        }
-        else
-        {
-          countLoop++;
-        }
-      } while (!okStart);
+      // Only allocates for the first walk, the rest reuse the buffers
+      progress->Add(Progress::ALLOCATIONS, workspace.Reserve(simLength, nSteps));
+      int64_t *sites = workspace.sites.data();
+      uint8_t *crossings = workspace.crossings.data();
+      double *times = workspace.times.data();
 
-      if (countLoop == countMax) // If no nearest neighbours, set the whole walk to that site
+      if (trapped) // If no nearest neighbours, set the whole walk to that site
       {
-        walks.fill(pos);
-        boundaryDetect.zeros();
+        std::fill(sites, sites + simLength, pos);
+        std::fill(crossings, crossings + simLength, 0);
       }
       else
       {
         posLast = pos;
-        walks(0) = pos;
-        boundaryDetect(0) = 0;
+        sites[0] = pos;
+        crossings[0] = 0;
 
         for (size_t j = 1; j < simLength; j++)
         {
-          neighbours = GetOccupiedNeighbours(pos);
-          std::uniform_int_distribution<uint32_t> RandChoice(0, static_cast<uint32_t>(neighbours.n_elem) - 1);
-          pos = neighbours(RandChoice(RNG));
-          walks(j) = pos;
-
-          if (arma::any(firstRow == posLast) && arma::any(lastRow == pos)) // Walks that hit the top boundary
-          {
-            boundaryDetect(j) = 1;
-          }
-          else if (arma::any(lastRow == posLast) && arma::any(firstRow == pos)) // Walks that hit the bottom boundary
-          {
-            boundaryDetect(j) = 2;
-          }
-          else if (posLast >= boundary2 && pos < boundary1) // Walks that hit the right boundary
-          {
-            boundaryDetect(j) = 3;
-          }
-          else if (posLast < boundary1 && pos >= boundary2) // Walks that hit the left boundary
-          {
-            boundaryDetect(j) = 4;
-          }
-          else
-          {
-            boundaryDetect(j) = 0;
-          }
-
+          pos = Hop(RNG, pos, neighbourMask(pos));
+          sites[j] = pos;
+          crossings[j] = BoundaryCrossed(posLast, pos);
           posLast = pos; // Update last position
         }
       }
 
-      ctrwTimes.set_size(simLength);
       if (beta > 0.)
       {
         std::exponential_distribution<double> ExponentialDistribution(beta); // Create exponential distribution
-        ctrwTimes.imbue([&]() { return ExponentialDistribution(RNG); });     // Draw CTRW random variates
-        ctrwTimes = arma::cumsum(tau0 * arma::exp(ctrwTimes));               // Transform to Pareto distribution and accumulate
+        double t = 0.;
+        for (size_t j = 0; j < simLength; j++) // Transform the variates to Pareto distribution and accumulate
+        {
+          t += tau0 * std::exp(ExponentialDistribution(RNG));
+          times[j] = t;
+        }
       }
       else
       {
-        ctrwTimes = arma::linspace<arma::vec>(1, simLength, simLength);
+        for (size_t j = 0; j < simLength; j++)
+        {
+          times[j] = j + 1.;
+        }
       }
 
-      arma::uvec boundaryTime_ = arma::find(ctrwTimes >= nSteps, 1, "first"); // Only keep times within range [0, nSteps]
-      int64_t boundaryTime = boundaryTime_(0);
-      ctrwTimes = ctrwTimes(arma::span(0, boundaryTime));
-      ctrwTimes(boundaryTime) = nSteps;
+      uint64_t boundaryTime = simLength - 1; // Only keep times within range [0, nSteps]
+      for (size_t j = 0; j < simLength; j++)
+      {
+        if (times[j] >= nSteps)
+        {
+          boundaryTime = j;
+          break;
+        }
+      }
+      times[boundaryTime] = nSteps;
 
+      int64_t *observedSites = workspace.observedSites.data();
+      uint8_t *observedCrossings = workspace.observedCrossings.data();
       uint64_t counter = 0;
-      boundaryTrue.zeros();
 
       for (size_t j = 0; j < nSteps; j++) // Subordinate fractal walk with CTRW
       {
-        if (j > ctrwTimes(counter))
+        observedCrossings[j] = 0;
+        if (j > times[counter])
         {
           counter++;
-          boundaryTrue(j) = boundaryDetect(counter);
+          observedCrossings[j] = crossings[counter];
         }
-        trueWalks(j) = walks(counter);
+        observedSites[j] = sites[counter];
       }
 
       int64_t nxCell = 0;
       int64_t nyCell = 0;
       for (size_t n = 0; n < nSteps; n++) // Convert the walk to the coordinate system
       {
-        switch (boundaryTrue(n))
-        {
-        case 1:
-          nyCell++;
-          break;
-        case 2:
-          nyCell--;
-          break;
-        case 3:
-          nxCell++;
-          break;
-        case 4:
-          nxCell--;
-          break;
-        case 0:
-        default:
-          break;
-        }
-        walksCoords(0, n, i) = latticeCoords(0, trueWalks(n)) + nxCell * unitCell(0);
-        walksCoords(1, n, i) = latticeCoords(1, trueWalks(n)) + nyCell * unitCell(1);
+        UpdateCell(observedCrossings[n], nxCell, nyCell);
+        walksCoords(0, n, i) = latticeCoords(0, observedSites[n]) + nxCell * unitCell(0);
+        walksCoords(1, n, i) = latticeCoords(1, observedSites[n]) + nyCell * unitCell(1);
+        Reside(i, observedSites[n]);
       }
     }
 
+    if (!Cancelled())
+    {
+      TickWalks(nWalks);
+    }
+
     t1 = GetTime();
-    PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
   }
 
-  void AnalyseWalks()
+  void DynamicWalks()
   {
-    PrintFixed(0, "Analysing random walks...  ");
+    // Sites (or bonds) switch between occupied and empty with rates
+    // switchOn and switchOff while the walkers move. The occupancy is
+    // bit-packed, and the switching events are generated in batches by
+    // uniformization at the total rate nOrder * max(switchOn, switchOff),
+    // then merged in time order with the walkers' hops via an event queue.
+    // Walkers query the current bits, so no structures are rebuilt.
+    Log(0, "Simulating dynamic walks...");
+    progress->Set(Progress::STAGE, Progress::WALKING);
     t0 = GetTime();
 
-    eaMSD.zeros(); // Zero the placeholders
-    eaMSDall.zeros();
-    taMSD.zeros();
-    eataMSD.zeros();
-    eataMSDall.zeros();
-    ergodicity.zeros();
+    PossibleStartPoints(); // Start points are taken from the initial configuration
 
-    // For long walks / lots of walks, the analysis is the bottleneck,
-    // so we parallelize over nJobs using threading.
+    occupancyBits.assign((nOrder + 63) / 64, 0);
+    for (size_t i = 0; i < OrderCount(threshold); i++)
+    {
+      FlipBit(occupancyBits, occupation(i));
+    }
 
-    auto &&func = [&](uint64_t i) {
-      arma::vec::fixed<2> walkOrigin, walkStep;
-      walkOrigin = walksCoords.slice(i).col(0);
-      for (size_t j = 1; j < nSteps; j++)
+    std::uniform_int_distribution<uint32_t> RandSample(0, static_cast<uint32_t>(latticeOnes.n_elem) - 1);
+    std::exponential_distribution<double> ExponentialDistribution((beta > 0.) ? beta : 1.);
+
+    arma::Col<int64_t> pos(nWalks);
+    arma::Mat<int64_t> cells(2, nWalks, arma::fill::zeros);
+    arma::uvec counter(nWalks, arma::fill::zeros);
+    arma::vec tWalk(nWalks); // Cumulative CTRW time of each walker's next hop
+
+    typedef std::pair<double, uint64_t> Event;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> hops;
+
+    for (size_t i = 0; i < nWalks; i++)
+    {
+      uint64_t countLoop = 0;
+      uint64_t countMax = std::min(N, static_cast<uint64_t>(1E6));
+      do
       {
-        walkStep = walksCoords.slice(i).col(j);
-        eaMSDall(j - 1, i) = SquaredDist(walkStep(0), walkOrigin(0),
-                                         walkStep(1), walkOrigin(1)); // Ensemble-average MSD
-        taMSD(j - 1, i) = TAMSD(walksCoords.slice(i), nSteps, j);     // Time-average MSD
-        eataMSDall(j - 1, i) = TAMSD(walksCoords.slice(i), j, 1);     // Ensemble-time-average MSD
+        pos(i) = latticeOnes(RandSample(RNG));
+      } while (DynamicMask(pos(i)) == 0 && ++countLoop < countMax);
+
+      tWalk(i) = (beta > 0.) ? tau0 * std::exp(ExponentialDistribution(RNG)) : 1.;
+      if (countLoop < countMax)
+      {
+        hops.push(Event(tWalk(i), i));
       }
-    };
+    }
 
-    parallel(func, static_cast<uint64_t>(0), static_cast<uint64_t>(nWalks), nJobs);
+    double rateMax = std::max(switchOn, switchOff);
+    std::exponential_distribution<double> EventGap(rateMax * nOrder);
+    std::uniform_int_distribution<uint64_t> RandElement(0, nOrder - 1);
+    std::uniform_real_distribution<double> RandAccept(0., 1.);
+    double tEvent = EventGap(RNG);
 
-    eaMSD.elem(arma::find_nonfinite(eaMSD)).zeros(); // Check for NaNs
-    taMSD.elem(arma::find_nonfinite(taMSD)).zeros();
-    eaMSDall.elem(arma::find_nonfinite(eataMSDall)).zeros();
+    for (size_t j = 0; j < nSteps; j++)
+    {
+      if (Cancelled())
+      {
+        break;
+      }
 
-    eaMSD = arma::mean(eaMSDall, 1); // Take means
-    eataMSD = arma::mean(eataMSDall, 1);
+      while (true) // Process every event before time j in order
+      {
+        double tHop = hops.empty() ? static_cast<double>(nSteps) : hops.top().first;
+        if (tEvent < tHop && tEvent < j)
+        {
+          uint64_t e = RandElement(RNG);
+          if (RandAccept(RNG) * rateMax < (GetBit(occupancyBits, e) ? switchOff : switchOn))
+          {
+            FlipBit(occupancyBits, e);
+          }
+          tEvent += EventGap(RNG);
+        }
+        else if (tHop < j)
+        {
+          uint64_t i = hops.top().second;
+          hops.pop();
 
-    eataMSD.elem(arma::find_nonfinite(eataMSD)).zeros(); //  Check for NaNs
+          uint8_t mask = DynamicMask(pos(i));
+          if (mask > 0) // Otherwise the walker is blocked and stays put
+          {
+            int64_t posLast = pos(i);
+            pos(i) = Hop(RNG, posLast, mask);
+            UpdateCell(BoundaryCrossed(posLast, pos(i)), cells(0, i), cells(1, i));
+          }
 
-    arma::mat meanTAMSD = arma::square(arma::mean(taMSD, 1));
-    arma::mat meanTAMSD2 = arma::mean(arma::square(taMSD), 1);
+          // As in the static model, at most one hop is observed per step
+          counter(i)++;
+          tWalk(i) = (beta > 0.) ? tWalk(i) + tau0 * std::exp(ExponentialDistribution(RNG)) : counter(i) + 1;
+          if (counter(i) + 1 < simLength)
+          {
+            hops.push(Event(std::max(tWalk(i), static_cast<double>(j)), i));
+          }
+        }
+        else
+        {
+          break;
+        }
+      }
 
-    ergodicity = (meanTAMSD2 - meanTAMSD) / meanTAMSD; // Ergodicity breaking over s
-    ergodicity.elem(arma::find_nonfinite(ergodicity)).zeros();
-    ergodicity /= arma::regspace<arma::vec>(1, nSteps - 1);
-    ergodicity.elem(arma::find_nonfinite(ergodicity)).zeros();
+      for (size_t i = 0; i < nWalks; i++)
+      {
+        walksCoords(0, j, i) = latticeCoords(0, pos(i)) + cells(0, i) * unitCell(0);
+        walksCoords(1, j, i) = latticeCoords(1, pos(i)) + cells(1, i) * unitCell(1);
+      }
+      progress->Add(Progress::STEPS, nWalks);
+    }
+
+    if (dynamicClusters) // Only relabel the clusters when they are wanted
+    {
+      ResetLattice();
+      for (size_t e = 0; e < nOrder; e++)
+      {
+        if (GetBit(occupancyBits, e) && percolationType == 1)
+        {
+          AddBond(e);
+        }
+        else if (GetBit(occupancyBits, e))
+        {
+          AddSite(e);
+        }
+      }
+      GroupClusters();
+    }
 
-    analysis.col(0) = eaMSD;
-    analysis.col(1) = eataMSD;
-    analysis.col(2) = ergodicity;
-    analysis.cols(3, nWalks + 2) = taMSD;
+    occupancyBits.clear();
 
     t1 = GetTime();
-    PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
   }
 
-  void AddNoise()
+  void ExclusionWalks()
   {
-    if (noise > 0.0)
-    {
-      PrintFixed(0, "Adding noise...            ");
-      t0 = GetTime();
+    // Interacting tracers with hard-core exclusion: a hop onto a site that
+    // holds another particle is rejected. Particle positions are kept in a
+    // bitset over the lattice, and the next hop of each particle is filed
+    // in a time wheel with one bin per observed step, sorted when reached.
+    Log(0, "Tracers with exclusion...  ");
+    progress->Set(Progress::STAGE, Progress::WALKING);
+    t0 = GetTime();
 
-      arma::cube noiseCube(size(walksCoords));
-      std::normal_distribution<double> NormalDistribution(0, noise);
-      noiseCube.imbue([&]() { return NormalDistribution(RNG); });
-      walksCoords += noiseCube;
+    PossibleStartPoints();
 
-      t1 = GetTime();
-      PrintFixed(6, ElapsedSeconds(t0, t1), " s\n");
-    }
-  }
+    std::uniform_int_distribution<uint32_t> RandSample(0, static_cast<uint32_t>(latticeOnes.n_elem) - 1);
+    std::exponential_distribution<double> ExponentialDistribution((beta > 0.) ? beta : 1.);
 
-  void GroupClusters()
-  {
-    clusters = lattice;
-    int64_t j;
-    for (size_t i = 0; i < N; i++)
+    arma::Col<int64_t> pos(nWalks);
+    arma::Mat<int64_t> cells(2, nWalks, arma::fill::zeros);
+    arma::uvec counter(nWalks, arma::fill::zeros);
+    arma::vec tWalk(nWalks);
+
+    typedef std::pair<double, uint64_t> Event;
+    std::vector<std::vector<Event>> wheel(nSteps);
+    std::vector<uint64_t> particleBits((N + 63) / 64, 0);
+
+    auto &&schedule = [&](const uint64_t i, const double t) {
+      uint64_t bin = static_cast<uint64_t>(std::floor(t)) + 1; // First step j with j > t
+      if (bin < nSteps)
+      {
+        wheel[bin].push_back(Event(t, i));
+      }
+    };
+
+    for (size_t i = 0; i < nWalks; i++) // Distinct start sites
     {
-      //PrintFixed(0, i, " ", clusters(i), " ");
-      j = GroupRoot(i);
-      if (clusters(i) >= 0)
+      uint64_t countLoop = 0;
+      uint64_t countMax = std::min(N, static_cast<uint64_t>(1E6));
+      do
       {
-        clusters(i) = clusters(j);
+        pos(i) = latticeOnes(RandSample(RNG));
+      } while ((neighbourMask(pos(i)) == 0 || GetBit(particleBits, pos(i))) && ++countLoop < countMax);
+
+      if (countLoop == countMax)
+      {
+        throw std::runtime_error("Unable to find a free start site for every particle");
       }
-      //PrintFixed(0, j, " ", clusters(i), " ", clusters(j), "\n");
+
+      FlipBit(particleBits, pos(i));
+      tWalk(i) = (beta > 0.) ? tau0 * std::exp(ExponentialDistribution(RNG)) : 1.;
+      schedule(i, tWalk(i));
     }
-  }
 
-  bool includeWalks;
-  arma::Col<int64_t> lattice, clusters;
-  arma::Mat<T> latticeCoords, analysis;
-  arma::Cube<T> walksCoords;
+    for (size_t j = 0; j < nSteps; j++)
+    {
+      if (Cancelled())
+      {
+        break;
+      }
 
-private:
-  uint64_t gridSize, latticeType;
-  double threshold;
-  uint64_t walkType, nWalks, nSteps;
-  double beta, tau0, noise;
-  int64_t randomSeed, nJobs;
+      std::sort(wheel[j].begin(), wheel[j].end()); // Hops before step j, in time order
 
-  uint64_t N, simLength;
-  int64_t EMPTY;
-  uint8_t neighbourCount;
+      for (const Event &ev : wheel[j])
+      {
+        uint64_t i = ev.second;
+        int64_t posLast = pos(i);
+        int64_t target = Hop(RNG, posLast, neighbourMask(posLast));
 
-  const double sqrt3 = 1.7320508075688772;
-  const double sqrt3o2 = 0.8660254037844386;
+        if (!GetBit(particleBits, target))
+        {
+          FlipBit(particleBits, posLast);
+          FlipBit(particleBits, target);
+          pos(i) = target;
+          UpdateCell(BoundaryCrossed(posLast, target), cells(0, i), cells(1, i));
+        }
 
-  const uint32_t maxSites = 4294967294;      // Max uint32_t
-  const double permConstant = 2.3283064e-10; // Equal to 1 / maxSites (max uint32_t)
+        counter(i)++; // At most one hop is observed per step
+        tWalk(i) = (beta > 0.) ? tWalk(i) + tau0 * std::exp(ExponentialDistribution(RNG)) : counter(i) + 1;
+        if (counter(i) + 1 < simLength)
+        {
+          schedule(i, std::max(tWalk(i), static_cast<double>(j)));
+        }
+      }
+      std::vector<Event>().swap(wheel[j]);
 
-  arma::ivec occupation, walks, trueWalks, firstRow, lastRow, latticeOnes;
-  arma::imat nn;
-  arma::Col<T> unitCell, ctrwTimes, eaMSD, eataMSD, ergodicity;
+      for (size_t i = 0; i < nWalks; i++)
+      {
+        walksCoords(0, j, i) = latticeCoords(0, pos(i)) + cells(0, i) * unitCell(0);
+        walksCoords(1, j, i) = latticeCoords(1, pos(i)) + cells(1, i) * unitCell(1);
+        Reside(i, pos(i));
+      }
+      progress->Add(Progress::STEPS, nWalks);
+    }
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+  }
+
+  void OpenOutput(const std::string &path)
+  {
+    // Zarr directory with every run parameter and the seed as attributes,
+    // named and valued as the arguments of the Python class, so that the
+    // run can be repeated from them. Zero limits and rates are defaults.
+    std::ostringstream attrs;
+    attrs << std::setprecision(17)
+          << "{\"grid_size\": " << gridSize
+          << ", \"lattice_type\": " << ((latticeType == 1) ? "\"honeycomb\"" : "\"square\"")
+          << ", \"percolation_type\": " << ((percolationType == 1) ? "\"bond\"" : "\"site\"")
+          << ", \"threshold\": " << threshold
+          << ", \"sweep\": " << (sweep ? "true" : "false")
+          << ", \"walk_type\": " << ((walkType == 1) ? "\"largest\"" : "\"all\"")
+          << ", \"n_walks\": " << nWalks
+          << ", \"n_steps\": " << nSteps
+          << ", \"beta\": " << beta
+          << ", \"tau0\": " << tau0
+          << ", \"noise\": " << noise
+          << ", \"accelerate\": " << (accelerate ? "true" : "false")
+          << ", \"walk_thresholds\": [";
+    for (size_t i = 0; i < walkThresholds.n_elem; i++)
+    {
+      attrs << ((i > 0) ? ", " : "") << walkThresholds(i);
+    }
+    attrs << "], \"switch_rates\": ";
+    if (dynamic)
+    {
+      attrs << "[" << switchOn << ", " << switchOff << "]";
+    }
+    else
+    {
+      attrs << "null";
+    }
+    attrs << ", \"dynamic_clusters\": " << (dynamicClusters ? "true" : "false")
+          << ", \"exclusion\": " << (exclusion ? "true" : "false")
+          << ", \"backbone\": " << (decompose ? "true" : "false")
+          << ", \"extendable\": " << (extendable ? "true" : "false")
+          << ", \"memory_limit\": ";
+    if (memoryLimit > 0)
+    {
+      attrs << memoryLimit;
+    }
+    else
+    {
+      attrs << "null";
+    }
+    attrs << ", \"random_seed\": " << seed
+          << ", \"n_jobs\": " << nJobs << "}";
+
+    writer.reset(new ZarrWriter(path, attrs.str()));
+    walksWritten = 0;
+
+    if (includeWalks)
+    {
+      chunkWalks = std::min(ChunkLength(2 * nSteps * sizeof(T)), nWalks);
+      writer->CreateArray("walks", {nWalks, nSteps, 2}, {chunkWalks, nSteps, 2}, DataType<T>());
+    }
+  }
+
+  void WriteLattice()
+  {
+    if (writer)
+    {
+      WriteArray("lattice", latticeCoords.memptr(), {N, 2}, 0);
+      WriteArray("clusters", clusters.memptr(), {N}, 0);
+      if (sweep)
+      {
+        WriteArray("sweep", percolationSweep.memptr(), {nOrder, 2}, 1, 'F');
+      }
+    }
+  }
+
+  void WriteWalks()
+  {
+    StreamWalks(nWalks);
+  }
+
+  void WriteAnalysis()
+  {
+    if (writer) // Same layout as the DataFrame, (nSteps - 1, nWalks + 3)
+    {
+      WriteArray("analysis", analysis.memptr(), {nSteps - 1, nWalks + 3}, 1, 'F');
+    }
+  }
+
+  void CloseOutput()
+  {
+    if (writer)
+    {
+      writer->Close();
+      writer.reset();
+    }
+  }
+
+  void AnalyseWalks()
+  {
+    Log(0, "Analysing random walks...  ");
+    progress->Set(Progress::STAGE, Progress::ANALYSIS);
+    t0 = GetTime();
+
+    AnalyseCube(walksCoords, analysis);
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+  }
+
+  void AnalyseCube(const arma::Cube<T> &coords, arma::Mat<T> &out)
+  {
+    if (leanAnalysis)
+    {
+      AccumulateCube(coords, out);
+      return;
+    }
+
+    eaMSD.zeros(); // Zero the placeholders
+    ParallelFill(eaMSDall, 0., nJobs);
+    ParallelFill(taMSD, 0., nJobs);
+    eataMSD.zeros();
+    ParallelFill(eataMSDall, 0., nJobs);
+    ergodicity.zeros();
+
+    // For long walks / lots of walks, the analysis is the bottleneck,
+    // so we parallelize over nJobs using threading. The O(nSteps^2) TAMSD
+    // is split into tiles of (walk, block of lags), with the lag blocks
+    // chosen to have equal cost, so that a single long walk still uses
+    // every thread. Each tile writes its own entries, and the means are
+    // taken afterwards, so the results do not depend on nJobs. Noise-free
+    // walks are on the lattice, so their displacements are summed exactly
+    // in integer lattice coordinates.
+
+    uint64_t nBlocks = LagBlockCount(nSteps - 1, nWalks, nJobs);
+    arma::uvec lagEdges = LagBlockEdges(nSteps, nSteps - 1, nBlocks);
+    const bool exact = (noise == 0.);
+
+    auto &&func = [&](uint64_t t) {
+      if (Cancelled())
+      {
+        return;
+      }
+
+      uint64_t i = t / nBlocks;
+      uint64_t b = t % nBlocks;
+      if (exact)
+      {
+        const LatticeWalk lattice = OnLattice(coords.slice(i));
+        for (size_t j = lagEdges(b); j < lagEdges(b + 1); j++)
+        {
+          eaMSDall(j - 1, i) = lattice.SquaredDist(j, 0);
+          taMSD(j - 1, i) = LatticeTAMSD(lattice, i, j);
+        }
+        progress->Add(Progress::LAGS, lagEdges(b + 1) - lagEdges(b));
+        return;
+      }
+
+      arma::vec::fixed<2> walkOrigin, walkStep;
+      walkOrigin = coords.slice(i).col(0);
+      for (size_t j = lagEdges(b); j < lagEdges(b + 1); j++)
+      {
+        walkStep = coords.slice(i).col(j);
+        eaMSDall(j - 1, i) = SquaredDist(walkStep(0), walkOrigin(0),
+                                         walkStep(1), walkOrigin(1)); // Ensemble-average MSD
+        taMSD(j - 1, i) = TAMSD(coords.slice(i), nSteps, j);          // Time-average MSD
+      }
+      progress->Add(Progress::LAGS, lagEdges(b + 1) - lagEdges(b));
+    };
+
+    parallel(func, static_cast<uint64_t>(0), static_cast<uint64_t>(nWalks * nBlocks), nJobs);
+
+    auto &&prefix = [&](uint64_t i) {
+      if (Cancelled())
+      {
+        return;
+      }
+
+      // Ensemble-time-average MSD, TAMSD(walk, j, 1), from a running sum
+      const arma::Mat<T> &walk = coords.slice(i);
+      if (exact)
+      {
+        const LatticeWalk lattice = OnLattice(walk);
+        int64_t sumA = 0, sumB = 0;
+        for (size_t j = 1; j < nSteps; j++)
+        {
+          eataMSDall(j - 1, i) = lattice.Physical(sumA, sumB) / (j - 1);
+          lattice.Accumulate(j, j - 1, sumA, sumB);
+        }
+        return;
+      }
+
+      double integral = 0.;
+      for (size_t j = 1; j < nSteps; j++)
+      {
+        eataMSDall(j - 1, i) = integral / (j - 1);
+        integral += SquaredDist(walk(0, j), walk(0, j - 1),
+                                walk(1, j), walk(1, j - 1));
+      }
+    };
+
+    parallel(prefix, static_cast<uint64_t>(0), static_cast<uint64_t>(nWalks), nJobs);
+
+    eaMSD.elem(arma::find_nonfinite(eaMSD)).zeros(); // Check for NaNs
+    taMSD.elem(arma::find_nonfinite(taMSD)).zeros();
+    eaMSDall.elem(arma::find_nonfinite(eataMSDall)).zeros();
+
+    eaMSD = arma::mean(eaMSDall, 1); // Take means
+    eataMSD = arma::mean(eataMSDall, 1);
+
+    eataMSD.elem(arma::find_nonfinite(eataMSD)).zeros(); //  Check for NaNs
+
+    arma::mat meanTAMSD = arma::square(arma::mean(taMSD, 1));
+    arma::mat meanTAMSD2 = arma::mean(arma::square(taMSD), 1);
+
+    ergodicity = (meanTAMSD2 - meanTAMSD) / meanTAMSD; // Ergodicity breaking over s
+    ergodicity.elem(arma::find_nonfinite(ergodicity)).zeros();
+    ergodicity /= arma::regspace<arma::vec>(1, nSteps - 1);
+    ergodicity.elem(arma::find_nonfinite(ergodicity)).zeros();
+
+    out.col(0) = eaMSD;
+    out.col(1) = eataMSD;
+    out.col(2) = ergodicity;
+    out.cols(3, nWalks + 2) = taMSD;
+  }
+
+  void AddNoise()
+  {
+    if (noise > 0.0)
+    {
+      Log(0, "Adding noise...            ");
+      progress->Set(Progress::STAGE, Progress::NOISE);
+      t0 = GetTime();
+
+      NoiseCube(walksCoords);
+
+      t1 = GetTime();
+      Log(6, ElapsedSeconds(t0, t1), " s\n");
+    }
+  }
+
+  void NoiseCube(arma::Cube<T> &coords)
+  {
+    arma::Cube<T> noiseCube(size(coords));
+    std::normal_distribution<double> NormalDistribution(0, noise);
+    noiseCube.imbue([&]() { return NormalDistribution(RNG); });
+    coords += noiseCube;
+  }
+
+  void ThresholdWalks()
+  {
+    // Every threshold is represented at once by the occupation ranks,
+    // so walks at many thresholds share one percolation realization.
+    // Each walk has its own RNG stream and the walks are run in parallel.
+    Log(0, "Walking at thresholds...   ");
+    progress->Set(Progress::STAGE, Progress::THRESHOLDS);
+    t0 = GetTime();
+
+    uint64_t nThresholds = walkThresholds.n_elem;
+    arma::uvec cuts(nThresholds);
+    for (size_t k = 0; k < nThresholds; k++)
+    {
+      cuts(k) = OrderCount(walkThresholds(k));
+    }
+
+    orderRank.set_size(nOrder);
+    for (size_t i = 0; i < nOrder; i++)
+    {
+      orderRank(occupation(i)) = i;
+    }
+
+    if (walkType == 1)
+    {
+      LargestClustersAt(cuts);
+    }
+
+    thresholdWalks.set_size(2, nSteps, nWalks * nThresholds);
+    uint64_t streamSeed = RNG();
+
+    auto &&func = [&](uint64_t w) {
+      if (Cancelled())
+      {
+        return;
+      }
+
+      pcg64 rng(streamSeed, w);
+      RankWalk(rng, cuts(w / nWalks), w / nWalks, w);
+      progress->Add(Progress::WALKS, 1);
+      progress->Add(Progress::STEPS, nSteps);
+    };
+
+    parallel(func, static_cast<uint64_t>(0), static_cast<uint64_t>(nWalks * nThresholds), nJobs);
+
+    if (Cancelled())
+    {
+      orderRank.reset();
+      return;
+    }
+
+    if (noise > 0.0)
+    {
+      NoiseCube(thresholdWalks);
+    }
+
+    thresholdAnalysis.set_size(nSteps - 1, nWalks + 3, nThresholds);
+    for (size_t k = 0; k < nThresholds; k++)
+    {
+      const arma::Cube<T> coords(thresholdWalks.slice_memptr(k * nWalks), 2, nSteps, nWalks, false, true);
+      arma::Mat<T> out(thresholdAnalysis.slice_memptr(k), nSteps - 1, nWalks + 3, false, true);
+      AnalyseCube(coords, out);
+    }
+
+    orderRank.reset();
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+  }
+
+  void GroupClusters()
+  {
+    clusters = lattice;
+    int64_t j;
+    for (size_t i = 0; i < N; i++)
+    {
+      //PrintFixed(0, i, " ", clusters(i), " ");
+      j = GroupRoot(i);
+      if (clusters(i) >= 0)
+      {
+        clusters(i) = clusters(j);
+      }
+      //PrintFixed(0, j, " ", clusters(i), " ", clusters(j), "\n");
+    }
+  }
+
+  void Decompose()
+  {
+    // Split the largest cluster into its backbone and dangling ends. An
+    // iterative depth-first search (no recursion, so that it runs on
+    // 1E8-site lattices) finds the biconnected blocks of the cluster
+    // [Hopcroft-Tarjan], and flags a block as wrapping if one of its
+    // cycles winds around the periodic lattice. The backbone is the
+    // smallest subtree of the block-cut tree that joins all wrapping
+    // blocks or, if the cluster does not wrap, all blocks with a cycle.
+    // The labels are 1 on the backbone, 0 on dangling ends and -1 off
+    // the cluster.
+    Log(0, "Extracting backbone...     ");
+    t0 = GetTime();
+
+    if (gridSize < 3) // Smaller lattices have sites that neighbour each other twice
+    {
+      throw std::invalid_argument("The backbone needs a grid_size of at least 3");
+    }
+
+    backbone.set_size(N);
+    ParallelFill(backbone, static_cast<int64_t>(-1), nJobs);
+    residence.zeros(includeWalks ? nWalks : 0);
+
+    const int64_t root = LargestRoot();
+    if (root < 0)
+    {
+      t1 = GetTime();
+      Log(6, ElapsedSeconds(t0, t1), " s\n");
+      return;
+    }
+
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> order(N, 0), low(N, none); // low becomes the block of each site once it is in one
+    std::vector<int32_t> cellX(N, 0), cellY(N, 0);
+    std::vector<uint8_t> state(N, 0);                // Next neighbour slot, with the top bit for a winding cycle
+    std::vector<uint32_t> path, stack;               // Search path, and sites not yet in a block
+    std::vector<uint32_t> blockTop;                  // The site joining each block to its parent
+    std::vector<uint8_t> blockKind;                  // Bit 0: wraps, bit 1: has a cycle
+
+    uint32_t count = 1;
+    order[root] = low[root] = count++;
+    path.push_back(root);
+
+    while (!path.empty())
+    {
+      const uint32_t v = path.back();
+      const uint8_t j = state[v] & 0x7F;
+      if (j < neighbourCount)
+      {
+        state[v]++;
+        const uint32_t u = nn(j, v);
+        if (!((neighbourMask(v) >> j) & 1) || (path.size() > 1 && u == path[path.size() - 2]))
+        {
+          continue; // Not accessible, or the tree edge back to the parent
+        }
+
+        int32_t wx, wy;
+        Winding(v, u, wx, wy);
+        if (order[u] == 0)
+        {
+          order[u] = low[u] = count++;
+          cellX[u] = cellX[v] + wx;
+          cellY[u] = cellY[v] + wy;
+          path.push_back(u);
+          stack.push_back(u);
+        }
+        else if (order[u] < order[v]) // Back edge, closing a cycle in the block of v
+        {
+          low[v] = std::min(low[v], order[u]);
+          if (cellX[v] + wx != cellX[u] || cellY[v] + wy != cellY[u])
+          {
+            state[v] |= 0x80;
+          }
+        }
+        continue;
+      }
+
+      path.pop_back();
+      if (path.empty())
+      {
+        break;
+      }
+
+      const uint32_t p = path.back();
+      low[p] = std::min(low[p], low[v]);
+      if (low[v] >= order[p]) // p cuts off the subtree of v, which completes a block
+      {
+        const uint32_t b = blockTop.size();
+        uint8_t kind = 0;
+        uint32_t size = 1;
+        uint32_t x;
+        do
+        {
+          x = stack.back();
+          stack.pop_back();
+          kind |= state[x] >> 7;
+          low[x] = b;
+          size++;
+        } while (x != v);
+
+        blockTop.push_back(p);
+        blockKind.push_back(kind | ((size > 2) << 1));
+      }
+    }
+
+    std::vector<uint32_t>().swap(path);
+    std::vector<uint32_t>().swap(stack);
+    std::vector<int32_t>().swap(cellX);
+    std::vector<int32_t>().swap(cellY);
+    std::vector<uint8_t>().swap(state);
+
+    // Blocks were completed children first, so a single pass counts the
+    // terminal blocks below each one, and the branches (cut sites) they
+    // hang from. A block is on the backbone if it is a terminal, or if
+    // terminals lie both below and above it, or below two of its branches.
+    const uint64_t nBlocks = blockTop.size();
+    const bool wraps = std::any_of(blockKind.begin(), blockKind.end(), [](uint8_t k) { return k & 1; });
+    const uint8_t terminal = wraps ? 1 : 2;
+
+    uint64_t total = 0;
+    for (size_t b = 0; b < nBlocks; b++)
+    {
+      total += (blockKind[b] & terminal) != 0;
+    }
+
+    std::vector<uint32_t> weight(nBlocks, 0);
+    std::vector<uint8_t> branches(nBlocks, 0);
+    std::vector<uint32_t> &below = order; // Terminal blocks hanging below each site
+    std::fill(below.begin(), below.end(), 0);
+
+    for (size_t b = 0; b < nBlocks; b++)
+    {
+      weight[b] += (blockKind[b] & terminal) != 0;
+      const uint32_t p = blockTop[b];
+      if (weight[b] > 0 && static_cast<int64_t>(p) != root)
+      {
+        const uint32_t parent = low[p];
+        branches[parent] = std::min(branches[parent] + (below[p] == 0), 2);
+        weight[parent] += weight[b];
+      }
+      below[p] += weight[b];
+    }
+
+    for (size_t b = 0; b < nBlocks; b++)
+    {
+      branches[b] = (blockKind[b] & terminal) || (weight[b] > 0 && weight[b] < total) || (branches[b] > 1);
+    }
+
+    backbone(root) = 0;
+    for (size_t i = 0; i < N; i++)
+    {
+      if (low[i] != none && static_cast<int64_t>(i) != root)
+      {
+        backbone(i) = branches[low[i]];
+      }
+    }
+    for (size_t b = 0; b < nBlocks; b++)
+    {
+      if (branches[b])
+      {
+        backbone(blockTop[b]) = 1;
+      }
+    }
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+  }
+
+  T Spectrum(arma::Mat<T> &dos, const uint64_t nProbes, const uint64_t nLanczos,
+             const uint64_t nBins, const double fitMax)
+  {
+    // Density of states of the graph Laplacian L = D - A of the largest
+    // cluster, by stochastic Lanczos quadrature: each of nProbes random
+    // vectors, orthogonal to the constant zero mode, gives nLanczos Ritz
+    // values and weights. The probes run in parallel on their own RNG
+    // streams. At low eigenvalues the integrated density of states goes
+    // as lambda^(d_s / 2), so the spectral dimension d_s is twice the
+    // slope of a log-log fit up to fitMax. dos is (nBins, 3) over
+    // log-spaced bins: centre, density of states per site, and
+    // integrated density at the upper edge.
+    Log(0, "Lanczos spectrum...        ");
+    t0 = GetTime();
+
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> index(N, none), sites;
+    const int64_t root = LargestRoot();
+    if (root >= 0)
+    {
+      index[root] = 0;
+      sites.push_back(root);
+    }
+    for (size_t k = 0; k < sites.size(); k++) // Number the sites of the cluster breadth-first
+    {
+      const uint32_t v = sites[k];
+      for (size_t j = 0; j < neighbourCount; j++)
+      {
+        const uint32_t u = nn(j, v);
+        if (((neighbourMask(v) >> j) & 1) && index[u] == none)
+        {
+          index[u] = sites.size();
+          sites.push_back(u);
+        }
+      }
+    }
+
+    // The Laplacian in compressed rows: the degree of each row is its
+    // number of entries, so only the columns of -A are stored
+    const uint64_t n = sites.size();
+    std::vector<uint64_t> rowStart(n + 1, 0);
+    std::vector<uint32_t> cols;
+    cols.reserve(n * neighbourCount);
+    for (size_t k = 0; k < n; k++)
+    {
+      const uint32_t v = sites[k];
+      for (size_t j = 0; j < neighbourCount; j++)
+      {
+        const uint32_t u = nn(j, v);
+        if (((neighbourMask(v) >> j) & 1) && u != v) // A self-loop adds nothing to L
+        {
+          cols.push_back(index[u]);
+        }
+      }
+      rowStart[k + 1] = cols.size();
+    }
+    std::vector<uint32_t>().swap(index);
+    std::vector<uint32_t>().swap(sites);
+
+    dos.zeros(nBins, 3);
+    if (n < 2 || nProbes == 0 || nLanczos == 0 || nBins == 0)
+    {
+      return arma::Datum<T>::nan;
+    }
+
+    auto &&laplacian = [&](const arma::Col<T> &x, arma::Col<T> &y) {
+      for (size_t i = 0; i < n; i++)
+      {
+        T sum = (rowStart[i + 1] - rowStart[i]) * x(i);
+        for (size_t c = rowStart[i]; c < rowStart[i + 1]; c++)
+        {
+          sum -= x(cols[c]);
+        }
+        y(i) = sum;
+      }
+    };
+
+    const uint64_t m = std::min(nLanczos, n - 1);
+    arma::Mat<T> ritz(m, nProbes, arma::fill::zeros), weights(m, nProbes, arma::fill::zeros);
+    const uint64_t streamSeed = RNG();
+
+    auto &&probe = [&](uint64_t k) {
+      if (Cancelled())
+      {
+        return;
+      }
+
+      pcg64 rng(streamSeed, k);
+      std::normal_distribution<double> NormalDistribution(0., 1.);
+      arma::Col<T> v(n), vLast(n, arma::fill::zeros), w(n);
+      v.imbue([&]() { return NormalDistribution(rng); });
+      v -= arma::mean(v);
+      v /= arma::norm(v);
+
+      arma::Col<T> alpha(m), beta(m);
+      uint64_t steps = 0;
+      T b = 0.;
+      for (size_t j = 0; j < m; j++) // Three-term recurrence, without reorthogonalization
+      {
+        laplacian(v, w);
+        w -= b * vLast;
+        alpha(j) = arma::dot(w, v);
+        w -= alpha(j) * v;
+        b = arma::norm(w);
+        beta(j) = b;
+        steps++;
+        if (b < 1E-10) // The Krylov space is invariant, so the quadrature is exact
+        {
+          break;
+        }
+        std::swap(vLast, v);
+        v = w / b;
+      }
+
+      arma::Mat<T> tridiagonal(steps, steps, arma::fill::zeros);
+      tridiagonal.diag() = alpha.head(steps);
+      if (steps > 1)
+      {
+        tridiagonal.diag(1) = beta.head(steps - 1);
+        tridiagonal.diag(-1) = beta.head(steps - 1);
+      }
+
+      arma::Col<T> theta;
+      arma::Mat<T> vectors;
+      arma::eig_sym(theta, vectors, tridiagonal);
+      ritz.col(k).head(steps) = theta;
+      weights.col(k).head(steps) = arma::square(vectors.row(0).t());
+    };
+
+    parallel(probe, static_cast<uint64_t>(0), nProbes, nJobs);
+
+    // The n - 1 nonzero eigenvalues, as a fraction of the n sites
+    arma::uvec found = arma::find(weights > 0. && ritz > 1E-12);
+    arma::Col<T> theta = ritz.elem(found);
+    arma::Col<T> tau = weights.elem(found) * (static_cast<T>(n - 1) / n / nProbes);
+    if (theta.n_elem == 0)
+    {
+      return arma::Datum<T>::nan;
+    }
+
+    arma::uvec sorted = arma::sort_index(theta);
+    theta = theta.elem(sorted);
+    tau = arma::cumsum(tau.elem(sorted));
+
+    arma::Col<T> edges = arma::logspace<arma::Col<T>>(std::log10(theta.min()), std::log10(theta.max()), nBins + 1);
+    edges(nBins) = theta.max(); // Exact, so the last bin holds every eigenvalue
+    arma::Col<T> integrated(nBins + 1);
+    for (size_t b = 0; b <= nBins; b++)
+    {
+      auto last = std::upper_bound(theta.begin(), theta.end(), edges(b));
+      integrated(b) = (last == theta.begin()) ? 0. : tau(last - theta.begin() - 1);
+    }
+
+    std::vector<T> x, y;
+    for (size_t b = 0; b < nBins; b++)
+    {
+      dos(b, 0) = std::sqrt(edges(b) * edges(b + 1));
+      dos(b, 1) = (integrated(b + 1) - integrated(b)) / (edges(b + 1) - edges(b));
+      dos(b, 2) = integrated(b + 1);
+      if (edges(b + 1) <= fitMax && integrated(b + 1) > 0.)
+      {
+        x.push_back(std::log(edges(b + 1)));
+        y.push_back(std::log(integrated(b + 1)));
+      }
+    }
+
+    T dimension = arma::Datum<T>::nan;
+    if (x.size() > 1)
+    {
+      arma::Col<T> lx(x), ly(y);
+      lx -= arma::mean(lx);
+      dimension = 2. * arma::dot(lx, ly - arma::mean(ly)) / arma::dot(lx, lx);
+    }
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+
+    return dimension;
+  }
+
+  // Re-target later stages, so that a parameter sweep (or a cached
+  // lattice) can share the earlier ones (see CTRWsweep, CTRWcache)
+  void SetThreshold(const double p)
+  {
+    threshold = p;
+  }
+
+  void SetWalks(const uint64_t walkCount, const uint64_t steps, const double exponent, const double timescale)
+  {
+    nWalks = walkCount;
+    nSteps = steps;
+    beta = exponent;
+    tau0 = timescale;
+    includeWalks = ((nWalks > 0) && (nSteps > 0));
+    leanAnalysis = false;
+
+    if (memoryLimit > 0)
+    {
+      CheckMemory();
+    }
+    SizeWalkBuffers();
+  }
+
+  void SetNoise(const double sigma)
+  {
+    noise = sigma;
+  }
+
+  pcg64 &Generator()
+  {
+    return RNG;
+  }
+
+  const arma::imat &Neighbours() const
+  {
+    return nn;
+  }
+
+  void SetProgress(Progress &shared)
+  {
+    progress = &shared;
+  }
+
+  void SetVerbose(const bool timings)
+  {
+    verbose = timings;
+  }
+
+  void SetBackbone(const bool extract)
+  {
+    decompose = extract;
+    if (memoryLimit > 0)
+    {
+      CheckMemory();
+    }
+  }
+
+  void SetExtendable(const bool keep)
+  {
+    extendable = keep;
+    if (memoryLimit > 0)
+    {
+      CheckMemory();
+    }
+  }
+
+  // Carries on the walks of an extendable run, which stopped after
+  // previous.n_cols steps, up to nSteps. Each walk resumes its stream
+  // where it stopped, so the walks, and the TAMSD from the kept sums,
+  // are those of a single run of nSteps. The walks are independent, so
+  // they run in parallel.
+  void ExtendWalks(const arma::Cube<T> &previous, const arma::Mat<int64_t> &state,
+                   const arma::Col<T> &jumps, const arma::Mat<int64_t> &sums)
+  {
+    Log(0, "Extending random walks...  ");
+    progress->Set(Progress::STAGE, Progress::WALKING);
+    t0 = GetTime();
+
+    nAnalysed = previous.n_cols;
+    walkSeed = (nWalks > 0) ? static_cast<uint64_t>(state(5, 0)) : 0;
+    walkState = state;
+    nextJump = jumps;
+    if (sums.n_rows > 0)
+    {
+      lagSums.rows(0, sums.n_rows - 1) = sums;
+    }
+
+    auto &&func = [&](uint64_t i) {
+      if (Cancelled())
+      {
+        return;
+      }
+
+      walksCoords.slice(i).cols(0, nAnalysed - 1) = previous.slice(i);
+
+      pcg64 rng(walkSeed, i);
+      rng.advance(static_cast<uint64_t>(walkState(6, i)));
+      WalkState walk = LoadState(i);
+      LazySteps(rng, walk, [&](const int64_t p) { return neighbourMask(p); },
+                walksCoords, i, nAnalysed, true);
+      SaveState(i, walk, rng);
+
+      progress->Add(Progress::WALKS, 1);
+      progress->Add(Progress::STEPS, nSteps - nAnalysed);
+    };
+
+    parallel(func, static_cast<uint64_t>(0), nWalks, nJobs);
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+  };
+
+  // Multilevel splitting for the tail of the displacement distribution
+  // after steps - 1 steps. The walks are the lazy walks of an accelerate
+  // run with the same seed, but the first time a walker gets further from
+  // its start than the next of the increasing levels, it is split into
+  // nClones walkers that share its history, each with a fork of its RNG
+  // stream and 1 / nClones of its weight. A walker that crosses several
+  // levels in one hop is split once. Splitting at these stopping times
+  // leaves the expectation of any function of the walks unchanged, so the
+  // weighted sums over the walkers of each root walk are unbiased, but
+  // many more walkers reach the far tail. With nClones = 1, nothing is
+  // split and the estimates are those of plain Monte Carlo.
+  //
+  // tails is (nLevels, 4): the level, the probability that the final
+  // displacement is at least the level, its standard error over the root
+  // walks, and the number of walkers that crossed the level. density holds
+  // the probability of the final displacement in each bin of edges.
+  void SplitWalks(const uint64_t walkCount, const uint64_t steps, const arma::Col<T> &levels,
+                  const uint64_t nClones, const arma::Col<T> &edges, arma::Mat<T> &tails,
+                  arma::Col<T> &density)
+  {
+    Log(0, "Splitting random walks...  ");
+    progress->Set(Progress::STAGE, Progress::WALKING);
+    t0 = GetTime();
+
+    nWalks = walkCount; // Nothing is kept per step, so no walk buffers are sized
+    nSteps = steps;
+    const uint64_t nLevels = levels.n_elem;
+    const uint64_t nBins = (edges.n_elem > 1) ? edges.n_elem - 1 : 0;
+    const uint64_t nBlocks = std::min(nWalks, static_cast<uint64_t>(256));
+
+    simLength = (tau0 < 1.0) ? static_cast<uint64_t>(nSteps / tau0) : nSteps;
+    PossibleStartPoints();
+    walkSeed = RNG(); // As in RandomWalks, so the root walks are those of a run
+
+    // Per root walk, so the standard errors come from independent samples,
+    // and per fixed block of walks for the histogram and the counts, so
+    // the result does not depend on the number of threads
+    arma::Mat<T> rootTails(nLevels, nWalks, arma::fill::zeros);
+    arma::Mat<T> histogram(nBins, nBlocks, arma::fill::zeros);
+    arma::Mat<T> crossed(nLevels, nBlocks, arma::fill::zeros);
+
+    struct Walker
+    {
+      WalkState state;
+      pcg64 rng;
+      uint64_t step, level;
+      double weight;
+    };
+
+    auto &&func = [&](uint64_t b) {
+      std::exponential_distribution<double> ExponentialDistribution((beta > 0.) ? beta : 1.);
+      std::vector<Walker> stack;
+
+      for (size_t i = nWalks * b / nBlocks; i < nWalks * (b + 1) / nBlocks; i++)
+      {
+        if (Cancelled())
+        {
+          return;
+        }
+
+        pcg64 rng(walkSeed, i);
+        bool trapped;
+        const int64_t start = StartPoint(rng, trapped);
+        const T x0 = latticeCoords(0, start);
+        const T y0 = latticeCoords(1, start);
+        const WalkState first = FirstState(rng, start, trapped);
+        stack.push_back(Walker{first, rng, 0, 0, 1.});
+
+        auto &&displacement = [&](const WalkState &state) {
+          const T dx = latticeCoords(0, state.pos) + state.nxCell * unitCell(0) - x0;
+          const T dy = latticeCoords(1, state.pos) + state.nyCell * unitCell(1) - y0;
+          return std::sqrt(dx * dx + dy * dy);
+        };
+
+        while (!stack.empty()) // Depth first, so only one branch of clones is held at a time
+        {
+          Walker walker = std::move(stack.back());
+          stack.pop_back();
+          WalkState &state = walker.state;
+
+          T distance = displacement(state); // A clone split at the last step is already done
+          for (size_t j = walker.step; j < nSteps; j++)
+          {
+            LazyHop(walker.rng, state, [&](const int64_t p) { return neighbourMask(p); },
+                    j, ExponentialDistribution);
+            distance = displacement(state);
+
+            if (walker.level < nLevels && distance >= levels(walker.level))
+            {
+              while (walker.level < nLevels && distance >= levels(walker.level))
+              {
+                crossed(walker.level++, b) += 1.;
+              }
+
+              walker.weight /= nClones;
+              for (size_t c = 1; c < nClones; c++)
+              {
+                const uint64_t seed = walker.rng();
+                const uint64_t stream = walker.rng();
+                stack.push_back(Walker{state, pcg64(seed, stream), j + 1, walker.level, walker.weight});
+              }
+            }
+          }
+
+          for (size_t l = 0; l < nLevels && distance >= levels(l); l++)
+          {
+            rootTails(l, i) += walker.weight;
+          }
+
+          if (nBins > 0 && distance >= edges(0) && distance <= edges(nBins))
+          {
+            const uint64_t above = std::upper_bound(edges.begin(), edges.end(), distance) - edges.begin();
+            const uint64_t bin = std::min(above, nBins) - 1; // The last edge closes the last bin
+            histogram(bin, b) += walker.weight;
+          }
+
+          progress->Add(Progress::STEPS, nSteps - walker.step);
+        }
+
+        progress->Add(Progress::WALKS, 1);
+      }
+    };
+
+    parallel(func, static_cast<uint64_t>(0), nBlocks, nJobs);
+
+    tails.zeros(nLevels, 4);
+    density.zeros(nBins);
+    if (nWalks > 0)
+    {
+      tails.col(0) = levels;
+      tails.col(1) = arma::mean(rootTails, 1);
+      tails.col(2) = (nWalks > 1) ? arma::Col<T>(arma::stddev(rootTails, 0, 1) / std::sqrt(static_cast<T>(nWalks)))
+                                  : arma::Col<T>(nLevels, arma::fill::zeros);
+      tails.col(3) = arma::sum(crossed, 1);
+      density = arma::sum(histogram, 1) / static_cast<T>(nWalks);
+    }
+
+    t1 = GetTime();
+    Log(6, ElapsedSeconds(t0, t1), " s\n");
+  };
+
+  // Single walks with an exponent of their own, drawn from the caller's
+  // generator, for labelled datasets (see CTRWdataset). Hops are drawn
+  // lazily, as with accelerate, and nothing is analysed.
+  void StartSampling(const uint64_t steps, const double timescale)
+  {
+    nSteps = steps;
+    tau0 = timescale;
+    simLength = (tau0 < 1.0) ? static_cast<uint64_t>(nSteps / tau0) : nSteps;
+    PossibleStartPoints();
+  }
+
+  void SampleWalk(pcg64 &rng, const double exponent, arma::Cube<T> &coords, const uint64_t slice)
+  {
+    beta = exponent;
+    bool trapped;
+    int64_t pos = StartPoint(rng, trapped);
+    LazyWalk(rng, pos, trapped,
+             [&](const int64_t p) { return neighbourMask(p); },
+             coords, slice);
+  }
+
+  bool Cancelled() const
+  {
+    return progress->Cancelled();
+  }
+
+  // Bytes held by each buffer for this configuration, computed from the
+  // parameters alone, so it can be called before anything is allocated.
+  // Buffers of different stages are counted as if they coexisted.
+  std::vector<std::pair<std::string, uint64_t>> MemoryPlan() const
+  {
+    uint64_t nc = (latticeType == 1) ? 3 : 4;
+    uint64_t nSites = (latticeType == 1) ? 4 * gridSize * gridSize : gridSize * gridSize;
+    uint64_t nLinks = nSites * nc / 2;
+    uint64_t nElems = (percolationType == 1) ? nLinks : nSites;
+    uint64_t nRows = (latticeType == 1) ? 2 * gridSize : gridSize;
+    uint64_t nThresholds = walkThresholds.n_elem;
+
+    std::vector<std::pair<std::string, uint64_t>> plan;
+    auto &&add = [&](const std::string &name, const uint64_t bytes) {
+      if (bytes > 0)
+      {
+        plan.emplace_back(name, bytes);
+      }
+    };
+
+    add("nn", nc * nSites * sizeof(int64_t));
+    add("firstRow, lastRow", 2 * nRows * sizeof(int64_t));
+    add("rowEdges", nSites * sizeof(uint8_t));
+    add("lattice", nSites * sizeof(int64_t));
+    add("clusters", nSites * sizeof(int64_t));
+    add("occupation", nElems * sizeof(int64_t));
+    add("neighbourMask", nSites * sizeof(uint8_t));
+    add("latticeCoords", 2 * nSites * sizeof(T));
+    add("latticeOnes", nSites * sizeof(int64_t));
+
+    if (percolationType == 1)
+    {
+      add("bonds", 4 * nLinks * sizeof(int64_t));
+      add("slotBond", nc * nSites * sizeof(uint32_t));
+    }
+
+    if (sweep)
+    {
+      add("percolationSweep", 2 * nElems * sizeof(T));
+      add("latticeSnapshot", nSites * sizeof(int64_t));
+    }
+
+    if (decompose) // Six words and a byte per site for the search, and at most one block per site
+    {
+      add("backbone", nSites * sizeof(int64_t));
+      add("backboneSearch", nSites * (8 * sizeof(uint32_t) + 3 * sizeof(uint8_t)));
+      add("residence", includeWalks ? nWalks * sizeof(T) : 0);
+    }
+
+    if (!includeWalks)
+    {
+      return plan;
+    }
+
+    uint64_t len = (tau0 < 1.0) ? static_cast<uint64_t>(nSteps / tau0) : nSteps;
+    uint64_t lagWalks = leanAnalysis ? 0 : (nSteps - 1) * nWalks;
+
+    if (!accelerate && !dynamic && !exclusion)
+    {
+      add("workspace", WalkWorkspace::Bytes(len, nSteps));
+    }
+    if (extendable)
+    {
+      add("walkState, nextJump", nWalks * (7 * sizeof(int64_t) + sizeof(T)));
+      add("lagSums", 2 * (nSteps - 1) * nWalks * sizeof(int64_t));
+    }
+    add("walksCoords", 2 * nSteps * nWalks * sizeof(T));
+    add("analysis", (nSteps - 1) * (nWalks + 3) * sizeof(T));
+    add("eaMSD, eataMSD, ergodicity", (3 * nSteps - 2) * sizeof(T));
+    add("eaMSDall", lagWalks * sizeof(T));
+    add("taMSD", lagWalks * sizeof(T));
+    add("eataMSDall", lagWalks * sizeof(T));
+
+    if (noise > 0.)
+    {
+      add("noiseCube", 2 * nSteps * nWalks * (nThresholds + 1) * sizeof(T));
+    }
+
+    if (dynamic)
+    {
+      add("occupancyBits", (nElems + 63) / 64 * sizeof(uint64_t));
+    }
+
+    if (exclusion)
+    {
+      add("particleBits", (nSites + 63) / 64 * sizeof(uint64_t));
+      add("wheel", nWalks * (sizeof(T) + sizeof(uint64_t)) + nSteps * sizeof(std::vector<char>));
+    }
+
+    if (nThresholds > 0)
+    {
+      add("orderRank", nElems * sizeof(uint32_t));
+      add("thresholdStarts", (walkType == 1) ? nThresholds * nSites * sizeof(arma::uword) : 0);
+      add("thresholdWalks", 2 * nSteps * nWalks * nThresholds * sizeof(T));
+      add("thresholdAnalysis", (nSteps - 1) * (nWalks + 3) * nThresholds * sizeof(T));
+    }
+
+    return plan;
+  }
+
+  uint64_t PlannedBytes() const
+  {
+    uint64_t total = 0;
+    for (const auto &buffer : MemoryPlan())
+    {
+      total += buffer.second;
+    }
+    return total;
+  }
+
+  bool includeWalks, dynamic;
+  arma::Col<int64_t> lattice, clusters, backbone;
+  arma::Mat<T> latticeCoords, analysis, percolationSweep;
+  arma::Col<T> residence; // Observed steps of each walk on the backbone
+  arma::Mat<int64_t> walkState, lagSums; // Where each walk stopped, and its TAMSD sums, to extend it
+  arma::Col<T> nextJump;
+  arma::Cube<T> walksCoords, thresholdWalks, thresholdAnalysis;
+
+private:
+  uint64_t gridSize, latticeType, percolationType;
+  double threshold;
+  bool sweep;
+  uint64_t walkType, nWalks, nSteps;
+  double beta, tau0, noise;
+  bool accelerate;
+  arma::Col<T> walkThresholds;
+  double switchOn, switchOff;
+  bool dynamicClusters, exclusion;
+  uint64_t memoryLimit;
+  int64_t randomSeed, nJobs;
+  uint64_t seed;
+
+  Progress ownProgress;
+  Progress *progress;
+
+  std::unique_ptr<ZarrWriter> writer;
+  uint64_t chunkWalks, walksWritten;
+
+  bool verbose;      // Print the timing of each stage
+  bool leanAnalysis; // Accumulate the ensemble means instead of keeping (lag, walk) buffers
+  bool decompose;    // Extract the backbone of the largest cluster
+  bool extendable;   // Keep what is needed to carry the walks on later
+  uint64_t nAnalysed, walkSeed;
+  uint64_t N, nBonds, nOrder, simLength;
+  uint64_t big, sumSquares;
+  int64_t EMPTY;
+  uint8_t neighbourCount;
+
+  const double sqrt3 = 1.7320508075688772;
+  const double sqrt3o2 = 0.8660254037844386;
+
+  const uint32_t maxSites = 4294967294;      // Max uint32_t
+  const double permConstant = 2.3283064e-10; // Equal to 1 / maxSites (max uint32_t)
+
+  arma::ivec occupation, firstRow, lastRow, latticeOnes;
+  arma::imat nn, bonds;
+  arma::Col<uint8_t> neighbourMask, rowEdges;
+  arma::Col<uint32_t> orderRank;
+  arma::Mat<uint32_t> slotBond;
+  std::vector<arma::uvec> thresholdStarts;
+  std::vector<uint64_t> occupancyBits;
+  arma::Col<T> unitCell, latticeBasis, latticeMetric, eaMSD, eataMSD, ergodicity;
   arma::Mat<T> eaMSDall, eataMSDall, taMSD;
 
-  pcg64 RNG;
-  std::uniform_int_distribution<uint32_t> UniformDistribution{0, maxSites};
-  std::chrono::high_resolution_clock::time_point t0, t1;
+  WalkWorkspace workspace; // Reused by every walk of the full CTRW pipeline
+
+  pcg64 RNG;
+  std::uniform_int_distribution<uint32_t> UniformDistribution{0, maxSites};
+  std::chrono::high_resolution_clock::time_point t0, t1;
+
+  template <typename... Args>
+  void Log(const uint32_t precision, Args &&... args)
+  {
+    if (verbose)
+    {
+      PrintFixed(precision, std::forward<Args>(args)...);
+    }
+  };
+
+  int64_t StartPoint(pcg64 &rng, bool &trapped)
+  {
+    // A random start site with at least one accessible neighbour, or
+    // a trapped one if none is found within the maximum attempts
+    std::uniform_int_distribution<uint32_t> RandSample(0, static_cast<uint32_t>(latticeOnes.n_elem) - 1);
+
+    uint64_t countLoop = 0;
+    uint64_t countMax = std::min(N, static_cast<uint64_t>(1E6));
+    int64_t pos;
+
+    while (true)
+    {
+      pos = latticeOnes(RandSample(rng));
+      if (neighbourMask(pos) > 0 || countLoop >= countMax)
+      {
+        break;
+      }
+      countLoop++;
+    }
+
+    trapped = (countLoop == countMax);
+    return pos;
+  };
+
+  int64_t LargestRoot() const
+  {
+    // Root of the largest cluster, which holds minus its size, or -1 if
+    // every site is empty
+    int64_t root = -1;
+    for (size_t i = 0; i < N; i++)
+    {
+      if (lattice(i) < 0 && lattice(i) != EMPTY && (root < 0 || lattice(i) < lattice(root)))
+      {
+        root = i;
+      }
+    }
+    return root;
+  };
+
+  inline int64_t FindRoot(const int64_t i)
+  {
+    return (lattice(i) < 0) ? i : lattice(i) = FindRoot(lattice(i));
+  };
+
+  inline int64_t GroupRoot(const int64_t i)
+  {
+    return (clusters(i) < 0) ? i : clusters(i) = GroupRoot(clusters(i));
+  };
+
+  void AccumulateCube(const arma::Cube<T> &coords, arma::Mat<T> &out)
+  {
+    // Same statistics as AnalyseCube, to rounding, when the memory limit
+    // leaves no room for the (lag, walk) buffers: the TAMSD of each walk
+    // goes straight into out, and the ensemble means are accumulated.
+    uint64_t nBlocks = LagBlockCount(nSteps - 1, nWalks, nJobs);
+    arma::uvec lagEdges = LagBlockEdges(nSteps, nSteps - 1, nBlocks);
+    const bool exact = (noise == 0.);
+
+    auto &&func = [&](uint64_t t) {
+      if (Cancelled())
+      {
+        return;
+      }
+
+      uint64_t i = t / nBlocks;
+      uint64_t b = t % nBlocks;
+      const LatticeWalk lattice = exact ? OnLattice(coords.slice(i)) : LatticeWalk(1., 1., 1., 1.);
+      for (size_t j = lagEdges(b); j < lagEdges(b + 1); j++)
+      {
+        T value = exact ? LatticeTAMSD(lattice, i, j) : TAMSD(coords.slice(i), nSteps, j);
+        out(j - 1, i + 3) = std::isfinite(value) ? value : 0.;
+      }
+      progress->Add(Progress::LAGS, lagEdges(b + 1) - lagEdges(b));
+    };
+
+    parallel(func, static_cast<uint64_t>(0), static_cast<uint64_t>(nWalks * nBlocks), nJobs);
+
+    arma::Col<T> sumMSD(nSteps - 1, arma::fill::zeros);
+    arma::Col<T> sumTAMSD(nSteps - 1, arma::fill::zeros);
+    arma::Col<T> sumTAMSD2(nSteps - 1, arma::fill::zeros);
+    eataMSD.zeros();
+
+    for (size_t i = 0; i < nWalks; i++) // Walks in order, so the sums do not depend on nJobs
+    {
+      double integral = 0.;
+      int64_t sumA = 0, sumB = 0;
+      const arma::Mat<T> &walk = coords.slice(i);
+      const LatticeWalk lattice = exact ? OnLattice(walk) : LatticeWalk(1., 1., 1., 1.);
+      for (size_t j = 1; j < nSteps; j++)
+      {
+        T eata = (exact ? lattice.Physical(sumA, sumB) : integral) / (j - 1);
+        if (std::isfinite(eata)) // As in AnalyseCube, a lag without an EATAMSD adds no MSD
+        {
+          sumMSD(j - 1) += exact ? lattice.SquaredDist(j, 0)
+                                 : SquaredDist(walk(0, j), walk(0, 0), walk(1, j), walk(1, 0));
+        }
+        eataMSD(j - 1) += eata;
+        if (exact)
+        {
+          lattice.Accumulate(j, j - 1, sumA, sumB);
+        }
+        else
+        {
+          integral += SquaredDist(walk(0, j), walk(0, j - 1),
+                                  walk(1, j), walk(1, j - 1));
+        }
+      }
+      sumTAMSD += out.col(i + 3);
+      sumTAMSD2 += arma::square(out.col(i + 3));
+    }
+
+    eaMSD = sumMSD / nWalks;
+    eataMSD /= nWalks;
+    eataMSD.elem(arma::find_nonfinite(eataMSD)).zeros();
+
+    arma::Col<T> meanTAMSD = arma::square(sumTAMSD / nWalks);
+    ergodicity = (sumTAMSD2 / nWalks - meanTAMSD) / meanTAMSD;
+    ergodicity.elem(arma::find_nonfinite(ergodicity)).zeros();
+    ergodicity /= arma::regspace<arma::vec>(1, nSteps - 1);
+    ergodicity.elem(arma::find_nonfinite(ergodicity)).zeros();
+
+    out.col(0) = eaMSD;
+    out.col(1) = eataMSD;
+    out.col(2) = ergodicity;
+  };
+
+  T LatticeTAMSD(const LatticeWalk &lattice, const uint64_t i, const uint64_t j)
+  {
+    // TAMSD of walk i at lag j. When the walks can be extended, the sums
+    // are kept, and only the terms that end after the nAnalysed steps
+    // already in them are added, which gives the same integers.
+    if (lagSums.is_empty())
+    {
+      return lattice.LagSum(j) / (nSteps - j);
+    }
+
+    int64_t &sumA = lagSums(2 * j - 2, i);
+    int64_t &sumB = lagSums(2 * j - 1, i);
+    lattice.AccumulateLag(j, (nAnalysed > j) ? nAnalysed - j : 0, sumA, sumB);
+    return lattice.Physical(sumA, sumB) / (nSteps - j);
+  };
+
+  LatticeWalk OnLattice(const arma::Mat<T> &walk) const
+  {
+    LatticeWalk lattice(latticeBasis(0), latticeBasis(1), latticeMetric(0), latticeMetric(1));
+    lattice.Assign(walk.memptr(), walk.n_cols);
+    return lattice;
+  };
+
+  inline bool TickSites(const uint64_t i)
+  {
+    progress->Set(Progress::SITES, i);
+    return Cancelled();
+  };
+
+  inline bool TickWalks(const uint64_t i)
+  {
+    progress->Set(Progress::WALKS, i);
+    progress->Set(Progress::STEPS, i * nSteps);
+    return Cancelled();
+  };
+
+  void CheckMemory()
+  {
+    // Over the limit, first drop the (lag, walk) analysis buffers in
+    // favour of accumulating the ensemble means, then give up
+    if (PlannedBytes() > memoryLimit && includeWalks)
+    {
+      leanAnalysis = true;
+    }
+
+    if (PlannedBytes() <= memoryLimit)
+    {
+      return;
+    }
+
+    auto plan = MemoryPlan();
+    std::sort(plan.begin(), plan.end(),
+              [](const std::pair<std::string, uint64_t> &a, const std::pair<std::string, uint64_t> &b) {
+                return a.second > b.second;
+              });
+
+    std::ostringstream msg;
+    msg << "The configuration needs " << PlannedBytes() << " bytes, more than the memory limit of "
+        << memoryLimit << " bytes. Largest buffers: ";
+    for (size_t i = 0; i < std::min(plan.size(), static_cast<size_t>(3)); i++)
+    {
+      msg << ((i > 0) ? ", " : "") << plan[i].first << " (" << plan[i].second << " bytes)";
+    }
+    msg << ". Reduce n_walks, n_steps or grid_size, or raise the memory limit.";
+    throw std::runtime_error(msg.str());
+  };
+
+  void SizeWalkBuffers()
+  {
+    includeWalks = ((nWalks > 0) && (nSteps > 0));
+
+    if (includeWalks)
+    {
+      simLength = (tau0 < 1.0) ? static_cast<uint64_t>(nSteps / tau0) : nSteps;
+
+      eaMSD.set_size(nSteps);
+      eaMSDall.set_size(leanAnalysis ? 0 : nSteps - 1, nWalks);
+      taMSD.set_size(leanAnalysis ? 0 : nSteps - 1, nWalks);
+      eataMSD.set_size(nSteps - 1);
+      eataMSDall.set_size(leanAnalysis ? 0 : nSteps - 1, nWalks);
+      ergodicity.set_size(nSteps - 1);
+      analysis.set_size(nSteps - 1, nWalks + 3);
+      walksCoords.set_size(2, nSteps, nWalks);
+      walkState.set_size(extendable ? 7 : 0, extendable ? nWalks : 0);
+      nextJump.set_size(extendable ? nWalks : 0);
+      lagSums.set_size(extendable ? 2 * (nSteps - 1) : 0, extendable ? nWalks : 0);
+
+      ParallelFill(lagSums, static_cast<int64_t>(0), nJobs);
+      ParallelFill(eaMSDall, 0., nJobs); // Interleave the per-walk buffers by first touch
+      ParallelFill(taMSD, 0., nJobs);
+      ParallelFill(eataMSDall, 0., nJobs);
+      ParallelFill(analysis, 0., nJobs);
+      ParallelFill(walksCoords, 0., nJobs);
+    }
+    else
+    {
+      simLength = 0;
+
+      workspace.Release();
+      eaMSD.set_size(0);
+      eaMSDall.set_size(0, 0);
+      taMSD.set_size(0, 0);
+      eataMSD.set_size(0);
+      eataMSDall.set_size(0, 0);
+      ergodicity.set_size(0);
+      analysis.set_size(0, 0);
+      walksCoords.set_size(0, 0, 0);
+      walkState.set_size(0, 0);
+      nextJump.set_size(0);
+      lagSums.set_size(0, 0);
+    }
+  };
+
+  void PossibleStartPoints()
+  {
+    latticeOnes = arma::regspace<arma::ivec>(0, N - 1);
+
+    // Set up selection of random start point
+    //  - walkType = 1 : on largest cluster, or
+    //  - walkType = 0 : on ALL clusters
+    if (walkType == 1)
+    {
+      int64_t latticeMin = lattice.elem(find(lattice > EMPTY)).min();
+      arma::uvec idxMin = arma::find(lattice == latticeMin);
+      arma::uvec largestCluster = arma::find(lattice == idxMin(0));
+      uint64_t largestClusterSize = largestCluster.n_elem + 1;
+      largestCluster.resize(largestClusterSize);
+      largestCluster(largestClusterSize - 1) = idxMin(0);
+      latticeOnes = latticeOnes.elem(largestCluster);
+    }
+    else
+    {
+      latticeOnes = latticeOnes.elem(find(lattice != EMPTY));
+    }
+  };
+
+  uint64_t ChunkLength(const uint64_t rowBytes) const
+  {
+    // Rows per chunk for chunks of about 4 MiB
+    return std::max(static_cast<uint64_t>(1), static_cast<uint64_t>(4194304) / rowBytes);
+  };
+
+  template <typename E>
+  static std::string DataType()
+  {
+    return std::is_integral<E>::value ? "<i8" : "<f8";
+  };
+
+  template <typename E>
+  void WriteArray(const std::string &name, const E *data,
+                  const std::vector<uint64_t> &shape,
+                  const size_t outer, const char order = 'C')
+  {
+    // Chunk along the slowest-varying axis, i.e. the first axis for
+    // C order or the last axis for Fortran order
+    uint64_t inner = 1;
+    for (size_t k = 0; k < shape.size(); k++)
+    {
+      inner *= (k == outer) ? 1 : shape[k];
+    }
+
+    std::vector<uint64_t> chunks = shape;
+    chunks[outer] = std::min(ChunkLength(inner * sizeof(E)), std::max(shape[outer], static_cast<uint64_t>(1)));
+    writer->CreateArray(name, shape, chunks, DataType<E>(), order);
+
+    std::vector<uint64_t> index(shape.size(), 0);
+    for (uint64_t first = 0; first < shape[outer]; first += chunks[outer])
+    {
+      index[outer] = first / chunks[outer];
+      uint64_t rows = std::min(chunks[outer], shape[outer] - first);
+      writer->WriteChunk(name, index, data + first * inner,
+                         rows * inner * sizeof(E), chunks[outer] * inner * sizeof(E));
+    }
+  };
+
+  void StreamWalks(const uint64_t done)
+  {
+    // Hand every complete chunk of walks (or the final one) to the writer
+    if (!writer || !includeWalks)
+    {
+      return;
+    }
+
+    uint64_t chunkBytes = chunkWalks * 2 * nSteps * sizeof(T);
+    while (walksWritten < done && (walksWritten + chunkWalks <= done || done == nWalks))
+    {
+      uint64_t count = std::min(chunkWalks, nWalks - walksWritten);
+      writer->WriteChunk("walks", {walksWritten / chunkWalks, 0, 0}, walksCoords.slice_memptr(walksWritten),
+                         count * 2 * nSteps * sizeof(T), chunkBytes);
+      walksWritten += count;
+    }
+  };
+
+  inline int64_t Hop(pcg64 &rng, const int64_t pos, const uint8_t mask)
+  {
+    // Pick the k-th accessible neighbour from the bitmask
+    std::uniform_int_distribution<uint32_t> RandChoice(0, static_cast<uint32_t>(maskCount[mask]) - 1);
+    return nn(maskSlot[mask][RandChoice(rng)], pos);
+  };
+
+  inline uint8_t BoundaryCrossed(const int64_t posLast, const int64_t pos)
+  {
+    int64_t boundary1 = static_cast<int64_t>(gridSize);
+    int64_t boundary2 = static_cast<int64_t>(N) - boundary1;
+
+    if ((rowEdges(posLast) & 1) && (rowEdges(pos) & 2)) // Walks that hit the top boundary
+    {
+      return 1;
+    }
+    else if ((rowEdges(posLast) & 2) && (rowEdges(pos) & 1)) // Walks that hit the bottom boundary
+    {
+      return 2;
+    }
+    else if (posLast >= boundary2 && pos < boundary1) // Walks that hit the right boundary
+    {
+      return 3;
+    }
+    else if (posLast < boundary1 && pos >= boundary2) // Walks that hit the left boundary
+    {
+      return 4;
+    }
+    return 0;
+  };
+
+  inline void UpdateCell(const uint64_t boundary, int64_t &nxCell, int64_t &nyCell)
+  {
+    switch (boundary)
+    {
+    case 1:
+      nyCell++;
+      break;
+    case 2:
+      nyCell--;
+      break;
+    case 3:
+      nxCell++;
+      break;
+    case 4:
+      nxCell--;
+      break;
+    case 0:
+    default:
+      break;
+    }
+  };
+
+  inline uint8_t DynamicMask(const int64_t pos) const
+  {
+    // Accessible neighbours in the current dynamic configuration
+    uint8_t mask = 0;
+    for (size_t j = 0; j < neighbourCount; j++)
+    {
+      mask |= GetBit(occupancyBits, (percolationType == 1) ? slotBond(j, pos) : nn(j, pos)) << j;
+    }
+    return mask;
+  };
+
+  struct WalkState
+  {
+    // Where a lazily drawn walk stopped: its site, the unit cell it is
+    // in, the hops made and the time of the next one
+    int64_t pos, nxCell, nyCell;
+    uint64_t hops;
+    double tNext;
+    bool trapped;
+  };
+
+  template <typename Mask>
+  WalkState LazyWalk(pcg64 &rng, int64_t pos, const bool trapped, Mask &&getMask,
+                     arma::Cube<T> &coords, const uint64_t slice, const bool reside = false)
+  {
+    // Waiting times are drawn one at a time, and the walker only hops when
+    // a wait has elapsed, so none of the hops after the last observed time
+    // are simulated. The statistics are identical to the full pipeline,
+    // but the cost scales with the number of observed hops, not simLength.
+    WalkState state = FirstState(rng, pos, trapped);
+    LazySteps(rng, state, getMask, coords, slice, 0, reside);
+    return state;
+  };
+
+  WalkState FirstState(pcg64 &rng, const int64_t pos, const bool trapped)
+  {
+    // A lazy walk at its start site, with the time of its first hop
+    std::exponential_distribution<double> ExponentialDistribution((beta > 0.) ? beta : 1.);
+
+    WalkState state;
+    state.pos = pos;
+    state.nxCell = 0;
+    state.nyCell = 0;
+    state.hops = 0;
+    state.tNext = (beta > 0.) ? tau0 * std::exp(ExponentialDistribution(rng)) : 1.;
+    state.trapped = trapped;
+    return state;
+  };
+
+  template <typename Mask>
+  void LazySteps(pcg64 &rng, WalkState &state, Mask &&getMask, arma::Cube<T> &coords,
+                 const uint64_t slice, const uint64_t first, const bool reside)
+  {
+    // Steps first to nSteps - 1 of a lazy walk, from its state
+    std::exponential_distribution<double> ExponentialDistribution((beta > 0.) ? beta : 1.);
+
+    for (size_t j = first; j < nSteps; j++)
+    {
+      LazyHop(rng, state, getMask, j, ExponentialDistribution);
+      coords(0, j, slice) = latticeCoords(0, state.pos) + state.nxCell * unitCell(0);
+      coords(1, j, slice) = latticeCoords(1, state.pos) + state.nyCell * unitCell(1);
+      if (reside)
+      {
+        Reside(slice, state.pos);
+      }
+    }
+  };
+
+  template <typename Mask>
+  inline void LazyHop(pcg64 &rng, WalkState &state, Mask &&getMask, const uint64_t j,
+                      std::exponential_distribution<double> &ExponentialDistribution)
+  {
+    // The hop of a lazy walk before step j, if its wait has elapsed
+    if (!state.trapped && (j > state.tNext) && (state.hops + 1 < simLength))
+    {
+      const int64_t posLast = state.pos;
+      state.pos = Hop(rng, state.pos, getMask(state.pos));
+      UpdateCell(BoundaryCrossed(posLast, state.pos), state.nxCell, state.nyCell);
+
+      state.hops++;
+      state.tNext = (beta > 0.) ? state.tNext + tau0 * std::exp(ExponentialDistribution(rng)) : state.hops + 1;
+    }
+  };
+
+  void SaveState(const uint64_t i, const WalkState &state, const pcg64 &rng)
+  {
+    // One column per walk: site, unit cell, hops, trapped, and the seed
+    // and number of draws of its stream, with the next hop time apart
+    if (!extendable)
+    {
+      return;
+    }
+
+    walkState(0, i) = state.pos;
+    walkState(1, i) = state.nxCell;
+    walkState(2, i) = state.nyCell;
+    walkState(3, i) = static_cast<int64_t>(state.hops);
+    walkState(4, i) = state.trapped;
+    walkState(5, i) = static_cast<int64_t>(walkSeed);
+    walkState(6, i) = static_cast<int64_t>(static_cast<uint64_t>(rng - pcg64(walkSeed, i)));
+    nextJump(i) = state.tNext;
+  };
+
+  WalkState LoadState(const uint64_t i) const
+  {
+    WalkState state;
+    state.pos = walkState(0, i);
+    state.nxCell = walkState(1, i);
+    state.nyCell = walkState(2, i);
+    state.hops = static_cast<uint64_t>(walkState(3, i));
+    state.trapped = (walkState(4, i) != 0);
+    state.tNext = nextJump(i);
+    return state;
+  };
+
+  inline void Reside(const uint64_t i, const int64_t pos)
+  {
+    // Count the steps of walk i on the backbone, once it is extracted
+    if (!backbone.is_empty())
+    {
+      residence(i) += (backbone(pos) == 1);
+    }
+  };
+
+  inline void Winding(const int64_t from, const int64_t to, int32_t &wx, int32_t &wy) const
+  {
+    // Unit cells crossed by the bond between two neighbouring sites
+    const T dx = latticeCoords(0, to) - latticeCoords(0, from);
+    const T dy = latticeCoords(1, to) - latticeCoords(1, from);
+    wx = (dx > 0.5 * unitCell(0)) ? -1 : (dx < -0.5 * unitCell(0)) ? 1 : 0;
+    wy = (dy > 0.5 * unitCell(1)) ? -1 : (dy < -0.5 * unitCell(1)) ? 1 : 0;
+  };
+
+  inline uint8_t RankMask(const int64_t pos, const uint64_t nCut)
+  {
+    // Accessible neighbours at a threshold, tested from the occupation ranks
+    uint8_t mask = 0;
+    if (percolationType == 1)
+    {
+      for (size_t j = 0; j < neighbourCount; j++)
+      {
+        mask |= (orderRank(slotBond(j, pos)) < nCut) << j;
+      }
+    }
+    else if (orderRank(pos) < nCut)
+    {
+      for (size_t j = 0; j < neighbourCount; j++)
+      {
+        mask |= (orderRank(nn(j, pos)) < nCut) << j;
+      }
+    }
+    return mask;
+  };
+
+  void RankWalk(pcg64 &rng, const uint64_t nCut, const uint64_t k, const uint64_t w)
+  {
+    uint64_t countLoop = 0;
+    uint64_t countMax = std::min(N, static_cast<uint64_t>(1E6));
+    int64_t pos = 0;
+
+    if (walkType == 1) // Start on the largest cluster at this threshold
+    {
+      const arma::uvec &starts = thresholdStarts[k];
+      std::uniform_int_distribution<uint64_t> RandSample(0, std::max(starts.n_elem, static_cast<arma::uword>(1)) - 1);
+      do
+      {
+        pos = (starts.n_elem > 0) ? starts(RandSample(rng)) : 0;
+      } while (RankMask(pos, nCut) == 0 && ++countLoop < countMax);
+    }
+    else // Start on any site that is occupied at this threshold
+    {
+      std::uniform_int_distribution<uint64_t> RandSample(0, N - 1);
+      do
+      {
+        pos = RandSample(rng);
+      } while (RankMask(pos, nCut) == 0 && ++countLoop < countMax);
+    }
+
+    LazyWalk(rng, pos, countLoop == countMax,
+             [&](const int64_t p) { return RankMask(p, nCut); },
+             thresholdWalks, w);
+  };
+
+  void LargestClustersAt(const arma::uvec &cuts)
+  {
+    // One further percolation pass in the same order, collecting
+    // the sites of the largest cluster as each cut is reached
+    arma::Col<int64_t> latticeBackup = lattice;
+    uint64_t bigBackup = big;
+    uint64_t sumSquaresBackup = sumSquares;
+
+    arma::uvec order = arma::sort_index(cuts);
+    thresholdStarts.assign(cuts.n_elem, arma::uvec());
+    ResetLattice();
+
+    uint64_t added = 0;
+    for (size_t m = 0; m < order.n_elem; m++)
+    {
+      uint64_t k = order(m);
+      for (; added < cuts(k); added++)
+      {
+        AddElement(added);
+      }
+
+      int64_t root = -1;
+      for (size_t i = 0; i < N; i++) // Root with the most negative size
+      {
+        if (lattice(i) < 0 && lattice(i) != EMPTY && (root < 0 || lattice(i) < lattice(root)))
+        {
+          root = i;
+        }
+      }
+
+      if (root >= 0)
+      {
+        std::vector<arma::uword> members;
+        for (size_t i = 0; i < N; i++)
+        {
+          if (lattice(i) != EMPTY && FindRoot(i) == root)
+          {
+            members.push_back(i);
+          }
+        }
+        thresholdStarts[k] = arma::uvec(members);
+      }
+    }
+
+    lattice = latticeBackup;
+    big = bigBackup;
+    sumSquares = sumSquaresBackup;
+  };
+
+  uint64_t OrderCount(const double p) const
+  {
+    // Number of sites (or bonds) occupied at threshold p,
+    // i.e. the count of integers i satisfying i < (p * nOrder) - 1
+    double last = (p * nOrder) - 1;
+    return (last > 0) ? std::min(static_cast<uint64_t>(std::ceil(last)), nOrder) : 0;
+  };
+
+  int64_t MergeRoots(int64_t r1, int64_t r2)
+  {
+    // Weighted union of two distinct roots, returning the new root
+    uint64_t size1 = -lattice(r1);
+    uint64_t size2 = -lattice(r2);
+
+    if (lattice(r1) > lattice(r2))
+    {
+      lattice(r2) += lattice(r1);
+      lattice(r1) = r2;
+      r1 = r2;
+    }
+    else
+    {
+      lattice(r1) += lattice(r2);
+      lattice(r2) = r1;
+    }
+    if (-lattice(r1) > static_cast<int64_t>(big))
+    {
+      big = -lattice(r1);
+    }
+
+    sumSquares += 2 * size1 * size2; // (a + b)^2 = a^2 + b^2 + 2ab
+    return r1;
+  };
+
+  void RecordSweep(const uint64_t i)
+  {
+    percolationSweep(i, 0) = big;
+    percolationSweep(i, 1) = static_cast<T>(sumSquares) / N;
+  };
+
+  void ResetLattice()
+  {
+    big = 0;
+    if (percolationType == 1)
+    {
+      sumSquares = N;
+      big = 1;
+      ParallelFill(lattice, -1, nJobs); // Every site is present, initially as its own cluster
+    }
+    else
+    {
+      sumSquares = 0;
+      ParallelFill(lattice, EMPTY, nJobs);
+    }
+  };
+
+  inline void AddElement(const uint64_t i)
+  {
+    if (percolationType == 1)
+    {
+      AddBond(occupation[i]);
+    }
+    else
+    {
+      AddSite(occupation[i]);
+    }
+  };
+
+  inline void AddSite(const int64_t s1)
+  {
+    int64_t s2;
+    int64_t r1, r2;
+
+    r1 = s1;
+    lattice(s1) = -1;
+    sumSquares += 1;
+    big = std::max(big, static_cast<uint64_t>(1));
+
+    for (size_t j = 0; j < neighbourCount; j++)
+    {
+      s2 = nn(j, s1);
+      if (lattice(s2) != EMPTY)
+      {
+        r2 = FindRoot(s2);
+        if (r2 != r1)
+        {
+          r1 = MergeRoots(r1, r2);
+        }
+      }
+    }
+  };
+
+  inline void AddBond(const int64_t b)
+  {
+    int64_t r1 = FindRoot(bonds(0, b));
+    int64_t r2 = FindRoot(bonds(1, b));
+    if (r2 != r1)
+    {
+      MergeRoots(r1, r2);
+    }
+  };
+
+  void PercolateSites()
+  {
+    uint64_t nOccupied = OrderCount(threshold);
+    uint64_t nAdd = sweep ? nOrder : nOccupied;
+    arma::Col<int64_t> latticeSnapshot;
+
+    ResetLattice();
+
+    for (uint64_t i = 0; i < nAdd; i++)
+    {
+      if (i % Progress::blockSize == 0 && TickSites(i))
+      {
+        nAdd = i;
+        break;
+      }
+
+      if (i == nOccupied) // Keep the state at the threshold while sweeping all p
+      {
+        latticeSnapshot = lattice;
+      }
+
+      AddSite(occupation[i]);
+
+      if (sweep)
+      {
+        RecordSweep(i);
+      }
+    }
+
+    progress->Set(Progress::SITES, nAdd);
+
+    if (nOccupied < nAdd)
+    {
+      lattice = latticeSnapshot;
+    }
+
+    ParallelFill(neighbourMask, 0, nJobs); // Walkers may step onto any occupied neighbour
+    for (size_t i = 0; i < N; i++)
+    {
+      if (lattice(i) != EMPTY)
+      {
+        for (size_t j = 0; j < neighbourCount; j++)
+        {
+          if (lattice(nn(j, i)) != EMPTY)
+          {
+            neighbourMask(i) |= (1 << j);
+          }
+        }
+      }
+    }
+  };
+
+  void PercolateBonds()
+  {
+    uint64_t b;
+
+    uint64_t nOpen = OrderCount(threshold);
+    uint64_t nAdd = sweep ? nOrder : nOpen;
+    arma::Col<int64_t> latticeSnapshot;
+
+    ResetLattice();
+    ParallelFill(neighbourMask, 0, nJobs);
+
+    for (uint64_t i = 0; i < nAdd; i++)
+    {
+      if (i % Progress::blockSize == 0 && TickSites(i))
+      {
+        nAdd = i;
+        break;
+      }
+
+      if (i == nOpen)
+      {
+        latticeSnapshot = lattice;
+      }
+
+      b = occupation[i];
+      if (i < nOpen) // Walkers may only cross open bonds
+      {
+        neighbourMask(bonds(0, b)) |= (1 << bonds(2, b));
+        neighbourMask(bonds(1, b)) |= (1 << bonds(3, b));
+      }
+
+      AddBond(b);
+
+      if (sweep)
+      {
+        RecordSweep(i);
+      }
+    }
+
+    progress->Set(Progress::SITES, nAdd);
+
+    if (nOpen < nAdd)
+    {
+      lattice = latticeSnapshot;
+    }
+  };
+
+  void FindBonds()
+  {
+    // Each bond is listed once as (site, neighbour, slot in site, slot in neighbour)
+    int64_t s2;
+
+    nBonds = 0;
+    for (size_t i = 0; i < N; i++)
+    {
+      for (size_t j = 0; j < neighbourCount; j++)
+      {
+        nBonds += (static_cast<int64_t>(i) < nn(j, i)) ? 1 : 0;
+      }
+    }
+
+    bonds.set_size(4, nBonds);
+    slotBond.set_size(neighbourCount, N);
+    ParallelFill(bonds, 0, nJobs);
+    ParallelFill(slotBond, 0, nJobs);
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < N; i++)
+    {
+      for (size_t j = 0; j < neighbourCount; j++)
+      {
+        s2 = nn(j, i);
+        if (static_cast<int64_t>(i) < s2)
+        {
+          bonds(0, count) = i;
+          bonds(1, count) = s2;
+          bonds(2, count) = j;
+          slotBond(j, i) = count;
+          bool reverse = false;
+          for (size_t k = 0; k < neighbourCount; k++)
+          {
+            if (nn(k, s2) == static_cast<int64_t>(i))
+            {
+              bonds(3, count) = k;
+              slotBond(k, s2) = count;
+              reverse = true;
+            }
+          }
+          if (!reverse) // The slot is used as a shift, so it must exist
+          {
+            throw std::runtime_error("Site " + std::to_string(s2) + " does not list its neighbour " +
+                                     std::to_string(i) + " back");
+          }
+          count++;
+        }
+      }
+    }
+  };
+
+  template <typename Grid>
+  void LatticeCoordinates(const Grid &grid)
+  {
+    for (size_t i = 0; i < N; i++)
+    {
+      const uint64_t col = grid.Column(i);
+      const uint64_t row = grid.Row(i);
+
+      if (latticeType == 1) // Populate honeycomb lattice coordinates
+      {
+        const double xOffset = 3. * (col >> 2);
+        const double yOffset = (gridSize - row - 1) * sqrt3; // Count from top to bottom
+
+        switch (col & 3)
+        {
+        case 0:
+        default:
+          latticeCoords(0, i) = xOffset;
+          latticeCoords(1, i) = yOffset + sqrt3o2;
+          break;
+        case 1:
+          latticeCoords(0, i) = xOffset + 0.5;
+          latticeCoords(1, i) = yOffset;
+          break;
+        case 2:
+          latticeCoords(0, i) = xOffset + 1.5;
+          latticeCoords(1, i) = yOffset;
+          break;
+        case 3:
+          latticeCoords(0, i) = xOffset + 2.0;
+          latticeCoords(1, i) = yOffset + sqrt3o2;
+          break;
+        }
+      }
+      else // Populate square lattice coordinates
+      {
+        latticeCoords(0, i) = col;
+        latticeCoords(1, i) = row;
+      }
+    }
+  };
+
+  void BoundariesHoneycomb()
+  {
+    if (IsPowerOfTwo(gridSize))
+    {
+      BoundariesHoneycomb(PowerOfTwoGrid(gridSize, N));
+    }
+    else
+    {
+      BoundariesHoneycomb(GenericGrid(gridSize, N));
+    }
+  };
+
+  template <typename Grid>
+  void BoundariesHoneycomb(const Grid &grid)
+  {
+    // Honeycomb lattice nearest neighbours with periodic boundary conditions.
+    // The columns repeat with period 4, and the first (last) row of the
+    // columns 0 and 3 (1 and 2) in each period wraps to the other side.
+    for (size_t i = 0; i < N; i++)
+    {
+      if (i == 0) // First site
+      {
+        nn(0, i) = i + gridSize;
+        nn(1, i) = i + 2 * gridSize - 1;
+        nn(2, i) = i + N - gridSize;
+      }
+      else if (i == N - gridSize) // Top right-hand corner
+      {
+        nn(0, i) = i - 1;
+        nn(1, i) = i - gridSize;
+        nn(2, i) = i - N + gridSize;
+      }
+      else if (i == N - gridSize - 1) // Bottom right-hand corner
+      {
+        nn(0, i) = i - gridSize;
+        nn(1, i) = i + gridSize;
+        nn(2, i) = i + 1;
+      }
+      else if (i < gridSize) // First column
+      {
+        nn(0, i) = i + gridSize - 1;
+        nn(1, i) = i + gridSize;
+        nn(2, i) = i + N - gridSize;
+      }
+      else if (i > (N - gridSize)) // Last column
+      {
+        nn(0, i) = i - gridSize - 1;
+        nn(1, i) = i - gridSize;
+        nn(2, i) = i - N + gridSize;
+      }
+      else // Run through the rest of the tests
+      {
+        const uint64_t row = grid.Row(i);
+
+        switch (grid.Column(i) & 3)
+        {
+        case 0:
+          if (row == 0) // First row
+          {
+            nn(0, i) = i - gridSize;
+            nn(1, i) = i + gridSize;
+            nn(2, i) = i + 2 * gridSize - 1;
+          }
+          else
+          {
+            nn(0, i) = i - gridSize;
+            nn(1, i) = i + gridSize - 1;
+            nn(2, i) = i + gridSize;
+          }
+          break;
+        case 1:
+          if (row == gridSize - 1) // Last row
+          {
+            nn(0, i) = i - gridSize;
+            nn(1, i) = i + gridSize;
+            nn(2, i) = i - 2 * gridSize + 1;
+          }
+          else
+          {
+            nn(0, i) = i - gridSize;
+            nn(1, i) = i - gridSize + 1;
+            nn(2, i) = i + gridSize;
+          }
+          break;
+        case 2:
+          if (row == gridSize - 1) // Last row
+          {
+            nn(0, i) = i - gridSize;
+            nn(1, i) = i + gridSize;
+            nn(2, i) = i + 1;
+          }
+          else
+          {
+            nn(0, i) = i - gridSize;
+            nn(1, i) = i + gridSize;
+            nn(2, i) = i + gridSize + 1;
+          }
+          break;
+        case 3:
+          if (row == 0) // First row
+          {
+            nn(0, i) = i - 1;
+            nn(1, i) = i - gridSize;
+            nn(2, i) = i + gridSize;
+          }
+          else
+          {
+            nn(0, i) = i - gridSize - 1;
+            nn(1, i) = i - gridSize;
+            nn(2, i) = i + gridSize;
+          }
+          break;
+        }
+      }
+    }
+  };
+
+  void BoundariesSquare()
+  {
+    if (IsPowerOfTwo(gridSize))
+    {
+      BoundariesSquare(PowerOfTwoGrid(gridSize, N));
+    }
+    else
+    {
+      BoundariesSquare(GenericGrid(gridSize, N));
+    }
+  };
+
+  template <typename Grid>
+  void BoundariesSquare(const Grid &grid)
+  {
+    // Square lattice nearest neighbours with periodic boundary conditions
+    for (size_t i = 0; i < N; i++)
+    {
+      const uint64_t col = grid.Column(i);
+      const uint64_t row = grid.Row(i);
+      nn(0, i) = grid.Site(col, grid.WrapRow(row + 1));
+      nn(1, i) = grid.Site(col, grid.WrapRow(row + gridSize - 1));
+      nn(2, i) = grid.WrapSite(i + gridSize);
+      nn(3, i) = grid.WrapSite(i + N - gridSize);
+    }
+  };
+};
+
+template <typename T>
+uint64_t CTRWwrapper(
+    arma::Col<int64_t> &clusters,
+    arma::Mat<T> &lattice,
+    arma::Mat<T> &analysis,
+    arma::Cube<T> &walks,
+    arma::Mat<T> &percolationSweep,
+    arma::Cube<T> &thresholdWalks,
+    arma::Cube<T> &thresholdAnalysis,
+    arma::Col<int64_t> &backbone,
+    arma::Col<T> &residence,
+    arma::Mat<int64_t> &walkState,
+    arma::Col<T> &nextJump,
+    arma::Mat<int64_t> &lagSums,
+    const uint64_t gridSize,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const double threshold,
+    const bool sweep,
+    const uint64_t walkType,
+    const uint64_t nWalks,
+    const uint64_t nSteps,
+    const double beta,
+    const double tau0,
+    const double noise,
+    const bool accelerate,
+    const arma::Col<T> &walkThresholds,
+    const double switchOn,
+    const double switchOff,
+    const bool dynamicClusters,
+    const bool exclusion,
+    const bool decompose,
+    const bool extendable,
+    const std::string &outputPath,
+    const uint64_t memoryLimit,
+    const int64_t randomSeed,
+    const int64_t nJobs,
+    Progress &progress)
+{
+  std::unique_ptr<CTRWfractal<T>> sim(new CTRWfractal<T>(
+      gridSize,
+      latticeType,
+      percolationType,
+      threshold,
+      sweep,
+      walkType,
+      nWalks,
+      nSteps,
+      beta,
+      tau0,
+      noise,
+      accelerate,
+      walkThresholds,
+      switchOn,
+      switchOff,
+      dynamicClusters,
+      exclusion,
+      memoryLimit,
+      randomSeed,
+      nJobs)); // Released on return, or if a stage throws
+
+  sim->SetProgress(progress); // Counters and cancellation shared with the caller
+  sim->SetBackbone(decompose);
+  sim->SetExtendable(extendable); // Keep the state of the walks, to extend them later
+
+  if (!outputPath.empty())
+  {
+    sim->OpenOutput(outputPath); // Stream results to a Zarr directory
+  }
+
+  // Once cancelled, the current stage stops at its next chunk of work
+  // and the later stages are skipped, so the outputs hold what was done
+  auto &&pipeline = [&]() {
+    sim->FindNeighbours(); // Identify neighbouring sites
+    sim->Permute();        // Randomize the order in which the sites (or bonds) are occupied
+    sim->Percolate();      // Run the percolation algorithm
+    sim->BuildLattice();   // Build the lattice coordinates
+    sim->GroupClusters();  // Group clusters by root
+    sim->WriteLattice();   // Write lattice products, if streaming
+
+    if (decompose && !sim->Cancelled())
+    {
+      sim->Decompose(); // Split the largest cluster into backbone and dangling ends
+    }
+
+    if (!sim->includeWalks || sim->Cancelled())
+    {
+      return;
+    }
+
+    if (sim->dynamic)
+    {
+      sim->DynamicWalks(); // Run the random walks with dynamic disorder
+    }
+    else if (exclusion)
+    {
+      sim->ExclusionWalks(); // Run interacting walks with site exclusion
+    }
+    else
+    {
+      sim->RandomWalks(); // Run the random walks
+    }
+
+    if (sim->Cancelled())
+    {
+      return;
+    }
+
+    sim->AddNoise();      // Add noise to walks
+    sim->WriteWalks();    // Write any walks not yet streamed
+    sim->AnalyseWalks();  // Calculate statistics for walks
+
+    if (sim->Cancelled())
+    {
+      return;
+    }
+
+    sim->WriteAnalysis(); // Write statistics, if streaming
+
+    if (walkThresholds.n_elem > 0)
+    {
+      sim->ThresholdWalks(); // Walks and statistics at further thresholds
+    }
+  };
+
+  pipeline();
+
+  if (!sim->Cancelled())
+  {
+    progress.Set(Progress::STAGE, Progress::DONE);
+  }
+
+  sim->CloseOutput(); // Wait for the writer to finish
+
+  // Move rather than copy, so the outputs are not held twice
+  lattice = std::move(sim->latticeCoords);
+  //clusters = sim->lattice;
+  clusters = std::move(sim->clusters);
+  analysis = std::move(sim->analysis);
+  walks = std::move(sim->walksCoords);
+  percolationSweep = std::move(sim->percolationSweep);
+  thresholdWalks = std::move(sim->thresholdWalks);
+  thresholdAnalysis = std::move(sim->thresholdAnalysis);
+  backbone = std::move(sim->backbone);
+  residence = sim->residence / static_cast<T>(std::max(nSteps, static_cast<uint64_t>(1))); // Fraction of the observed steps
+  walkState = std::move(sim->walkState);
+  nextJump = std::move(sim->nextJump);
+  lagSums = std::move(sim->lagSums);
+
+  // Armadillo is Fortran-contiguous, numpy is C-contiguous. The analysis
+  // is left as is: each of its columns becomes a row in numpy, so the
+  // ensemble vectors and the (walk, lag) TAMSD are views without copies
+  if (sim->includeWalks)
+  {
+    arma::inplace_trans(lattice);
+  }
+
+  if (sweep)
+  {
+    arma::inplace_trans(percolationSweep);
+  }
+
+  return 0;
+};
+
+template <typename T>
+std::vector<std::pair<std::string, uint64_t>> CTRWplan(
+    const uint64_t gridSize,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const double threshold,
+    const bool sweep,
+    const uint64_t walkType,
+    const uint64_t nWalks,
+    const uint64_t nSteps,
+    const double beta,
+    const double tau0,
+    const double noise,
+    const bool accelerate,
+    const arma::Col<T> &walkThresholds,
+    const double switchOn,
+    const double switchOff,
+    const bool dynamicClusters,
+    const bool exclusion,
+    const bool decompose,
+    const bool extendable,
+    const uint64_t memoryLimit)
+{
+  // The constructor only checks the plan against the limit,
+  // so nothing large is allocated here
+  CTRWfractal<T> sim(gridSize, latticeType, percolationType, threshold, sweep, walkType,
+                     nWalks, nSteps, beta, tau0, noise, accelerate, walkThresholds,
+                     switchOn, switchOff, dynamicClusters, exclusion, memoryLimit, 0, 0);
+  sim.SetBackbone(decompose);
+  sim.SetExtendable(extendable);
+  return sim.MemoryPlan();
+};
+
+template <typename T>
+uint64_t CTRWextend(
+    arma::Mat<T> &analysis,
+    arma::Cube<T> &walks,
+    arma::Mat<int64_t> &walkState,
+    arma::Col<T> &nextJump,
+    arma::Mat<int64_t> &lagSums,
+    arma::Col<T> &residence,
+    const arma::Cube<T> &previousWalks,
+    const arma::Mat<int64_t> &previousState,
+    const arma::Col<T> &previousJumps,
+    const arma::Mat<int64_t> &previousSums,
+    const arma::Col<T> &previousResidence,
+    const uint64_t gridSize,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const double threshold,
+    const uint64_t walkType,
+    const uint64_t nSteps,
+    const double beta,
+    const double tau0,
+    const bool decompose,
+    const uint64_t memoryLimit,
+    const int64_t randomSeed,
+    const int64_t nJobs)
+{
+  // Carries the noise-free, lazily drawn walks of an extendable run on to
+  // nSteps. The lattice is rebuilt from the seed of the run, which gives
+  // the same realization, and the walks resume from their saved state.
+  const uint64_t nWalks = previousWalks.n_slices;
+  const uint64_t nPrevious = previousWalks.n_cols;
+
+  if (nPrevious < 2 || nSteps <= nPrevious || previousWalks.n_rows != 2 ||
+      previousState.n_rows != 7 || previousState.n_cols != nWalks ||
+      previousJumps.n_elem != nWalks || previousSums.n_rows != 2 * (nPrevious - 1) ||
+      previousSums.n_cols != nWalks || (decompose && previousResidence.n_elem != nWalks))
+  {
+    throw std::runtime_error("The walks and their saved state do not match");
+  }
+
+  std::unique_ptr<CTRWfractal<T>> sim(new CTRWfractal<T>(
+      gridSize, latticeType, percolationType, threshold, false, walkType, nWalks, nSteps,
+      beta, tau0, 0., true, arma::Col<T>(), 0., 0., false, false, memoryLimit, randomSeed, nJobs));
+
+  sim->SetBackbone(decompose);
+  sim->SetExtendable(true);
+
+  sim->FindNeighbours();
+  sim->Permute();
+  sim->Percolate();
+  sim->BuildLattice();
+  sim->GroupClusters();
+
+  if (decompose)
+  {
+    sim->Decompose();
+    sim->residence = arma::round(previousResidence * nPrevious); // Back to counts of steps
+  }
+
+  sim->ExtendWalks(previousWalks, previousState, previousJumps, previousSums);
+  sim->AnalyseWalks();
+
+  analysis = std::move(sim->analysis);
+  walks = std::move(sim->walksCoords);
+  walkState = std::move(sim->walkState);
+  nextJump = std::move(sim->nextJump);
+  lagSums = std::move(sim->lagSums);
+  residence = sim->residence / static_cast<T>(nSteps);
+
+  return 0;
+};
+
+template <typename T>
+class CTRWcache
+{
+  // A percolated lattice kept between calls, so that repeated requests
+  // for walks on it skip the neighbour search, permutation and
+  // percolation. The generator is restored before each set of walks,
+  // so every call gives the same result as a standalone run.
+public:
+  CTRWcache(
+      const uint64_t gridSize,
+      const uint64_t latticeType,
+      const uint64_t percolationType,
+      const double threshold,
+      const uint64_t walkType,
+      const bool accelerate,
+      const int64_t randomSeed,
+      const int64_t nJobs) : sim(gridSize, latticeType, percolationType, threshold, false, walkType,
+                                 0, 0, 0., 1., 0., accelerate, arma::Col<T>(), 0., 0., false, false,
+                                 0, randomSeed, nJobs)
+  {
+    sim.FindNeighbours();
+    sim.Permute();
+    sim.Percolate();
+    sim.BuildLattice();
+    sim.GroupClusters();
+    percolated = sim.Generator();
+  };
+
+  uint64_t Walk(arma::Col<int64_t> &clusters,
+                arma::Mat<T> &lattice,
+                arma::Mat<T> &analysis,
+                arma::Cube<T> &walks,
+                const uint64_t nWalks,
+                const uint64_t nSteps,
+                const double beta,
+                const double tau0,
+                const double noise)
+  {
+    sim.Generator() = percolated;
+    sim.SetWalks(nWalks, nSteps, beta, tau0);
+    sim.SetNoise(noise);
+
+    if (sim.includeWalks)
+    {
+      sim.RandomWalks();
+      sim.AddNoise();
+      sim.AnalyseWalks();
+    }
+
+    clusters = sim.clusters; // Copies, as the lattice stays cached
+    lattice = sim.latticeCoords;
+    analysis = std::move(sim.analysis);
+    walks = std::move(sim.walksCoords);
+
+    if (sim.includeWalks) // Armadillo is Fortran-contiguous, numpy is C-contiguous
+    {
+      arma::inplace_trans(lattice);
+    }
+
+    return 0;
+  };
+
+private:
+  CTRWfractal<T> sim;
+  pcg64 percolated;
+};
+
+template <typename T>
+uint64_t CTRWsweep(
+    std::vector<arma::Col<int64_t>> &clusters,
+    std::vector<arma::Mat<T>> &lattices,
+    std::vector<arma::Mat<T>> &analyses,
+    std::vector<arma::Cube<T>> &walks,
+    arma::Col<int64_t> &latticeIndex,
+    const arma::Col<int64_t> &gridSizes,
+    const arma::Col<T> &thresholds,
+    const arma::Col<int64_t> &randomSeeds,
+    const arma::Col<T> &betas,
+    const arma::Col<T> &tau0s,
+    const arma::Col<T> &noises,
+    const arma::Col<int64_t> &stepCounts,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const uint64_t walkType,
+    const uint64_t nWalks,
+    const bool accelerate,
+    const uint64_t memoryLimit,
+    const int64_t nJobs)
+{
+  // Each point of the sweep runs the stages
+  //   neighbours -> permutation -> percolation -> walks -> noise -> analysis
+  // and a stage only depends on the parameters of the stages before it.
+  // Points are sorted so that those sharing a prefix are adjacent, and
+  // each distinct stage is run once. Only the permutation and the walks
+  // and noise draw random numbers, so restoring the generator at each
+  // branch gives exactly the result of running every point on its own.
+  uint64_t nPoints = gridSizes.n_elem;
+  if (thresholds.n_elem != nPoints || randomSeeds.n_elem != nPoints || betas.n_elem != nPoints ||
+      tau0s.n_elem != nPoints || noises.n_elem != nPoints || stepCounts.n_elem != nPoints)
+  {
+    throw std::invalid_argument("Every sweep parameter needs one value per point");
+  }
+
+  std::vector<uint64_t> order(nPoints);
+  for (size_t i = 0; i < nPoints; i++)
+  {
+    order[i] = i;
+  }
+
+  auto &&key = [&](const uint64_t i) {
+    return std::make_tuple(gridSizes(i), randomSeeds(i), thresholds(i),
+                           stepCounts(i), betas(i), tau0s(i), noises(i));
+  };
+  std::stable_sort(order.begin(), order.end(),
+                   [&](const uint64_t a, const uint64_t b) { return key(a) < key(b); });
+
+  // Boundaries of the groups sharing a lattice, a percolation, and a set of walks
+  std::vector<uint64_t> latticeEdges, percolationEdges, walkEdges;
+  for (size_t k = 0; k < nPoints; k++)
+  {
+    uint64_t i = order[k];
+    uint64_t h = (k > 0) ? order[k - 1] : i;
+    bool newLattice = (k == 0) || gridSizes(i) != gridSizes(h) || randomSeeds(i) != randomSeeds(h);
+    bool newPercolation = newLattice || thresholds(i) != thresholds(h);
+    bool newWalks = newPercolation || stepCounts(i) != stepCounts(h) || betas(i) != betas(h) ||
+                    tau0s(i) != tau0s(h);
+    if (newLattice)
+    {
+      latticeEdges.push_back(k);
+    }
+    if (newPercolation)
+    {
+      percolationEdges.push_back(k);
+    }
+    if (newWalks)
+    {
+      walkEdges.push_back(k);
+    }
+  }
+  latticeEdges.push_back(nPoints);
+  percolationEdges.push_back(nPoints);
+  walkEdges.push_back(nPoints);
+
+  latticeIndex.set_size(nPoints);
+  for (size_t q = 0; q + 1 < percolationEdges.size(); q++)
+  {
+    for (size_t k = percolationEdges[q]; k < percolationEdges[q + 1]; k++)
+    {
+      latticeIndex(order[k]) = q;
+    }
+  }
+
+  clusters.assign(percolationEdges.size() - 1, arma::Col<int64_t>());
+  lattices.assign(percolationEdges.size() - 1, arma::Mat<T>());
+  analyses.assign(nPoints, arma::Mat<T>());
+  walks.assign(nPoints, arma::Cube<T>());
+
+  // Run whole lattices in parallel when there are enough of them, and as
+  // many at once as fit in the memory budget. Otherwise give the threads
+  // to the analysis of each lattice in turn.
+  uint64_t nLattices = latticeEdges.size() - 1;
+  uint64_t peakBytes = 0;
+  for (size_t k = 0; k < nPoints; k++)
+  {
+    CTRWfractal<T> probe(gridSizes(k), latticeType, percolationType, thresholds(k), false,
+                         walkType, nWalks, stepCounts(k), betas(k), tau0s(k), noises(k),
+                         accelerate, arma::Col<T>(), 0., 0., false, false, memoryLimit, 0, 0);
+    peakBytes = std::max(peakBytes, probe.PlannedBytes()); // Nothing is allocated until FindNeighbours
+  }
+
+  uint64_t nConcurrent = std::min(static_cast<uint64_t>(NumThreads(nJobs)), nLattices);
+  if (nJobs == 0)
+  {
+    nConcurrent = 1;
+  }
+  if (memoryLimit > 0) // Each point fits on its own, or the probe above has thrown
+  {
+    nConcurrent = std::max(static_cast<uint64_t>(1), std::min(nConcurrent, memoryLimit / peakBytes));
+  }
+  int64_t innerJobs = (nConcurrent > 1) ? 0 : nJobs;
+
+  std::exception_ptr failure;
+  std::mutex failureMutex;
+
+  auto &&runLattice = [&](uint64_t g) {
+    try
+    {
+      uint64_t first = order[latticeEdges[g]];
+      CTRWfractal<T> sim(gridSizes(first), latticeType, percolationType, thresholds(first), false,
+                         walkType, nWalks, stepCounts(first), betas(first), tau0s(first),
+                         noises(first), accelerate, arma::Col<T>(), 0., 0., false, false,
+                         memoryLimit, randomSeeds(first), innerJobs);
+
+      sim.FindNeighbours();
+      sim.Permute();
+      sim.BuildLattice();
+      const pcg64 permuted = sim.Generator();
+
+      auto q = std::lower_bound(percolationEdges.begin(), percolationEdges.end(), latticeEdges[g]);
+      auto w = std::lower_bound(walkEdges.begin(), walkEdges.end(), latticeEdges[g]);
+
+      for (; *q < latticeEdges[g + 1]; q++)
+      {
+        sim.SetThreshold(thresholds(order[*q]));
+        sim.Percolate();
+        sim.GroupClusters();
+
+        uint64_t slot = latticeIndex(order[*q]);
+        clusters[slot] = sim.clusters;
+        lattices[slot] = sim.latticeCoords;
+
+        for (; *w < *(q + 1); w++)
+        {
+          uint64_t i = order[*w];
+          sim.SetWalks(nWalks, stepCounts(i), betas(i), tau0s(i));
+          if (!sim.includeWalks)
+          {
+            continue;
+          }
+
+          sim.Generator() = permuted;
+          sim.RandomWalks();
+          const pcg64 walked = sim.Generator();
+          const arma::Cube<T> clean = (*(w + 1) - *w > 1) ? sim.walksCoords : arma::Cube<T>();
+
+          for (size_t k = *w; k < *(w + 1); k++)
+          {
+            i = order[k];
+            if (k > *w)
+            {
+              sim.walksCoords = clean;
+              sim.Generator() = walked;
+            }
+            sim.SetNoise(noises(i));
+            sim.AddNoise();
+            sim.AnalyseWalks();
+
+            walks[i] = sim.walksCoords;
+            analyses[i] = sim.analysis;
+          }
+        }
+      }
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(failureMutex);
+      if (!failure)
+      {
+        failure = std::current_exception();
+      }
+    }
+  };
+
+  parallel(runLattice, static_cast<uint64_t>(0), nLattices, static_cast<int>(nConcurrent));
+
+  if (failure)
+  {
+    std::rethrow_exception(failure);
+  }
+
+  return 0;
+};
+
+template <typename T>
+uint64_t CTRWdataset(
+    const std::string &path,
+    const uint64_t nTracks,
+    const uint64_t nSteps,
+    const uint64_t tracksPerShard,
+    const uint64_t tracksPerLattice,
+    const double betaLow,
+    const double betaHigh,
+    const double thresholdLow,
+    const double thresholdHigh,
+    const double noiseLow,
+    const double noiseHigh,
+    const double tau0,
+    const uint64_t gridSize,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const uint64_t walkType,
+    const uint64_t randomSeed,
+    const int64_t nJobs)
+{
+  // Labelled trajectories for training estimators. Every track has its
+  // own exponent and noise level, drawn uniformly from the priors, and
+  // each run of tracksPerLattice tracks shares a lattice, whose threshold
+  // is drawn in the same way. Shards are generated in parallel, and each
+  // one only depends on the master seed and its index, so the files do
+  // not depend on nJobs. A shard is written as
+  //   walks-XXXXX.npy  : (tracks, nSteps, 2)
+  //   labels-XXXXX.npy : (tracks, 4), with columns beta, threshold,
+  //                      noise and the index of the lattice
+  if (tracksPerShard == 0 || tracksPerLattice == 0)
+  {
+    throw std::invalid_argument("Shards and lattices need at least one track each");
+  }
+
+  uint64_t nShards = (nTracks + tracksPerShard - 1) / tracksPerShard;
+  uint64_t latticesPerShard = (tracksPerShard + tracksPerLattice - 1) / tracksPerLattice;
+
+  std::exception_ptr failure;
+  std::mutex failureMutex;
+
+  auto &&runShard = [&](uint64_t s) {
+    try
+    {
+      pcg64 rng(randomSeed, s);
+      std::uniform_real_distribution<double> Uniform(0., 1.);
+      auto &&draw = [&](const double low, const double high) {
+        return low + (high - low) * Uniform(rng);
+      };
+
+      uint64_t n = std::min(tracksPerShard, nTracks - s * tracksPerShard);
+      arma::Cube<T> coords(2, nSteps, n);
+      arma::Mat<T> labels(4, n);
+
+      // The neighbours and coordinates do not depend on the occupations,
+      // so they are found once per shard and each lattice is re-permuted
+      CTRWfractal<T> sim(gridSize, latticeType, percolationType, thresholdLow, false, walkType,
+                         0, 0, 0., 1., 0., true, arma::Col<T>(), 0., 0., false, false, 0, 0, 0);
+      sim.SetVerbose(false);
+      sim.FindNeighbours();
+      sim.BuildLattice();
+
+      double threshold = 0.;
+      for (size_t k = 0; k < n; k++)
+      {
+        if (k % tracksPerLattice == 0) // The same lattice as a standalone run with its seed
+        {
+          threshold = draw(thresholdLow, thresholdHigh);
+          sim.Generator().seed(rng() >> 1);
+          sim.SetThreshold(threshold);
+          sim.Permute();
+          sim.Percolate();
+          sim.StartSampling(nSteps, tau0);
+        }
+
+        double beta = draw(betaLow, betaHigh);
+        double noise = draw(noiseLow, noiseHigh);
+        sim.SampleWalk(rng, beta, coords, k);
+
+        if (noise > 0.)
+        {
+          std::normal_distribution<double> NormalDistribution(0, noise);
+          coords.slice(k).transform([&](T x) { return x + NormalDistribution(rng); });
+        }
+
+        labels(0, k) = beta;
+        labels(1, k) = threshold;
+        labels(2, k) = noise;
+        labels(3, k) = s * latticesPerShard + k / tracksPerLattice;
+      }
+
+      // Armadillo is Fortran-contiguous, so a (2, nSteps, n) cube is a
+      // C-contiguous (n, nSteps, 2) array
+      std::ostringstream index;
+      index << std::setw(5) << std::setfill('0') << s;
+      WriteNpy(path + "/walks-" + index.str() + ".npy", coords.memptr(), {n, nSteps, 2});
+      WriteNpy(path + "/labels-" + index.str() + ".npy", labels.memptr(), {n, 4});
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(failureMutex);
+      if (!failure)
+      {
+        failure = std::current_exception();
+      }
+    }
+  };
+
+  parallel(runShard, static_cast<uint64_t>(0), nShards, static_cast<int>(nJobs));
+
+  if (failure)
+  {
+    std::rethrow_exception(failure);
+  }
+
+  return nShards;
+};
+
+template <typename T>
+uint64_t CTRWabc(
+    arma::Mat<T> &particles,
+    arma::Mat<T> &history,
+    arma::Mat<T> &statistics,
+    const arma::Cube<T> &observed,
+    const uint64_t nWalks,
+    const uint64_t nParticles,
+    const uint64_t nRounds,
+    const double quantile,
+    const double minAcceptance,
+    const double betaLow,
+    const double betaHigh,
+    const double thresholdLow,
+    const double thresholdHigh,
+    const double noise,
+    const double tau0,
+    const uint64_t gridSize,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const uint64_t walkType,
+    const uint64_t randomSeed,
+    const int64_t nJobs)
+{
+  // Fit beta and the threshold to observed tracks by sequential Monte
+  // Carlo ABC (ABC-PMC: Beaumont et al., Biometrika 96, 983 (2009)), with
+  // uniform priors. Each simulation percolates a fresh lattice, runs
+  // nWalks lazy walks and accumulates their summary statistics one walk
+  // at a time (see WalkSummary). The distance is Euclidean, with each
+  // statistic scaled by its spread over the first round, which is drawn
+  // from the prior. Every later round keeps the particles closer than a
+  // quantile of the previous distances, proposing from the weighted
+  // population with a Gaussian kernel of twice its variance.
+  //
+  // Proposals are made in batches and simulated in parallel. Each one has
+  // its own generator stream and is accepted in order, so the result does
+  // not depend on nJobs. The fit stops after nRounds, or at the first
+  // round whose acceptance rate would drop below minAcceptance.
+  //
+  // Outputs: particles is (4, nParticles) with rows beta, threshold,
+  // weight and distance; history is (3, rounds) with rows tolerance,
+  // acceptance rate and simulations; statistics is (nStats, 2) with the
+  // observed statistics and their scales.
+  const uint64_t nSteps = observed.n_cols;
+  const uint64_t nStats = WalkSummary::nStats;
+  if (observed.n_rows != 2 || nSteps < 2 || observed.n_slices == 0)
+  {
+    throw std::invalid_argument("The observed tracks must be of shape (tracks, steps >= 2, 2)");
+  }
+  if (nParticles < 2 || nWalks == 0 || nRounds == 0)
+  {
+    throw std::invalid_argument("ABC needs at least two particles, one walk and one round");
+  }
+
+  WalkSummary summary(nSteps);
+  for (size_t k = 0; k < observed.n_slices; k++)
+  {
+    summary.Add(observed.slice_memptr(k));
+  }
+  const arma::vec target = summary.Statistics();
+
+  const arma::vec low = {betaLow, thresholdLow};
+  const arma::vec high = {betaHigh, thresholdHigh};
+
+  // One simulation per worker, whose neighbours and coordinates are
+  // reused by every proposal it runs
+  const uint64_t nWorkers = (nJobs == 0) ? 1 : NumThreads(nJobs);
+  std::vector<std::unique_ptr<CTRWfractal<T>>> sims(nWorkers);
+
+  auto &&simulate = [&](pcg64 &rng, const arma::vec &theta, const uint64_t worker) {
+    std::unique_ptr<CTRWfractal<T>> &sim = sims[worker];
+    if (!sim)
+    {
+      sim.reset(new CTRWfractal<T>(gridSize, latticeType, percolationType, theta(1), false, walkType,
+                                   0, 0, 0., 1., 0., true, arma::Col<T>(), 0., 0., false, false, 0, 0, 0));
+      sim->SetVerbose(false);
+      sim->FindNeighbours();
+      sim->BuildLattice();
+    }
+
+    sim->Generator().seed(rng() >> 1);
+    sim->SetThreshold(theta(1));
+    sim->Permute();
+    sim->Percolate();
+    sim->StartSampling(nSteps, tau0);
+
+    arma::Cube<T> walk(2, nSteps, 1);
+    WalkSummary acc(nSteps);
+    std::normal_distribution<double> NormalDistribution(0, (noise > 0.) ? noise : 1.);
+    for (size_t w = 0; w < nWalks; w++)
+    {
+      sim->SampleWalk(rng, theta(0), walk, 0);
+      if (noise > 0.)
+      {
+        walk.transform([&](T x) { return x + NormalDistribution(rng); });
+      }
+      acc.Add(walk.memptr());
+    }
+    return acc.Statistics();
+  };
+
+  // Propose and simulate attempts [first, first + count) of a round
+  arma::mat thetas, stats;
+  std::vector<char> valid;
+
+  auto &&runBatch = [&](const uint64_t round, const uint64_t first, const uint64_t count,
+                        const std::function<arma::vec(pcg64 &)> &propose) {
+    thetas.set_size(2, count);
+    stats.set_size(nStats, count);
+    valid.assign(count, 0);
+
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+    const uint64_t nActive = std::min(nWorkers, count);
+
+    auto &&work = [&](uint64_t worker) {
+      try
+      {
+        for (uint64_t j = worker; j < count; j += nActive)
+        {
+          pcg64 rng(randomSeed, (round << 40) + first + j);
+          arma::vec theta = propose(rng);
+          thetas.col(j) = theta;
+          if (arma::all(theta >= low) && arma::all(theta <= high))
+          {
+            stats.col(j) = simulate(rng, theta, worker);
+            valid[j] = 1;
+          }
+        }
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(failureMutex);
+        if (!failure)
+        {
+          failure = std::current_exception();
+        }
+      }
+    };
+
+    parallel(work, static_cast<uint64_t>(0), nActive, static_cast<int>((nJobs == 0) ? 0 : nActive));
+
+    if (failure)
+    {
+      std::rethrow_exception(failure);
+    }
+  };
+
+  // Round 0: the prior, which also sets the scale of each statistic
+  runBatch(0, 0, nParticles, [&](pcg64 &rng) {
+    std::uniform_real_distribution<double> Uniform(0., 1.);
+    arma::vec theta = low + (high - low) % arma::vec({Uniform(rng), Uniform(rng)});
+    return theta;
+  });
 
-  inline int64_t FindRoot(const int64_t i)
+  arma::vec scale(nStats);
+  for (size_t k = 0; k < nStats; k++)
   {
-    return (lattice(i) < 0) ? i : lattice(i) = FindRoot(lattice(i));
+    arma::rowvec x = stats.row(k);
+    double mad = 1.4826 * arma::median(arma::abs(x - arma::median(x)));
+    double sd = arma::stddev(x);
+    scale(k) = (mad > 0.) ? mad : ((sd > 0.) ? sd : 1.);
+  }
+
+  auto &&distance = [&](const uint64_t j) {
+    return arma::norm((stats.col(j) - target) / scale);
   };
 
-  inline int64_t GroupRoot(const int64_t i)
+  arma::mat population = thetas;
+  arma::vec weights(nParticles);
+  weights.fill(1. / nParticles);
+  arma::vec distances(nParticles);
+  for (size_t j = 0; j < nParticles; j++)
   {
-    return (clusters(i) < 0) ? i : clusters(i) = GroupRoot(clusters(i));
-  };
+    distances(j) = distance(j);
+  }
 
-  void PossibleStartPoints()
+  std::vector<arma::vec> rounds;
+  rounds.push_back(arma::vec({distances.max(), 1., static_cast<double>(nParticles)}));
+
+  for (uint64_t t = 1; t < nRounds; t++)
   {
-    latticeOnes = arma::regspace<arma::ivec>(0, N - 1);
+    arma::vec sorted = arma::sort(distances);
+    const double epsilon = sorted(static_cast<uint64_t>(quantile * (nParticles - 1)));
 
-    // Set up selection of random start point
-    //  - walkType = 1 : on largest cluster, or
-    //  - walkType = 0 : on ALL clusters
-    if (walkType == 1)
+    arma::vec mean = population * weights;
+    arma::vec sigma = arma::sqrt(2. * ((arma::square(population.each_col() - mean)) * weights));
+    sigma = arma::max(sigma, 1E-6 * (high - low)); // Keep a collapsed population moving
+    arma::vec cumulative = arma::cumsum(weights);
+
+    auto &&propose = [&](pcg64 &rng) {
+      std::uniform_real_distribution<double> Uniform(0., 1.);
+      const double u = Uniform(rng) * cumulative(nParticles - 1);
+      const uint64_t a = std::min(static_cast<uint64_t>(std::upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin()),
+                                  nParticles - 1);
+      std::normal_distribution<double> NormalDistribution(0., 1.);
+      arma::vec theta = population.col(a);
+      theta(0) += sigma(0) * NormalDistribution(rng);
+      theta(1) += sigma(1) * NormalDistribution(rng);
+      return theta;
+    };
+
+    const uint64_t maxAttempts = static_cast<uint64_t>(std::ceil(nParticles / std::max(minAcceptance, 1E-9)));
+    arma::mat accepted(2, nParticles);
+    arma::vec acceptedDistances(nParticles);
+    uint64_t nAccepted = 0, attempts = 0, used = 0;
+
+    while (nAccepted < nParticles && attempts < maxAttempts)
     {
-      int64_t latticeMin = lattice.elem(find(lattice > EMPTY)).min();
-      arma::uvec idxMin = arma::find(lattice == latticeMin);
-      arma::uvec largestCluster = arma::find(lattice == idxMin(0));
-      uint64_t largestClusterSize = largestCluster.n_elem + 1;
-      largestCluster.resize(largestClusterSize);
-      largestCluster(largestClusterSize - 1) = idxMin(0);
-      latticeOnes = latticeOnes.elem(largestCluster);
+      const uint64_t count = std::min(nParticles, maxAttempts - attempts);
+      runBatch(t, attempts, count, propose);
+
+      for (size_t j = 0; j < count && nAccepted < nParticles; j++)
+      {
+        if (!valid[j])
+        {
+          continue;
+        }
+        const double d = distance(j);
+        if (d <= epsilon)
+        {
+          accepted.col(nAccepted) = thetas.col(j);
+          acceptedDistances(nAccepted) = d;
+          nAccepted++;
+          used = attempts + j + 1;
+        }
+      }
+      attempts += count;
     }
-    else
+
+    if (nAccepted < nParticles) // Acceptance too low, keep the last population
     {
-      latticeOnes = latticeOnes.elem(find(lattice != EMPTY));
+      break;
     }
-  };
-
-  arma::ivec GetOccupiedNeighbours(const int64_t pos)
-  {
-    arma::Col<uint8_t> checkNeighbour(neighbourCount, arma::fill::zeros);
-    arma::ivec neighbours = nn.col(pos);
 
-    for (size_t k = 0; k < neighbourCount; k++)
+    // Importance weights for a uniform prior
+    arma::vec updated(nParticles);
+    for (size_t i = 0; i < nParticles; i++)
     {
-      checkNeighbour(k) = (lattice(neighbours(k)) == EMPTY) ? 0 : 1;
+      arma::mat z = population;
+      z.each_col() -= accepted.col(i);
+      z.each_col() /= sigma;
+      updated(i) = 1. / arma::dot(weights, arma::exp(-0.5 * arma::sum(arma::square(z), 0)).t());
     }
 
-    return neighbours.elem(find(checkNeighbour == 1));
-  };
+    population = accepted;
+    weights = updated / arma::accu(updated);
+    distances = acceptedDistances;
+    rounds.push_back(arma::vec({epsilon, static_cast<double>(nParticles) / used, static_cast<double>(used)}));
+  }
 
-  void BoundariesHoneycomb()
+  particles.set_size(4, nParticles);
+  particles.rows(0, 1) = arma::conv_to<arma::Mat<T>>::from(population);
+  particles.row(2) = arma::conv_to<arma::Row<T>>::from(weights.t());
+  particles.row(3) = arma::conv_to<arma::Row<T>>::from(distances.t());
+
+  history.set_size(3, rounds.size());
+  for (size_t r = 0; r < rounds.size(); r++)
   {
-    // Honeycomb lattice nearest neighbours with periodic boundary conditions
-    uint64_t currentCol = 0;
-    uint64_t count = 0;
+    history.col(r) = arma::conv_to<arma::Col<T>>::from(rounds[r]);
+  }
 
-    for (size_t i = 0; i < N; i++)
+  statistics.set_size(nStats, 2);
+  statistics.col(0) = arma::conv_to<arma::Col<T>>::from(target);
+  statistics.col(1) = arma::conv_to<arma::Col<T>>::from(scale);
+
+  return rounds.size();
+};
+
+template <typename T>
+uint64_t CTRWageing(
+    arma::Cube<T> &out,
+    const arma::Cube<T> &coords,
+    const arma::Col<int64_t> &ageingTimes,
+    const arma::Col<int64_t> &windowLengths,
+    const arma::Col<int64_t> &lags,
+    const int64_t nJobs)
+{
+  // Ageing-resolved TAMSD of each walk,
+  //   TAMSD(lag; ta, T) = sum_{t = ta}^{ta + T - lag - 1} |r(t + lag) - r(t)|^2 / (T - lag),
+  // for every ageing time ta, window length T and lag. For each lag, one
+  // pass over the walk builds the prefix sums of the squared increments,
+  // after which every window is a difference of two of them. The whole
+  // surface then costs about as much as the TAMSD at those lags over the
+  // full walk. Windows that do not fit in the walk, or that are not
+  // longer than the lag, are NaN.
+  //
+  // coords is (2, nSteps, nWalks), and out is (nLags, nWindows * nAgeing,
+  // nWalks), i.e. a C-contiguous (nWalks, nAgeing, nWindows, nLags) array.
+  const uint64_t nSteps = coords.n_cols;
+  const uint64_t nWalks = coords.n_slices;
+  const uint64_t nAgeing = ageingTimes.n_elem;
+  const uint64_t nWindows = windowLengths.n_elem;
+  const uint64_t nLags = lags.n_elem;
+
+  if (coords.n_rows != 2)
+  {
+    throw std::invalid_argument("The walks must be of shape (walks, steps, 2)");
+  }
+  if (arma::any(ageingTimes < 0) || arma::any(windowLengths < 1) || arma::any(lags < 1))
+  {
+    throw std::invalid_argument("Ageing times must be >= 0, and window lengths and lags >= 1");
+  }
+
+  out.set_size(nLags, nWindows * nAgeing, nWalks);
+
+  auto &&func = [&](uint64_t i) {
+    const T *walk = coords.slice_memptr(i);
+    std::vector<double> prefix(nSteps + 1);
+
+    for (size_t k = 0; k < nLags; k++)
     {
-      if (i == 0) // First site
-      {
-        nn(0, i) = i + gridSize;
-        nn(1, i) = i + 2 * gridSize - 1;
-        nn(2, i) = i + N - gridSize;
-      }
-      else if (i == N - gridSize) // Top right-hand corner
+      const uint64_t delta = static_cast<uint64_t>(lags(k));
+      const uint64_t n = (delta < nSteps) ? nSteps - delta : 0;
+
+      prefix[0] = 0.;
+      for (size_t t = 0; t < n; t++)
       {
-        nn(0, i) = i - 1;
-        nn(1, i) = i - gridSize;
-        nn(2, i) = i - N + gridSize;
+        prefix[t + 1] = prefix[t] + SquaredDist(walk[2 * (t + delta)], walk[2 * t],
+                                                walk[2 * (t + delta) + 1], walk[2 * t + 1]);
       }
-      else if (i == N - gridSize - 1) // Bottom right-hand corner
+
+      for (size_t a = 0; a < nAgeing; a++)
       {
-        nn(0, i) = i - gridSize;
-        nn(1, i) = i + gridSize;
-        nn(2, i) = i + 1;
+        for (size_t w = 0; w < nWindows; w++)
+        {
+          const uint64_t ta = static_cast<uint64_t>(ageingTimes(a));
+          const uint64_t window = static_cast<uint64_t>(windowLengths(w));
+          out(k, a * nWindows + w, i) = (delta < window && ta + window <= nSteps)
+                                            ? (prefix[ta + window - delta] - prefix[ta]) / (window - delta)
+                                            : arma::Datum<T>::nan;
+        }
       }
-      else if (i < gridSize) // First column
+    }
+  };
+
+  parallel(func, static_cast<uint64_t>(0), nWalks, static_cast<int>(nJobs));
+
+  return 0;
+};
+
+template <typename T>
+uint64_t CTRWdwell(
+    arma::Col<int64_t> &segments,
+    arma::Mat<T> &histogram,
+    arma::Mat<T> &exponents,
+    const arma::Cube<T> &coords,
+    const double noise,
+    const double penalty,
+    const uint64_t tMin,
+    const uint64_t nBins,
+    const int64_t nJobs)
+{
+  // Splits each walk into dwells and jumps (see DwellDetector), with the
+  // noise estimated per walk if it is negative, and a BIC-like penalty of
+  // 3 ln(nSteps) per segment if the penalty is negative. The complete
+  // dwells are binned over log-spaced dwell times from 1 to nSteps, and
+  // give the maximum-likelihood Pareto exponent of each walk and of all
+  // of them pooled.
+  //
+  // coords is (2, nSteps, nWalks), and the outputs are C-contiguous:
+  //   segments:  (nWalks, nSteps), the index of the segment of each step
+  //   histogram: (nWalks + 3, nBins), the lower and upper bin edges, the
+  //              ensemble counts, then the counts of each walk
+  //   exponents: (nWalks + 1, 4), the number of dwells >= tMin, the
+  //              exponent, its standard error and the noise, for each
+  //              walk then the ensemble
+  const uint64_t nSteps = coords.n_cols;
+  const uint64_t nWalks = coords.n_slices;
+
+  if (coords.n_rows != 2)
+  {
+    throw std::invalid_argument("The walks must be of shape (walks, steps, 2)");
+  }
+  if (nBins < 1 || tMin < 1)
+  {
+    throw std::invalid_argument("The number of bins and the shortest dwell must be >= 1");
+  }
+
+  const double lambda = (penalty < 0.) ? 3. * std::log(std::max(static_cast<double>(nSteps), 2.)) : penalty;
+  arma::Col<T> edges = arma::logspace<arma::Col<T>>(0., std::log10(nSteps + 1.), nBins + 1);
+  edges(0) = 1.;
+  edges(nBins) = nSteps + 1.;
+
+  segments.set_size(nSteps * nWalks);
+  histogram.zeros(nBins, nWalks + 3);
+  histogram.col(0) = arma::ceil(edges.head(nBins)); // Dwell times are whole steps
+  histogram.col(1) = arma::ceil(edges.tail(nBins));
+  exponents.zeros(4, nWalks + 1);
+  std::vector<std::vector<uint64_t>> dwells(nWalks);
+
+  auto &&func = [&](uint64_t i) {
+    const T *walk = coords.slice_memptr(i);
+    const double sigma = (noise < 0.) ? DwellDetector::EstimateNoise(walk, nSteps) : noise;
+
+    DwellDetector detector(nSteps, sigma, lambda);
+    detector.Segment(walk, segments.memptr() + i * nSteps);
+    detector.Dwells(dwells[i]);
+
+    for (auto t : dwells[i])
+    {
+      const uint64_t b = std::upper_bound(edges.begin(), edges.end(), static_cast<T>(t)) - edges.begin() - 1;
+      histogram(std::min(b, nBins - 1), i + 3) += 1.;
+    }
+
+    double exponent, stdError;
+    exponents(0, i) = DwellDetector::ParetoExponent(dwells[i], tMin, exponent, stdError);
+    exponents(1, i) = exponent;
+    exponents(2, i) = stdError;
+    exponents(3, i) = sigma;
+  };
+
+  parallel(func, static_cast<uint64_t>(0), nWalks, static_cast<int>(nJobs));
+
+  std::vector<uint64_t> pooled;
+  for (auto &d : dwells)
+  {
+    pooled.insert(pooled.end(), d.begin(), d.end());
+  }
+
+  double exponent, stdError;
+  exponents(0, nWalks) = DwellDetector::ParetoExponent(pooled, tMin, exponent, stdError);
+  exponents(1, nWalks) = exponent;
+  exponents(2, nWalks) = stdError;
+  exponents(3, nWalks) = (nWalks > 0) ? arma::accu(exponents.submat(3, 0, 3, nWalks - 1)) / nWalks : noise;
+  if (nWalks > 0)
+  {
+    histogram.col(2) = arma::sum(histogram.tail_cols(nWalks), 1);
+  }
+
+  return 0;
+};
+
+template <typename T>
+uint64_t CTRWtracks(
+    arma::Mat<T> &analysis,
+    arma::Col<int64_t> &ids,
+    arma::Col<int64_t> &firstFrames,
+    arma::Col<int64_t> &lengths,
+    arma::Col<int64_t> &observed,
+    const std::string &path,
+    const bool binary,
+    const char delimiter,
+    const uint64_t maxLag,
+    const int64_t nJobs)
+{
+  // Reads a table of experimental tracks in parallel (see TrackTable),
+  // and analyses them as AnalyseCube does the simulated walks, at lags
+  // of 1 to maxLag frames, or up to the longest track if maxLag is zero.
+  // Tracks have their own lengths, and frames that were not observed are
+  // NaN, so each statistic averages over the pairs of observed frames,
+  // and the ensemble over the tracks that have any at that lag. The
+  // TAMSD of a track is NaN at lags it has no pairs for.
+  //
+  // analysis is (nLags, nTracks + 3), laid out as from CTRWwrapper, and
+  // the tracks are in increasing order of id.
+  TrackTable table(path, binary, delimiter, nJobs);
+  const uint64_t nTracks = table.Count();
+  const T nan = arma::Datum<T>::nan;
+  if (nTracks == 0)
+  {
+    throw std::invalid_argument("No tracks in " + path);
+  }
+
+  uint64_t longest = 0;
+  for (size_t i = 0; i < nTracks; i++)
+  {
+    longest = std::max(longest, table.Length(i));
+  }
+  const uint64_t nLags = (longest < 2) ? 0 : ((maxLag > 0) ? std::min(maxLag, longest - 1) : longest - 1);
+
+  analysis.set_size(nLags, nTracks + 3);
+  arma::Mat<T> eaMSDall(nLags, nTracks), eataMSDall(nLags, nTracks);
+
+  // Tiles of (track, block of lags), so that a few long tracks still use
+  // every thread. The lag blocks have equal cost for the longest track,
+  // as AnalyseCube cuts them for the walks.
+  const uint64_t nBlocks = LagBlockCount(nLags, nTracks, nJobs);
+  const arma::uvec lagEdges = LagBlockEdges(longest, nLags, nBlocks);
+
+  auto &&func = [&](uint64_t t) {
+    const uint64_t i = t / nBlocks;
+    const uint64_t b = t % nBlocks;
+    const uint64_t n = table.Length(i);
+    const double *r = table.Track(i);
+    for (size_t j = lagEdges(b); j < lagEdges(b + 1); j++)
+    {
+      double integral = 0.;
+      uint64_t pairs = 0;
+      for (size_t s = 0; s + j < n; s++)
       {
-        nn(0, i) = i + gridSize - 1;
-        nn(1, i) = i + gridSize;
-        nn(2, i) = i + N - gridSize;
+        const double d = SquaredDist(r[2 * (s + j)], r[2 * s], r[2 * (s + j) + 1], r[2 * s + 1]);
+        if (!std::isnan(d))
+        {
+          integral += d;
+          pairs++;
+        }
       }
-      else if (i > (N - gridSize)) // Last column
+      analysis(j - 1, i + 3) = (pairs > 0) ? integral / pairs : nan;
+      eaMSDall(j - 1, i) = (j < n) ? SquaredDist(r[2 * j], r[0], r[2 * j + 1], r[1]) : nan; // The first frame is observed
+    }
+  };
+
+  parallel(func, static_cast<uint64_t>(0), nTracks * nBlocks, nJobs);
+
+  auto &&prefix = [&](uint64_t i) {
+    // Ensemble-time-average MSD from a running sum, as in AnalyseCube
+    const uint64_t n = table.Length(i);
+    const double *r = table.Track(i);
+    double integral = 0.;
+    uint64_t increments = 0;
+    for (size_t j = 1; j <= nLags; j++)
+    {
+      eataMSDall(j - 1, i) = (j < n && increments > 0) ? integral / increments : nan;
+      if (j < n && increments == 0)
       {
-        nn(0, i) = i - gridSize - 1;
-        nn(1, i) = i - gridSize;
-        nn(2, i) = i - N + gridSize;
+        eaMSDall(j - 1, i) = 0.; // As in AnalyseCube, a lag without an EATAMSD adds no MSD
       }
-      else // Run through the rest of the tests
+      if (j < n)
       {
-        switch (currentCol)
+        const double d = SquaredDist(r[2 * j], r[2 * (j - 1)], r[2 * j + 1], r[2 * (j - 1) + 1]);
+        if (!std::isnan(d))
         {
-        case 0:
-          if (arma::any(firstRow == i)) // First row
-          {
-            nn(0, i) = i - gridSize;
-            nn(1, i) = i + gridSize;
-            nn(2, i) = i + 2 * gridSize - 1;
-          }
-          else
-          {
-            nn(0, i) = i - gridSize;
-            nn(1, i) = i + gridSize - 1;
-            nn(2, i) = i + gridSize;
-          }
-          break;
-        case 1:
-          if (arma::any(lastRow == i)) // Last row
-          {
-            nn(0, i) = i - gridSize;
-            nn(1, i) = i + gridSize;
-            nn(2, i) = i - 2 * gridSize + 1;
-          }
-          else
-          {
-            nn(0, i) = i - gridSize;
-            nn(1, i) = i - gridSize + 1;
-            nn(2, i) = i + gridSize;
-          }
-          break;
-        case 2:
-          if (arma::any(lastRow == i)) // Last row
-          {
-            nn(0, i) = i - gridSize;
-            nn(1, i) = i + gridSize;
-            nn(2, i) = i + 1;
-          }
-          else
-          {
-            nn(0, i) = i - gridSize;
-            nn(1, i) = i + gridSize;
-            nn(2, i) = i + gridSize + 1;
-          }
-          break;
-        case 3:
-          if (arma::any(firstRow == i)) // First row
-          {
-            nn(0, i) = i - 1;
-            nn(1, i) = i - gridSize;
-            nn(2, i) = i + gridSize;
-          }
-          else
-          {
-            nn(0, i) = i - gridSize - 1;
-            nn(1, i) = i - gridSize;
-            nn(2, i) = i + gridSize;
-          }
-          break;
+          integral += d;
+          increments++;
         }
       }
-
-      if ((i + 1) % gridSize == 0) // Update current column
-      {
-        count++;
-        currentCol = count % 4;
-      }
     }
   };
 
-  void BoundariesSquare()
-  {
-    // Square lattice nearest neighbours with periodic boundary conditions
-    for (size_t i = 0; i < N; i++)
+  parallel(prefix, static_cast<uint64_t>(0), nTracks, nJobs);
+
+  // Means over the tracks with a value at each lag
+  auto &&mean = [](const arma::Row<T> &values, const uint64_t power) {
+    T sum = 0.;
+    uint64_t count = 0;
+    for (auto v : values)
     {
-      nn(0, i) = (i + 1) % N;
-      nn(1, i) = (i + N - 1) % N;
-      nn(2, i) = (i + gridSize) % N;
-      nn(3, i) = (i + N - gridSize) % N;
-      if (i % gridSize == 0)
-      {
-        nn(1, i) = i + gridSize - 1;
-      }
-      if ((i + 1) % gridSize == 0)
+      if (std::isfinite(v))
       {
-        nn(0, i) = i - gridSize + 1;
+        sum += (power == 2) ? v * v : v;
+        count++;
       }
     }
+    return (count > 0) ? sum / count : arma::Datum<T>::nan;
   };
+
+  for (size_t j = 0; j < nLags; j++)
+  {
+    const arma::Row<T> tamsd = analysis(j, arma::span(3, nTracks + 2));
+    const T meanTAMSD = mean(tamsd, 1);
+    analysis(j, 0) = mean(eaMSDall.row(j), 1);
+    analysis(j, 1) = mean(eataMSDall.row(j), 1);
+    analysis(j, 2) = (mean(tamsd, 2) - meanTAMSD * meanTAMSD) / (meanTAMSD * meanTAMSD) / (j + 1); // Ergodicity breaking over s
+  }
+  arma::Mat<T> ensemble = analysis.cols(0, 2);
+  ensemble.elem(arma::find_nonfinite(ensemble)).zeros(); // Check for NaNs
+  analysis.cols(0, 2) = ensemble;
+
+  ids = arma::conv_to<arma::Col<int64_t>>::from(table.ids);
+  firstFrames = arma::conv_to<arma::Col<int64_t>>::from(table.firstFrame);
+  lengths.set_size(nTracks);
+  observed.set_size(nTracks);
+  for (size_t i = 0; i < nTracks; i++)
+  {
+    lengths(i) = table.Length(i);
+    observed(i) = table.observed[i];
+  }
+
+  return 0;
 };
 
 template <typename T>
-uint64_t CTRWwrapper(
-    arma::Col<int64_t> &clusters,
-    arma::Mat<T> &lattice,
-    arma::Mat<T> &analysis,
-    arma::Cube<T> &walks,
+T CTRWspectrum(
+    arma::Mat<T> &dos,
+    const uint64_t gridSize,
+    const uint64_t latticeType,
+    const uint64_t percolationType,
+    const double threshold,
+    const uint64_t nProbes,
+    const uint64_t nLanczos,
+    const uint64_t nBins,
+    const double fitMax,
+    const int64_t randomSeed,
+    const int64_t nJobs)
+{
+  // Percolates as a run with the same seed does, so the spectrum is that
+  // of the same largest cluster, then estimates it by Lanczos quadrature
+  CTRWfractal<T> sim(gridSize, latticeType, percolationType, threshold, false, 0,
+                     0, 0, 0., 1., 0., false, arma::Col<T>(), 0., 0., false, false,
+                     0, randomSeed, nJobs);
+  sim.FindNeighbours();
+  sim.Permute();
+  sim.Percolate();
+
+  return sim.Spectrum(dos, nProbes, nLanczos, nBins, fitMax);
+};
+
+template <typename T>
+void CTRWsplit(
+    arma::Mat<T> &tails,
+    arma::Col<T> &density,
+    const arma::Col<T> &levels,
+    const arma::Col<T> &edges,
+    const uint64_t nClones,
     const uint64_t gridSize,
     const uint64_t latticeType,
+    const uint64_t percolationType,
     const double threshold,
     const uint64_t walkType,
     const uint64_t nWalks,
     const uint64_t nSteps,
     const double beta,
     const double tau0,
-    const double noise,
     const int64_t randomSeed,
     const int64_t nJobs)
 {
-  CTRWfractal<T> *sim = new CTRWfractal<T>(
-      gridSize,
-      latticeType,
-      threshold,
-      walkType,
-      nWalks,
-      nSteps,
-      beta,
-      tau0,
-      noise,
-      randomSeed,
-      nJobs);
-
-  sim->FindNeighbours(); // Identify neighbouring sites
-  sim->Permute();        // Randomize the order in which the sites are occupied
-  sim->Percolate();      // Run the percolation algorithm
-  sim->BuildLattice();   // Build the lattice coordinates
-  sim->GroupClusters();  // Group clusters by root
-
-  if (sim->includeWalks)
+  // Percolates as a run with the same seed does, then estimates the tail
+  // of the final displacement by splitting the walks at the levels
+  if (nClones == 0 || nSteps == 0 || !std::is_sorted(levels.begin(), levels.end()) ||
+      !std::is_sorted(edges.begin(), edges.end()))
   {
-    sim->RandomWalks();  // Run the random walks
-    sim->AddNoise();     // Add noise to walks
-    sim->AnalyseWalks(); // Calculate statistics for walks
+    throw std::invalid_argument("Splitting needs at least one clone and one step, and increasing levels and edges");
   }
 
-  lattice = sim->latticeCoords;
-  //clusters = sim->lattice;
-  clusters = sim->clusters;
-  analysis = sim->analysis;
-  walks = sim->walksCoords;
-
-  if (sim->includeWalks) // Armadillo is Fortran-contiguous, numpy is C-contiguous
+  // A walker splits at most once per level and once per step, so each
+  // root walk ends as at most nClones^min(levels, steps) walkers
+  const uint64_t maxWalkers = 1 << 20;
+  uint64_t walkers = 1;
+  for (size_t l = 0; l < std::min(static_cast<uint64_t>(levels.n_elem), nSteps) && walkers <= maxWalkers; l++)
   {
-    arma::inplace_trans(lattice);
-    arma::inplace_trans(analysis);
+    walkers *= nClones;
+  }
+  if (walkers > maxWalkers)
+  {
+    throw std::invalid_argument("Splitting gives more than " + std::to_string(maxWalkers) +
+                                " walkers per walk, use fewer clones or levels");
   }
 
-  delete sim;
-  return 0;
+  CTRWfractal<T> sim(gridSize, latticeType, percolationType, threshold, false, walkType,
+                     0, 0, beta, tau0, 0., true, arma::Col<T>(), 0., 0., false, false,
+                     0, randomSeed, nJobs);
+  sim.FindNeighbours();
+  sim.Permute();
+  sim.Percolate();
+  sim.BuildLattice();
+  sim.GroupClusters();
+
+  sim.SplitWalks(nWalks, nSteps, levels, nClones, edges, tails, density);
 };
 
 #endif
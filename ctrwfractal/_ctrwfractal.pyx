@@ -22,6 +22,9 @@ import numpy as np
 cimport numpy as np
 cimport cython
 from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+from libcpp.pair cimport pair
 from libc.stdint cimport uint64_t, int64_t
 
 np.import_array()
@@ -98,6 +101,49 @@ cdef extern from "utils/utils.hpp":
     int64_t* GetMemory(Mat[int64_t]& m)
     int64_t* GetMemory(Cube[int64_t]& m)
 
+    cdef cppclass Progress:
+        Progress() nogil
+        uint64_t Get(int which) nogil
+        void Cancel() nogil
+        bool Cancelled() nogil
+
+
+STAGES = ("neighbours", "permutation", "percolation", "walks",
+          "noise", "analysis", "thresholds", "done")
+
+
+cdef class RunProgress:
+    """Counters and cancellation flag shared with a running simulation.
+
+    The counters can be read from any thread while the simulation runs
+    with the GIL released, and ``cancel`` asks it to stop at the next
+    chunk of work.
+    """
+    cdef Progress *c_progress
+
+    def __cinit__(self):
+        self.c_progress = new Progress()
+
+    def __dealloc__(self):
+        del self.c_progress
+
+    def cancel(self):
+        self.c_progress.Cancel()
+
+    @property
+    def cancelled(self):
+        return self.c_progress.Cancelled()
+
+    def counts(self):
+        return {
+            "stage": STAGES[self.c_progress.Get(0)],
+            "sites": self.c_progress.Get(1),
+            "walks": self.c_progress.Get(2),
+            "steps": self.c_progress.Get(3),
+            "lags": self.c_progress.Get(4),
+            "allocations": self.c_progress.Get(5),
+        }
+
 
 cdef np.ndarray[np.int64_t, ndim=1] numpy_from_col_i(Col[int64_t] &m) except +:
     cdef np.npy_intp dim = <np.npy_intp> m.n_elem
@@ -110,6 +156,30 @@ cdef np.ndarray[np.int64_t, ndim=1] numpy_from_col_i(Col[int64_t] &m) except +:
     return arr
 
 
+cdef np.ndarray[np.double_t, ndim=1] numpy_from_col_d(Col[double] &m) except +:
+    cdef np.npy_intp dim = <np.npy_intp> m.n_elem
+    cdef np.ndarray[np.double_t, ndim=1] arr = np.PyArray_SimpleNewFromData(1, &dim, np.NPY_DOUBLE, GetMemory(m))
+
+    if GetMemState[Col[double]](m) == 0:
+        SetMemState[Col[double]](m, 1)
+        PyArray_ENABLEFLAGS(arr, np.NPY_OWNDATA)
+
+    return arr
+
+
+cdef np.ndarray[np.int64_t, ndim=2] numpy_from_mat_i(Mat[int64_t] &m) except +:
+    cdef np.npy_intp dims[2]
+    dims[0] = <np.npy_intp> m.n_cols
+    dims[1] = <np.npy_intp> m.n_rows
+    cdef np.ndarray[np.int64_t, ndim=2] arr = np.PyArray_SimpleNewFromData(2, &dims[0], np.NPY_INT64, GetMemory(m))
+
+    if GetMemState[Mat[int64_t]](m) == 0:
+        SetMemState[Mat[int64_t]](m, 1)
+        PyArray_ENABLEFLAGS(arr, np.NPY_OWNDATA)
+
+    return arr
+
+
 cdef np.ndarray[np.double_t, ndim=2] numpy_from_mat_d(Mat[double] &m) except +:
     cdef np.npy_intp dims[2]
     dims[0] = <np.npy_intp> m.n_cols
@@ -137,25 +207,95 @@ cdef np.ndarray[np.double_t, ndim=3] numpy_from_cube_d(Cube[double] &m) except +
     return arr
 
 
-cdef extern from "_ctrw.hpp":
-    cdef uint64_t c_ctrw "CTRWwrapper"[T] (Col[int64_t] &, Mat[T] &, Mat[T] &, Cube[T] &,
-                                           uint64_t, uint64_t, double,
+cdef extern from "_ctrw.hpp" nogil:
+    cdef uint64_t c_ctrw "CTRWwrapper"[T] (Col[int64_t] &, Mat[T] &, Mat[T] &, Cube[T] &, Mat[T] &,
+                                           Cube[T] &, Cube[T] &, Col[int64_t] &, Col[T] &,
+                                           Mat[int64_t] &, Col[T] &, Mat[int64_t] &,
+                                           uint64_t, uint64_t, uint64_t, double, bool,
                                            uint64_t, uint64_t, uint64_t,
-                                           double, double, double,
-                                           int64_t, int64_t)
+                                           double, double, double, bool, Col[T] &,
+                                           double, double, bool, bool, bool, bool, string, uint64_t,
+                                           int64_t, int64_t, Progress &) except +
+
+    cdef uint64_t c_ctrw_extend "CTRWextend"[T] (Mat[T] &, Cube[T] &, Mat[int64_t] &, Col[T] &,
+                                                 Mat[int64_t] &, Col[T] &, Cube[T] &, Mat[int64_t] &,
+                                                 Col[T] &, Mat[int64_t] &, Col[T] &,
+                                                 uint64_t, uint64_t, uint64_t, double, uint64_t,
+                                                 uint64_t, double, double, bool, uint64_t,
+                                                 int64_t, int64_t) except +
+
+    cdef cppclass CTRWcache[T]:
+        CTRWcache(uint64_t, uint64_t, uint64_t, double, uint64_t, bool, int64_t, int64_t) except +
+        uint64_t Walk(Col[int64_t] &, Mat[T] &, Mat[T] &, Cube[T] &,
+                      uint64_t, uint64_t, double, double, double) except +
+
+    cdef vector[pair[string, uint64_t]] c_ctrw_plan "CTRWplan"[T] (uint64_t, uint64_t, uint64_t, double, bool,
+                                                                   uint64_t, uint64_t, uint64_t,
+                                                                   double, double, double, bool, Col[T] &,
+                                                                   double, double, bool, bool, bool, bool,
+                                                                   uint64_t) except +
+
+    cdef uint64_t c_ctrw_sweep "CTRWsweep"[T] (vector[Col[int64_t]] &, vector[Mat[T]] &,
+                                               vector[Mat[T]] &, vector[Cube[T]] &,
+                                               Col[int64_t] &, Col[int64_t] &, Col[T] &,
+                                               Col[int64_t] &, Col[T] &, Col[T] &, Col[T] &,
+                                               Col[int64_t] &, uint64_t, uint64_t, uint64_t,
+                                               uint64_t, bool, uint64_t, int64_t) except +
+
+    cdef uint64_t c_ctrw_dataset "CTRWdataset"[T] (string, uint64_t, uint64_t, uint64_t, uint64_t,
+                                                   double, double, double, double, double, double,
+                                                   double, uint64_t, uint64_t, uint64_t, uint64_t,
+                                                   uint64_t, int64_t) except +
+
+    cdef uint64_t c_ctrw_abc "CTRWabc"[T] (Mat[T] &, Mat[T] &, Mat[T] &, Cube[T] &,
+                                           uint64_t, uint64_t, uint64_t, double, double,
+                                           double, double, double, double, double, double,
+                                           uint64_t, uint64_t, uint64_t, uint64_t,
+                                           uint64_t, int64_t) except +
+
+    cdef uint64_t c_ctrw_ageing "CTRWageing"[T] (Cube[T] &, Cube[T] &, Col[int64_t] &,
+                                                 Col[int64_t] &, Col[int64_t] &, int64_t) except +
+
+    cdef uint64_t c_ctrw_dwell "CTRWdwell"[T] (Col[int64_t] &, Mat[T] &, Mat[T] &, Cube[T] &,
+                                               double, double, uint64_t, uint64_t, int64_t) except +
+
+    cdef uint64_t c_ctrw_tracks "CTRWtracks"[T] (Mat[T] &, Col[int64_t] &, Col[int64_t] &, Col[int64_t] &,
+                                                 Col[int64_t] &, string, bool, char, uint64_t, int64_t) except +
+
+    cdef double c_ctrw_spectrum "CTRWspectrum"[T] (Mat[T] &, uint64_t, uint64_t, uint64_t, double,
+                                                   uint64_t, uint64_t, uint64_t, double,
+                                                   int64_t, int64_t) except +
+
+    cdef void c_ctrw_split "CTRWsplit"[T] (Mat[T] &, Col[T] &, Col[T] &, Col[T] &, uint64_t,
+                                           uint64_t, uint64_t, uint64_t, double, uint64_t,
+                                           uint64_t, uint64_t, double, double,
+                                           int64_t, int64_t) except +
 
 
 def ctrw_fractal(uint64_t grid_size = 32,
                  uint64_t lattice_type = 0,
+                 uint64_t percolation_type = 0,
                  double threshold = 0.0,
+                 bool sweep = False,
                  uint64_t walk_type = 0,
                  uint64_t n_walks = 0,
                  uint64_t n_steps = 0,
                  double beta = 0.0,
                  double tau0 = 1.0,
                  double noise = 0.0,
+                 bool accelerate = False,
+                 walk_thresholds = None,
+                 double switch_on = 0.0,
+                 double switch_off = 0.0,
+                 bool dynamic_clusters = False,
+                 bool exclusion = False,
+                 bool backbone = False,
+                 bool extendable = False,
+                 output = None,
+                 uint64_t memory_limit = 0,
                  int64_t random_seed = -1,
-                 int64_t n_jobs = -1):
+                 int64_t n_jobs = -1,
+                 RunProgress progress = None):
 
     cdef uint64_t result
 
@@ -163,37 +303,627 @@ def ctrw_fractal(uint64_t grid_size = 32,
     cdef np.ndarray[np.double_t, ndim=2] lattice
     cdef np.ndarray[np.double_t, ndim=2] analysis
     cdef np.ndarray[np.double_t, ndim=3] walks
+    cdef np.ndarray[np.double_t, ndim=2] percolation_sweep
+    cdef np.ndarray[np.double_t, ndim=3] threshold_walks
+    cdef np.ndarray[np.double_t, ndim=3] threshold_analysis
+    cdef np.ndarray[np.double_t, ndim=1] thresholds
+    cdef np.ndarray[np.int64_t, ndim=1] backbone_labels
+    cdef np.ndarray[np.double_t, ndim=1] residence
+    cdef np.ndarray[np.int64_t, ndim=2] walk_state
+    cdef np.ndarray[np.double_t, ndim=1] next_jump
+    cdef np.ndarray[np.int64_t, ndim=2] lag_sums
 
     cdef Col[int64_t] _clusters
     cdef Mat[double] _lattice
     cdef Mat[double] _analysis
     cdef Cube[double] _walks
+    cdef Mat[double] _percolation_sweep
+    cdef Cube[double] _threshold_walks
+    cdef Cube[double] _threshold_analysis
+    cdef Col[double] _walk_thresholds
+    cdef Col[int64_t] _backbone
+    cdef Col[double] _residence
+    cdef Mat[int64_t] _walk_state
+    cdef Col[double] _next_jump
+    cdef Mat[int64_t] _lag_sums
 
     _clusters = Col[int64_t]()
     _lattice = Mat[double]()
     _analysis = Mat[double]()
     _walks = Cube[double]()
-
-    result = c_ctrw[double](_clusters,
-                            _lattice,
-                            _analysis,
-                            _walks,
-                            grid_size,
-                            lattice_type,
-                            threshold,
-                            walk_type,
-                            n_walks,
-                            n_steps,
-                            beta,
-                            tau0,
-                            noise,
-                            random_seed,
-                            n_jobs)
+    _percolation_sweep = Mat[double]()
+    _threshold_walks = Cube[double]()
+    _threshold_analysis = Cube[double]()
+    _backbone = Col[int64_t]()
+    _residence = Col[double]()
+    _walk_state = Mat[int64_t]()
+    _next_jump = Col[double]()
+    _lag_sums = Mat[int64_t]()
+
+    cdef string output_path = b"" if output is None else str(output).encode()
+
+    if walk_thresholds is None:
+        walk_thresholds = []
+    thresholds = np.ascontiguousarray(walk_thresholds, dtype=np.double)
+    _walk_thresholds = Col[double](<double*> np.PyArray_DATA(thresholds), thresholds.shape[0], True, False)
+
+    if progress is None:
+        progress = RunProgress()
+    cdef Progress *c_progress = progress.c_progress
+
+    with nogil:  # So that Python threads can poll or cancel while this runs
+        result = c_ctrw[double](_clusters,
+                                _lattice,
+                                _analysis,
+                                _walks,
+                                _percolation_sweep,
+                                _threshold_walks,
+                                _threshold_analysis,
+                                _backbone,
+                                _residence,
+                                _walk_state,
+                                _next_jump,
+                                _lag_sums,
+                                grid_size,
+                                lattice_type,
+                                percolation_type,
+                                threshold,
+                                sweep,
+                                walk_type,
+                                n_walks,
+                                n_steps,
+                                beta,
+                                tau0,
+                                noise,
+                                accelerate,
+                                _walk_thresholds,
+                                switch_on,
+                                switch_off,
+                                dynamic_clusters,
+                                exclusion,
+                                backbone,
+                                extendable,
+                                output_path,
+                                memory_limit,
+                                random_seed,
+                                n_jobs,
+                                c_progress[0])
 
     clusters = numpy_from_col_i(_clusters)
     lattice = numpy_from_mat_d(_lattice)
     analysis = numpy_from_mat_d(_analysis)
     walks = numpy_from_cube_d(_walks)
+    percolation_sweep = numpy_from_mat_d(_percolation_sweep)
+    threshold_walks = numpy_from_cube_d(_threshold_walks)
+    threshold_analysis = numpy_from_cube_d(_threshold_analysis)
+    backbone_labels = numpy_from_col_i(_backbone)
+    residence = numpy_from_col_d(_residence)
+    walk_state = numpy_from_mat_i(_walk_state)
+    next_jump = numpy_from_col_d(_next_jump)
+    lag_sums = numpy_from_mat_i(_lag_sums)
+
+    return (clusters, lattice, walks, analysis, percolation_sweep,
+            threshold_walks, threshold_analysis, backbone_labels, residence,
+            (walk_state, next_jump, lag_sums), result)
+
+
+def ctrw_extend(walks,
+                walk_state,
+                next_jump,
+                lag_sums,
+                residence = None,
+                uint64_t n_steps = 0,
+                uint64_t grid_size = 32,
+                uint64_t lattice_type = 0,
+                uint64_t percolation_type = 0,
+                double threshold = 0.0,
+                uint64_t walk_type = 0,
+                double beta = 0.0,
+                double tau0 = 1.0,
+                bool backbone = False,
+                uint64_t memory_limit = 0,
+                int64_t random_seed = -1,
+                int64_t n_jobs = -1):
+
+    # (walks, steps, 2) in C order is a (2, steps, walks) cube in Fortran order,
+    # and the (walks, k) state arrays are (k, walks) matrices
+    cdef np.ndarray[np.double_t, ndim=3] walks_ = np.ascontiguousarray(walks, dtype=np.double)
+    cdef np.ndarray[np.int64_t, ndim=2] state_ = np.ascontiguousarray(walk_state, dtype=np.int64)
+    cdef np.ndarray[np.double_t, ndim=1] jumps_ = np.ascontiguousarray(next_jump, dtype=np.double)
+    cdef np.ndarray[np.int64_t, ndim=2] sums_ = np.ascontiguousarray(lag_sums, dtype=np.int64)
+    cdef np.ndarray[np.double_t, ndim=1] residence_ = np.ascontiguousarray(
+        np.zeros(0) if residence is None else residence, dtype=np.double
+    )
+
+    cdef Cube[double] _previous_walks = Cube[double](<double*> np.PyArray_DATA(walks_),
+                                                     walks_.shape[2], walks_.shape[1],
+                                                     walks_.shape[0], False, True)
+    cdef Mat[int64_t] _previous_state = Mat[int64_t](<int64_t*> np.PyArray_DATA(state_),
+                                                     state_.shape[1], state_.shape[0], False, True)
+    cdef Col[double] _previous_jumps = Col[double](<double*> np.PyArray_DATA(jumps_),
+                                                   jumps_.shape[0], False, True)
+    cdef Mat[int64_t] _previous_sums = Mat[int64_t](<int64_t*> np.PyArray_DATA(sums_),
+                                                    sums_.shape[1], sums_.shape[0], False, True)
+    cdef Col[double] _previous_residence = Col[double](<double*> np.PyArray_DATA(residence_),
+                                                       residence_.shape[0], False, True)
+
+    cdef Mat[double] _analysis = Mat[double]()
+    cdef Cube[double] _walks = Cube[double]()
+    cdef Mat[int64_t] _walk_state = Mat[int64_t]()
+    cdef Col[double] _next_jump = Col[double]()
+    cdef Mat[int64_t] _lag_sums = Mat[int64_t]()
+    cdef Col[double] _residence = Col[double]()
+
+    with nogil:
+        c_ctrw_extend[double](_analysis, _walks, _walk_state, _next_jump, _lag_sums, _residence,
+                              _previous_walks, _previous_state, _previous_jumps, _previous_sums,
+                              _previous_residence, grid_size, lattice_type, percolation_type,
+                              threshold, walk_type, n_steps, beta, tau0, backbone,
+                              memory_limit, random_seed, n_jobs)
+
+    return (numpy_from_cube_d(_walks), numpy_from_mat_d(_analysis),
+            (numpy_from_mat_i(_walk_state), numpy_from_col_d(_next_jump),
+             numpy_from_mat_i(_lag_sums)),
+            numpy_from_col_d(_residence))
+
+
+
+def ctrw_memory_plan(uint64_t grid_size = 32,
+                     uint64_t lattice_type = 0,
+                     uint64_t percolation_type = 0,
+                     double threshold = 0.0,
+                     bool sweep = False,
+                     uint64_t walk_type = 0,
+                     uint64_t n_walks = 0,
+                     uint64_t n_steps = 0,
+                     double beta = 0.0,
+                     double tau0 = 1.0,
+                     double noise = 0.0,
+                     bool accelerate = False,
+                     walk_thresholds = None,
+                     double switch_on = 0.0,
+                     double switch_off = 0.0,
+                     bool dynamic_clusters = False,
+                     bool exclusion = False,
+                     bool backbone = False,
+                     bool extendable = False,
+                     uint64_t memory_limit = 0):
+
+    cdef np.ndarray[np.double_t, ndim=1] thresholds
+    cdef Col[double] _walk_thresholds
+    cdef vector[pair[string, uint64_t]] plan
+
+    if walk_thresholds is None:
+        walk_thresholds = []
+    thresholds = np.ascontiguousarray(walk_thresholds, dtype=np.double)
+    _walk_thresholds = Col[double](<double*> np.PyArray_DATA(thresholds), thresholds.shape[0], True, False)
+
+    plan = c_ctrw_plan[double](grid_size,
+                               lattice_type,
+                               percolation_type,
+                               threshold,
+                               sweep,
+                               walk_type,
+                               n_walks,
+                               n_steps,
+                               beta,
+                               tau0,
+                               noise,
+                               accelerate,
+                               _walk_thresholds,
+                               switch_on,
+                               switch_off,
+                               dynamic_clusters,
+                               exclusion,
+                               backbone,
+                               extendable,
+                               memory_limit)
+
+    return {name.decode(): n_bytes for name, n_bytes in plan}
+
+
+def ctrw_sweep(grid_sizes,
+               thresholds,
+               random_seeds,
+               betas,
+               tau0s,
+               noises,
+               n_steps,
+               uint64_t lattice_type = 0,
+               uint64_t percolation_type = 0,
+               uint64_t walk_type = 0,
+               uint64_t n_walks = 0,
+               bool accelerate = False,
+               uint64_t memory_limit = 0,
+               int64_t n_jobs = -1):
 
-    return clusters, lattice, walks, analysis, result
+    cdef uint64_t result
+    cdef size_t i
+
+    cdef np.ndarray[np.int64_t, ndim=1] lattice_index
+
+    cdef np.ndarray[np.int64_t, ndim=1] grid_sizes_ = np.ascontiguousarray(grid_sizes, dtype=np.int64)
+    cdef np.ndarray[np.double_t, ndim=1] thresholds_ = np.ascontiguousarray(thresholds, dtype=np.double)
+    cdef np.ndarray[np.int64_t, ndim=1] random_seeds_ = np.ascontiguousarray(random_seeds, dtype=np.int64)
+    cdef np.ndarray[np.double_t, ndim=1] betas_ = np.ascontiguousarray(betas, dtype=np.double)
+    cdef np.ndarray[np.double_t, ndim=1] tau0s_ = np.ascontiguousarray(tau0s, dtype=np.double)
+    cdef np.ndarray[np.double_t, ndim=1] noises_ = np.ascontiguousarray(noises, dtype=np.double)
+    cdef np.ndarray[np.int64_t, ndim=1] n_steps_ = np.ascontiguousarray(n_steps, dtype=np.int64)
+
+    cdef vector[Col[int64_t]] _clusters
+    cdef vector[Mat[double]] _lattices
+    cdef vector[Mat[double]] _analyses
+    cdef vector[Cube[double]] _walks
+    cdef Col[int64_t] _lattice_index
+
+    cdef Col[int64_t] _grid_sizes = Col[int64_t](<int64_t*> np.PyArray_DATA(grid_sizes_), grid_sizes_.shape[0], True, False)
+    cdef Col[double] _thresholds = Col[double](<double*> np.PyArray_DATA(thresholds_), thresholds_.shape[0], True, False)
+    cdef Col[int64_t] _random_seeds = Col[int64_t](<int64_t*> np.PyArray_DATA(random_seeds_), random_seeds_.shape[0], True, False)
+    cdef Col[double] _betas = Col[double](<double*> np.PyArray_DATA(betas_), betas_.shape[0], True, False)
+    cdef Col[double] _tau0s = Col[double](<double*> np.PyArray_DATA(tau0s_), tau0s_.shape[0], True, False)
+    cdef Col[double] _noises = Col[double](<double*> np.PyArray_DATA(noises_), noises_.shape[0], True, False)
+    cdef Col[int64_t] _n_steps = Col[int64_t](<int64_t*> np.PyArray_DATA(n_steps_), n_steps_.shape[0], True, False)
+
+    with nogil:
+        result = c_ctrw_sweep[double](_clusters,
+                                      _lattices,
+                                      _analyses,
+                                      _walks,
+                                      _lattice_index,
+                                      _grid_sizes,
+                                      _thresholds,
+                                      _random_seeds,
+                                      _betas,
+                                      _tau0s,
+                                      _noises,
+                                      _n_steps,
+                                      lattice_type,
+                                      percolation_type,
+                                      walk_type,
+                                      n_walks,
+                                      accelerate,
+                                      memory_limit,
+                                      n_jobs)
+
+    clusters = []
+    lattices = []
+    for i in range(_clusters.size()):
+        clusters.append(numpy_from_col_i(_clusters[i]))
+        lattices.append(numpy_from_mat_d(_lattices[i]))
+
+    walks = []
+    analyses = []
+    for i in range(_walks.size()):
+        walks.append(numpy_from_cube_d(_walks[i]))
+        analyses.append(numpy_from_mat_d(_analyses[i]))
+
+    lattice_index = numpy_from_col_i(_lattice_index)
+
+    return clusters, lattices, walks, analyses, lattice_index, result
+
+
+def ctrw_dataset(path,
+                 uint64_t n_tracks,
+                 uint64_t n_steps,
+                 uint64_t tracks_per_shard,
+                 uint64_t tracks_per_lattice,
+                 double beta_low,
+                 double beta_high,
+                 double threshold_low,
+                 double threshold_high,
+                 double noise_low,
+                 double noise_high,
+                 double tau0 = 1.0,
+                 uint64_t grid_size = 32,
+                 uint64_t lattice_type = 0,
+                 uint64_t percolation_type = 0,
+                 uint64_t walk_type = 0,
+                 uint64_t random_seed = 0,
+                 int64_t n_jobs = -1):
+
+    cdef uint64_t n_shards
+    cdef string _path = str(path).encode()
+
+    with nogil:
+        n_shards = c_ctrw_dataset[double](_path,
+                                          n_tracks,
+                                          n_steps,
+                                          tracks_per_shard,
+                                          tracks_per_lattice,
+                                          beta_low,
+                                          beta_high,
+                                          threshold_low,
+                                          threshold_high,
+                                          noise_low,
+                                          noise_high,
+                                          tau0,
+                                          grid_size,
+                                          lattice_type,
+                                          percolation_type,
+                                          walk_type,
+                                          random_seed,
+                                          n_jobs)
+
+    return n_shards
+
+
+cdef class LatticeCache:
+    """A percolated lattice kept in memory between sets of random walks.
+
+    Each call to ``walk`` gives the same result as a standalone run with
+    the same parameters, but skips the neighbour search, permutation and
+    percolation. Not thread-safe: callers must serialise ``walk``.
+    """
+    cdef CTRWcache[double] *c_cache
+
+    def __cinit__(self,
+                  uint64_t grid_size = 32,
+                  uint64_t lattice_type = 0,
+                  uint64_t percolation_type = 0,
+                  double threshold = 0.0,
+                  uint64_t walk_type = 0,
+                  bool accelerate = False,
+                  int64_t random_seed = -1,
+                  int64_t n_jobs = -1):
+        with nogil:
+            self.c_cache = new CTRWcache[double](grid_size,
+                                                 lattice_type,
+                                                 percolation_type,
+                                                 threshold,
+                                                 walk_type,
+                                                 accelerate,
+                                                 random_seed,
+                                                 n_jobs)
+
+    def __dealloc__(self):
+        del self.c_cache
+
+    def walk(self,
+             uint64_t n_walks = 0,
+             uint64_t n_steps = 0,
+             double beta = 0.0,
+             double tau0 = 1.0,
+             double noise = 0.0):
+
+        cdef np.ndarray[np.int64_t, ndim=1] clusters
+        cdef np.ndarray[np.double_t, ndim=2] lattice
+        cdef np.ndarray[np.double_t, ndim=2] analysis
+        cdef np.ndarray[np.double_t, ndim=3] walks
+
+        cdef Col[int64_t] _clusters
+        cdef Mat[double] _lattice
+        cdef Mat[double] _analysis
+        cdef Cube[double] _walks
+
+        with nogil:
+            self.c_cache.Walk(_clusters, _lattice, _analysis, _walks,
+                              n_walks, n_steps, beta, tau0, noise)
+
+        clusters = numpy_from_col_i(_clusters)
+        lattice = numpy_from_mat_d(_lattice)
+        analysis = numpy_from_mat_d(_analysis)
+        walks = numpy_from_cube_d(_walks)
+
+        return clusters, lattice, walks, analysis
+
+
+def ctrw_abc(observed,
+             uint64_t n_walks,
+             uint64_t n_particles,
+             uint64_t n_rounds,
+             double quantile,
+             double min_acceptance,
+             double beta_low,
+             double beta_high,
+             double threshold_low,
+             double threshold_high,
+             double noise = 0.0,
+             double tau0 = 1.0,
+             uint64_t grid_size = 32,
+             uint64_t lattice_type = 0,
+             uint64_t percolation_type = 0,
+             uint64_t walk_type = 0,
+             uint64_t random_seed = 0,
+             int64_t n_jobs = -1):
+
+    cdef uint64_t n_rounds_run
+
+    cdef np.ndarray[np.double_t, ndim=2] particles
+    cdef np.ndarray[np.double_t, ndim=2] history
+    cdef np.ndarray[np.double_t, ndim=2] statistics
+
+    # (tracks, steps, 2) in C order is a (2, steps, tracks) cube in Fortran order
+    cdef np.ndarray[np.double_t, ndim=3] observed_ = np.ascontiguousarray(observed, dtype=np.double)
+
+    cdef Mat[double] _particles
+    cdef Mat[double] _history
+    cdef Mat[double] _statistics
+    cdef Cube[double] _observed = Cube[double](<double*> np.PyArray_DATA(observed_),
+                                               observed_.shape[2], observed_.shape[1],
+                                               observed_.shape[0], False, True)
+
+    with nogil:
+        n_rounds_run = c_ctrw_abc[double](_particles,
+                                          _history,
+                                          _statistics,
+                                          _observed,
+                                          n_walks,
+                                          n_particles,
+                                          n_rounds,
+                                          quantile,
+                                          min_acceptance,
+                                          beta_low,
+                                          beta_high,
+                                          threshold_low,
+                                          threshold_high,
+                                          noise,
+                                          tau0,
+                                          grid_size,
+                                          lattice_type,
+                                          percolation_type,
+                                          walk_type,
+                                          random_seed,
+                                          n_jobs)
+
+    particles = numpy_from_mat_d(_particles)
+    history = numpy_from_mat_d(_history)
+    statistics = numpy_from_mat_d(_statistics)
+
+    return particles, history, statistics
+
+
+def ctrw_ageing(walks,
+                ageing_times,
+                window_lengths,
+                lags,
+                int64_t n_jobs = -1):
+
+    cdef np.ndarray[np.double_t, ndim=3] out
+
+    # (walks, steps, 2) in C order is a (2, steps, walks) cube in Fortran order
+    cdef np.ndarray[np.double_t, ndim=3] walks_ = np.ascontiguousarray(walks, dtype=np.double)
+    cdef np.ndarray[np.int64_t, ndim=1] ageing_times_ = np.ascontiguousarray(ageing_times, dtype=np.int64)
+    cdef np.ndarray[np.int64_t, ndim=1] window_lengths_ = np.ascontiguousarray(window_lengths, dtype=np.int64)
+    cdef np.ndarray[np.int64_t, ndim=1] lags_ = np.ascontiguousarray(lags, dtype=np.int64)
+
+    cdef Cube[double] _out
+    cdef Cube[double] _walks = Cube[double](<double*> np.PyArray_DATA(walks_),
+                                            walks_.shape[2], walks_.shape[1],
+                                            walks_.shape[0], False, True)
+    cdef Col[int64_t] _ageing_times = Col[int64_t](<int64_t*> np.PyArray_DATA(ageing_times_), ageing_times_.shape[0], True, False)
+    cdef Col[int64_t] _window_lengths = Col[int64_t](<int64_t*> np.PyArray_DATA(window_lengths_), window_lengths_.shape[0], True, False)
+    cdef Col[int64_t] _lags = Col[int64_t](<int64_t*> np.PyArray_DATA(lags_), lags_.shape[0], True, False)
+
+    with nogil:
+        c_ctrw_ageing[double](_out, _walks, _ageing_times, _window_lengths, _lags, n_jobs)
+
+    # (nLags, nWindows * nAgeing, nWalks) is (nWalks, nAgeing, nWindows, nLags) in C order
+    out = numpy_from_cube_d(_out)
+
+    return out.reshape(walks_.shape[0], ageing_times_.shape[0], window_lengths_.shape[0], lags_.shape[0])
+
+
+def ctrw_dwell(walks,
+               double noise = -1.0,
+               double penalty = -1.0,
+               uint64_t t_min = 2,
+               uint64_t n_bins = 20,
+               int64_t n_jobs = -1):
+
+    cdef np.ndarray[np.int64_t, ndim=1] segments
+    cdef np.ndarray[np.double_t, ndim=2] histogram
+    cdef np.ndarray[np.double_t, ndim=2] exponents
+
+    # (walks, steps, 2) in C order is a (2, steps, walks) cube in Fortran order
+    cdef np.ndarray[np.double_t, ndim=3] walks_ = np.ascontiguousarray(walks, dtype=np.double)
+
+    cdef Col[int64_t] _segments
+    cdef Mat[double] _histogram
+    cdef Mat[double] _exponents
+    cdef Cube[double] _walks = Cube[double](<double*> np.PyArray_DATA(walks_),
+                                            walks_.shape[2], walks_.shape[1],
+                                            walks_.shape[0], False, True)
+
+    with nogil:
+        c_ctrw_dwell[double](_segments, _histogram, _exponents, _walks,
+                             noise, penalty, t_min, n_bins, n_jobs)
+
+    segments = numpy_from_col_i(_segments)
+    histogram = numpy_from_mat_d(_histogram)
+    exponents = numpy_from_mat_d(_exponents)
+
+    return segments.reshape(walks_.shape[0], walks_.shape[1]), histogram, exponents
+
+
+def ctrw_tracks(path,
+                bool binary = False,
+                delimiter = ",",
+                uint64_t max_lag = 0,
+                int64_t n_jobs = -1):
+
+    cdef np.ndarray[np.double_t, ndim=2] analysis
+
+    cdef string _path = str(path).encode()
+    cdef char _delimiter = ord(delimiter)
+    cdef Mat[double] _analysis
+    cdef Col[int64_t] _ids
+    cdef Col[int64_t] _first_frames
+    cdef Col[int64_t] _lengths
+    cdef Col[int64_t] _observed
+
+    with nogil:
+        c_ctrw_tracks[double](_analysis, _ids, _first_frames, _lengths, _observed,
+                              _path, binary, _delimiter, max_lag, n_jobs)
+
+    analysis = numpy_from_mat_d(_analysis)
 
+    return (
+        analysis,
+        numpy_from_col_i(_ids),
+        numpy_from_col_i(_first_frames),
+        numpy_from_col_i(_lengths),
+        numpy_from_col_i(_observed),
+    )
+
+
+def ctrw_spectrum(uint64_t grid_size = 32,
+                  uint64_t lattice_type = 0,
+                  uint64_t percolation_type = 0,
+                  double threshold = 0.0,
+                  uint64_t n_probes = 16,
+                  uint64_t n_lanczos = 150,
+                  uint64_t n_bins = 40,
+                  double fit_max = 1.0,
+                  int64_t random_seed = -1,
+                  int64_t n_jobs = -1):
+
+    cdef np.ndarray[np.double_t, ndim=2] dos
+    cdef Mat[double] _dos
+    cdef double dimension
+
+    with nogil:
+        dimension = c_ctrw_spectrum[double](_dos, grid_size, lattice_type, percolation_type, threshold,
+                                            n_probes, n_lanczos, n_bins, fit_max, random_seed, n_jobs)
+
+    # (nBins, 3) is (3, nBins) in C order, one row per quantity
+    dos = numpy_from_mat_d(_dos)
+
+    return dos, dimension
+
+
+def ctrw_split(levels,
+               edges,
+               uint64_t n_clones = 4,
+               uint64_t grid_size = 32,
+               uint64_t lattice_type = 0,
+               uint64_t percolation_type = 0,
+               double threshold = 0.0,
+               uint64_t walk_type = 0,
+               uint64_t n_walks = 1,
+               uint64_t n_steps = 10,
+               double beta = 0.0,
+               double tau0 = 1.0,
+               int64_t random_seed = -1,
+               int64_t n_jobs = -1):
+
+    cdef np.ndarray[np.double_t, ndim=2] tails
+    cdef np.ndarray[np.double_t, ndim=1] density
+
+    cdef np.ndarray[np.double_t, ndim=1] levels_ = np.ascontiguousarray(levels, dtype=np.double)
+    cdef np.ndarray[np.double_t, ndim=1] edges_ = np.ascontiguousarray(edges, dtype=np.double)
+
+    cdef Mat[double] _tails
+    cdef Col[double] _density
+    cdef Col[double] _levels = Col[double](<double*> np.PyArray_DATA(levels_), levels_.shape[0], True, False)
+    cdef Col[double] _edges = Col[double](<double*> np.PyArray_DATA(edges_), edges_.shape[0], True, False)
+
+    with nogil:
+        c_ctrw_split[double](_tails, _density, _levels, _edges, n_clones, grid_size, lattice_type,
+                             percolation_type, threshold, walk_type, n_walks, n_steps, beta, tau0,
+                             random_seed, n_jobs)
+
+    # (nLevels, 4) is (4, nLevels) in C order, one row per quantity
+    tails = numpy_from_mat_d(_tails)
+    density = numpy_from_col_d(_density)
+
+    return tails, density
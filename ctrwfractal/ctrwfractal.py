@@ -15,6 +15,12 @@
 # You should have received a copy of the GNU General Public License
 # along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
 
+import itertools
+import json
+import os
+import threading
+import warnings
+
 import matplotlib.pyplot as plt
 import numpy as np
 import pandas as pd
@@ -23,16 +29,117 @@ from matplotlib.collections import PatchCollection
 from matplotlib.lines import Line2D
 from matplotlib.patches import Circle, Patch
 
-from ._ctrwfractal import ctrw_fractal
+from ._ctrwfractal import (
+    RunProgress,
+    ctrw_abc,
+    ctrw_ageing,
+    ctrw_dataset,
+    ctrw_dwell,
+    ctrw_extend,
+    ctrw_fractal,
+    ctrw_memory_plan,
+    ctrw_spectrum,
+    ctrw_split,
+    ctrw_sweep,
+    ctrw_tracks,
+)
+
+
+class WalkAnalysis:
+    """Random walk statistics as NumPy arrays.
+
+    Every array is a view of the buffer returned by the simulation, so
+    nothing is copied, however many walks there are.
+
+    Parameters
+    ----------
+    data : array-like, shape (n_walks + 3, n_lags)
+        The ensemble MSD, ensemble TAMSD and ergodicity breaking
+        parameter, followed by the TAMSD of each walk, at lags
+        1 to n_lags.
+
+    Attributes
+    ----------
+    lags : array-like, shape (n_lags,)
+        The lags, in steps.
+    eamsd : array-like, shape (n_lags,)
+        Ensemble mean-squared displacement.
+    eatamsd : array-like, shape (n_lags,)
+        Ensemble time-averaged mean-squared displacement.
+    ergodicity : array-like, shape (n_lags,)
+        Ergodicity breaking parameter.
+    tamsd : array-like, shape (n_walks, n_lags)
+        Time-averaged mean-squared displacement of each walk.
+
+    """
+
+    quantities = (
+        "EnsembleMSD",
+        "EnsembleTimeAveragedMSD",
+        "ErgodicityBreaking",
+        "TimeAveragedMSD",
+    )
+
+    def __init__(self, data):
+        self.data = data
+        self.lags = np.arange(1, data.shape[1] + 1)
+        self.eamsd = data[0]
+        self.eatamsd = data[1]
+        self.ergodicity = data[2]
+        self.tamsd = data[3:]
+
+    def to_frame(self):
+        """Wide DataFrame with one column per ensemble vector and per walk."""
+        columns = list(self.quantities[:3])
+        columns.extend([f"TimeAveragedMSD_Walk{i}" for i in range(len(self.tamsd))])
+
+        return pd.DataFrame(self.data.T, columns=columns, copy=False)
+
+    def to_arrow(self):
+        """Long-format Arrow table with columns quantity, walk, lag and value.
+
+        The walk is null for the ensemble quantities. The value column
+        shares the buffer of the simulation.
+        """
+        import pyarrow as pa
+
+        n_rows, n_lags = self.data.shape
+        rows = np.arange(n_rows)
+        quantity = pa.DictionaryArray.from_arrays(
+            np.repeat(np.minimum(rows, 3).astype(np.int8), n_lags),
+            list(self.quantities),
+        )
+        walk = np.repeat(rows - 3, n_lags)
+
+        return pa.table(
+            {
+                "quantity": quantity,
+                "walk": pa.array(walk, mask=walk < 0),
+                "lag": np.tile(self.lags, n_rows),
+                "value": pa.array(self.data.reshape(-1)),
+            }
+        )
+
+
+def _format_analysis(analysis, analysis_format):
+    """Wrap an analysis ndarray as a DataFrame, WalkAnalysis or pyarrow.Table."""
+    lean = WalkAnalysis(analysis)
+
+    if analysis_format == "numpy":
+        return lean
+    elif analysis_format == "arrow":
+        return lean.to_arrow()
+
+    return lean.to_frame()
 
 
 class CTRWfractal:
-    """Continuous-time random walks on 2D site percolation clusters.
+    """Continuous-time random walks on 2D site or bond percolation clusters.
 
     The percolation clusters are generated using the periodic algorithm
-    described in [New2001]_. Sites in a 2D lattice are randomly occupied
-    according to a percolation threshold between 0 (all sites unoccupied)
-    and 1 (all sites occupied).
+    described in [New2001]_. Sites (or bonds) in a 2D lattice are randomly
+    occupied according to a percolation threshold between 0 (all sites
+    unoccupied) and 1 (all sites occupied).
 
     Continuous-time random walks (CTRW) of a particle on the occupied
     clusters are carried out using the following power-law distribution
@@ -51,10 +158,20 @@ class CTRWfractal:
         - If "square", then a 2D square lattice is generated.
         - If "honeycomb", then a 2D honeycomb (or graphene) lattice
           is generated.
+    percolation_type : str {"site", "bond"}, default="site"
+        - If "site", then sites are occupied and walkers move between
+          neighbouring occupied sites.
+        - If "bond", then all sites are present, bonds between them are
+          opened, and walkers only move along open bonds.
     threshold : None or float, default=None
-        The fraction of occupied sites on the lattice. If None,
-        then the critical percolation threshold for the given
-        ``lattice_type`` is used.
+        The fraction of occupied sites (or open bonds) on the lattice.
+        If None, then the critical percolation threshold for the given
+        ``lattice_type`` and ``percolation_type`` is used.
+    sweep : bool, default=False
+        If True, continue adding sites (or bonds) beyond ``threshold``
+        until the lattice is full, recording the size of the largest
+        cluster and the mean cluster size after each addition. The
+        clusters and walks are unaffected. See ``percolation_curve``.
     walk_type : str {"all", "largest"}, default="all"
         - If "all", then the random walks can occur on any of the
           clusters on the 2D lattice.
@@ -72,6 +189,71 @@ class CTRWfractal:
     noise : None or float, default=None
         If not None, add zero-mean Gaussian noise to the random walks
         with standard deviation=``noise``.
+    accelerate : bool, default=False
+        If True, the waiting times are drawn before each hop and the
+        walk stops once the observation window of ``n_steps`` is filled,
+        so only the hops that appear in ``walks_`` are simulated. The
+        statistics are unchanged, but this is much faster for heavy-tailed
+        waiting times (small ``beta``) or ``tau0 < 1``. Note that each
+        walk draws from a random number stream of its own, so walks for
+        a given ``random_seed`` differ from the default mode.
+    walk_thresholds : None or array-like, default=None
+        If not None, also simulate ``n_walks`` random walks at each of
+        these thresholds on the same realization of the lattice. The
+        occupancy at any threshold is given by the rank of each site
+        (or bond) in the percolation order, so no further percolation
+        or lattices are needed, and all the walks run in parallel.
+    switch_rates : None or tuple of floats (k_on, k_off), default=None
+        If not None, the disorder is dynamic: while the particles walk,
+        each empty site (or closed bond) becomes occupied with rate
+        ``k_on`` and each occupied site (or open bond) becomes empty
+        with rate ``k_off``, per unit time. Walkers only hop onto sites
+        (or along bonds) that are occupied at the time of the hop.
+    dynamic_clusters : bool, default=False
+        If True and ``switch_rates`` is not None, relabel ``clusters_``
+        from the occupancy at the end of the walks. Otherwise the
+        clusters describe the initial configuration.
+    exclusion : bool, default=False
+        If True, the ``n_walks`` particles walk at the same time with
+        hard-core exclusion, so that no two particles share a site, and
+        a hop onto a site holding another particle is rejected. Not
+        available together with ``switch_rates``.
+    backbone : bool, default=False
+        If True, split the largest cluster into its backbone and its
+        dangling ends (see ``backbone_``), and record the time each walk
+        spends on the backbone. The backbone joins the blocks of the
+        cluster that wrap around the periodic lattice or, if none does,
+        those with a loop. Needs ``grid_size >= 3``, and not available
+        together with ``switch_rates``.
+    extendable : bool, default=False
+        If True, keep where each walk stopped and the sums behind its
+        TAMSD, so that ``extend`` can carry the walks on to more steps.
+        Needs ``accelerate=True`` and noise-free walks on a static
+        lattice, without ``walk_thresholds`` or ``output``. If
+        ``random_seed`` is None, a seed is drawn, so that the lattice
+        can be rebuilt.
+    output : None or str, default=None
+        If not None, path of a Zarr directory to which the lattice,
+        clusters, walks and analysis are written as zlib-compressed
+        chunks while the simulation runs. The run parameters and the
+        random seed are stored as attributes of the group, so the
+        directory can be opened with ``zarr.open(output)``, and the run
+        repeated with ``CTRWfractal(**attrs)``.
+    memory_limit : None or int, default=None
+        If not None, the number of bytes the simulation may use. The
+        size of every buffer is planned before anything is allocated
+        (see ``memory_plan``). If the plan exceeds the limit, the
+        ensemble statistics are accumulated over walks instead of
+        keeping a (lag, walk) array for each, which agrees with the
+        default analysis to rounding; if that is still too much, a
+        ``RuntimeError`` names the largest buffers.
+    analysis_format : {"dataframe", "numpy", "arrow"}, default="dataframe"
+        Format of ``analysis_``. A wide DataFrame has a column per walk,
+        which is slow to build for many walks. "numpy" gives a
+        ``WalkAnalysis`` of named array views, with the TAMSD as an
+        (n_walks, n_lags) array, and "arrow" a long-format
+        ``pyarrow.Table``. Neither copies the statistics, and the
+        DataFrame can still be had from ``WalkAnalysis.to_frame``.
     random_seed : None or int, default=None
         Random seed to use for the cluster generation and random walks.
     n_jobs : None or int, default=None
@@ -91,13 +273,35 @@ class CTRWfractal:
         If ``n_walks`` is not None, this is an array containing
         the physical (x, y) coordinates of the particle undergoing
         a random walk on the occupied sites.
-    analysis_ : None or pandas.DataFrame
-        If ``n_walks`` is not None, this is a dataframe containing:
-        ensemble mean-squared displacement (MSD), ensemble time-averaged
-        mean-squared displacement (TAMSD), ergodicity-breaking values,
-        and TAMSD for each trajectory.
+    analysis_ : None, pandas.DataFrame, WalkAnalysis or pyarrow.Table
+        If ``n_walks`` is not None, this contains: ensemble mean-squared
+        displacement (MSD), ensemble time-averaged mean-squared
+        displacement (TAMSD), ergodicity-breaking values, and TAMSD for
+        each trajectory, in the format set by ``analysis_format``.
+    threshold_walks_ : None or array-like, shape (n_thresholds, n_walks, n_steps, 2)
+        If ``walk_thresholds`` is not None, the random walks at each
+        of the thresholds.
+    threshold_analysis_ : None or list
+        If ``walk_thresholds`` is not None, the walk statistics at each
+        of the thresholds, in the same format as ``analysis_``.
+    backbone_ : None or array-like, shape (n_sites,)
+        If ``backbone`` is True, 1 for sites on the backbone of the
+        largest cluster, 0 for sites on its dangling ends, and -1 for
+        sites off it.
+    backbone_fraction_ : None or array-like, shape (n_walks,)
+        If ``backbone`` is True, the fraction of the observed steps of
+        each walk spent on the backbone.
+    sweep_ : None or array-like, shape (n_sites or n_bonds, 2)
+        If ``sweep`` is True, this is an array containing the size
+        of the largest cluster and the mean cluster size after each
+        site (or bond) is added.
     occupied_fraction_ : float
         Fraction of lattice sites marked as occupied.
+    cancelled_ : bool
+        True if the run was cancelled before it finished, in which case
+        ``walks_`` only holds the completed walks (or steps, when the
+        walkers move together), and the statistics of any stage that
+        did not finish are None.
 
     Notes
     -----
@@ -117,64 +321,91 @@ class CTRWfractal:
         self,
         grid_size=32,
         lattice_type="square",
+        percolation_type="site",
         threshold=None,
+        sweep=False,
         walk_type="all",
         n_walks=None,
         n_steps=None,
         beta=None,
         tau0=None,
         noise=None,
+        accelerate=False,
+        walk_thresholds=None,
+        switch_rates=None,
+        dynamic_clusters=False,
+        exclusion=False,
+        backbone=False,
+        extendable=False,
+        output=None,
+        memory_limit=None,
+        analysis_format="dataframe",
         random_seed=None,
         n_jobs=None,
     ):
         self.grid_size = grid_size
         self.lattice_type = lattice_type
+        self.percolation_type = percolation_type
         self.threshold = threshold
+        self.sweep = sweep
         self.walk_type = walk_type
         self.n_walks = n_walks
         self.n_steps = n_steps
         self.beta = beta
         self.tau0 = tau0
         self.noise = noise
+        self.accelerate = accelerate
+        self.walk_thresholds = walk_thresholds
+        self.switch_rates = switch_rates
+        self.dynamic_clusters = dynamic_clusters
+        self.exclusion = exclusion
+        self.backbone = backbone
+        self.extendable = extendable
+        self.output = output
+        self.memory_limit = memory_limit
+        self.analysis_format = analysis_format
         self.random_seed = random_seed
         self.n_jobs = n_jobs
 
         self._has_run = False
 
-    def _analysis_to_df(self, analysis, copy=True):
-        """Convert the analysis ndarray to a dataframe.
+    def _make_analysis(self, analysis):
+        """Wrap the analysis ndarray in the requested format.
 
         Parameters
         ----------
-        analysis : array-like
-            The input data, namely the random walk statistics
-            such as mean-squared displacement.
-        copy : bool, default True
-            If True, copies the array when creating the dataframe.
+        analysis : array-like, shape (n_walks + 3, n_steps - 1)
+            The random walk statistics from the C++ code, with the
+            ensemble vectors first and then the TAMSD of each walk.
 
         Returns
         -------
-        pd.DataFrame
-            Random walk statistics with descriptive column names.
+        pd.DataFrame, WalkAnalysis or pyarrow.Table
+            Random walk statistics, as set by ``analysis_format``.
 
         """
-        columns = ["EnsembleMSD", "EnsembleTimeAveragedMSD", "ErgodicityBreaking"]
-        columns.extend([f"TimeAveragedMSD_Walk{i}" for i in range(self.n_walks_)])
-
-        return pd.DataFrame(analysis, columns=columns, copy=copy)
+        return _format_analysis(analysis, self.analysis_format)
 
     def _check_arguments(self):
         """Sanity-checking of arguments before calling C++ code."""
         lattice_types = {"square": 0, "honeycomb": 1}
-        lattice_thresholds = {"square": 0.592746, "honeycomb": 0.697040230}
+        percolation_types = {"site": 0, "bond": 1}
+        lattice_thresholds = {
+            "site": {"square": 0.592746, "honeycomb": 0.697040230},
+            "bond": {"square": 0.5, "honeycomb": 0.652703645},
+        }
         walk_types = {"all": 0, "largest": 1}
+        analysis_formats = ("dataframe", "numpy", "arrow")
 
         self.lattice_type_ = lattice_types.get(self.lattice_type, None)
+        self.percolation_type_ = percolation_types.get(self.percolation_type, None)
         self.walk_type_ = walk_types.get(self.walk_type, None)
 
         # If no threshold given, use the critical values
         self.threshold_ = (
-            lattice_thresholds.get(self.lattice_type, 0.0)
+            lattice_thresholds.get(self.percolation_type, {}).get(
+                self.lattice_type, 0.0
+            )
             if self.threshold is None
             else self.threshold
         )
@@ -185,8 +416,17 @@ class CTRWfractal:
         self.beta_ = 0.0 if self.beta is None else self.beta
         self.tau0_ = 1.0 if self.tau0 is None else self.tau0
         self.noise_ = 0.0 if self.noise is None else self.noise
+        self.memory_limit_ = 0 if self.memory_limit is None else self.memory_limit
         self.random_seed_ = -1 if self.random_seed is None else self.random_seed
         self.n_jobs_ = 0 if self.n_jobs is None else self.n_jobs
+        self.walk_thresholds_ = (
+            np.zeros(0)
+            if self.walk_thresholds is None
+            else np.atleast_1d(np.asarray(self.walk_thresholds, dtype=float))
+        )
+        self.switch_rates_ = (
+            (0.0, 0.0) if self.switch_rates is None else tuple(self.switch_rates)
+        )
 
         # Check arguments
         if self.lattice_type_ is None:
@@ -195,6 +435,12 @@ class CTRWfractal:
                 f"instead of one of {lattice_types.keys()}"
             )
 
+        if self.percolation_type_ is None:
+            raise ValueError(
+                f"Invalid percolation_type parameter: got '{self.percolation_type}' "
+                f"instead of one of {percolation_types.keys()}"
+            )
+
         if self.walk_type_ is None:
             raise ValueError(
                 f"Invalid walk_type parameter: got '{self.walk_type}' "
@@ -207,6 +453,61 @@ class CTRWfractal:
                 f"instead of a float between 0.0 and 1.0"
             )
 
+        if np.any(self.walk_thresholds_ < 0.0) or np.any(self.walk_thresholds_ > 1.0):
+            raise ValueError(
+                f"Invalid walk_thresholds parameter: got '{self.walk_thresholds}' "
+                f"instead of floats between 0.0 and 1.0"
+            )
+
+        if len(self.switch_rates_) != 2 or min(self.switch_rates_) < 0.0:
+            raise ValueError(
+                f"Invalid switch_rates parameter: got '{self.switch_rates}' "
+                f"instead of a pair of floats >= 0.0"
+            )
+
+        if self.exclusion and self.switch_rates is not None:
+            raise ValueError(
+                "Invalid exclusion parameter: exclusion is not "
+                "supported together with switch_rates"
+            )
+
+        if self.backbone and (self.switch_rates is not None or self.grid_size < 3):
+            raise ValueError(
+                "Invalid backbone parameter: the backbone needs grid_size >= 3, "
+                "and is not supported together with switch_rates"
+            )
+
+        if self.extendable and (
+            not self.accelerate
+            or self.noise_ > 0.0
+            or self.walk_thresholds_.size > 0
+            or self.switch_rates is not None
+            or self.exclusion
+            or self.output is not None
+            or self.n_steps_ < 2
+        ):
+            raise ValueError(
+                "Invalid extendable parameter: extendable walks need accelerate=True "
+                "and n_steps >= 2, and are not supported together with noise, "
+                "walk_thresholds, switch_rates, exclusion or output"
+            )
+
+        if self.extendable and self.random_seed_ < 0:
+            # Draw a seed, so that extend can rebuild the same lattice
+            self.random_seed_ = int(np.random.SeedSequence().entropy % 2 ** 63)
+
+        if self.memory_limit is not None and self.memory_limit <= 0:
+            raise ValueError(
+                f"Invalid memory_limit parameter: got '{self.memory_limit}' "
+                f"instead of None or an int > 0"
+            )
+
+        if self.analysis_format not in analysis_formats:
+            raise ValueError(
+                f"Invalid analysis_format parameter: got '{self.analysis_format}' "
+                f"instead of one of {analysis_formats}"
+            )
+
         if self.beta_ < 0.0:
             raise ValueError(
                 f"Invalid beta parameter: got '{self.beta_}' "
@@ -225,14 +526,23 @@ class CTRWfractal:
                 f"instead of a float >= 0.0"
             )
 
-    def run(self):
+    def run(self, callback=None, interval=0.5):
         """Generate the percolation clusters and, if specified, simulate random walks.
 
-        Results are stored in the object attributes.
+        Results are stored in the object attributes. The simulation runs
+        in a background thread, so it can report progress and be
+        cancelled: by ``cancel`` from another thread, by the callback, or
+        by a KeyboardInterrupt (Ctrl-C). A cancelled run stops at the next
+        chunk of work and keeps what it has, with ``cancelled_`` set.
 
         Parameters
         ----------
-        None
+        callback : None or callable, default=None
+            If not None, called with the output of ``progress`` at most
+            once every ``interval`` seconds while the simulation runs.
+            If it returns True, the run is cancelled.
+        interval : float, default=0.5
+            Seconds between calls to ``callback``.
 
         Returns
         -------
@@ -241,40 +551,496 @@ class CTRWfractal:
 
         """
         self._check_arguments()
+        self._progress = RunProgress()
+        outcome = {}
+
+        def target():
+            try:
+                outcome["res"] = self._call(self._progress)
+            except BaseException as e:  # Re-raised in the calling thread
+                outcome["error"] = e
+
+        thread = threading.Thread(target=target, daemon=True)
+        thread.start()
+
+        try:
+            while thread.is_alive():
+                thread.join(interval)
+                if callback is not None and thread.is_alive():
+                    if callback(self.progress()):
+                        self._progress.cancel()
+        except KeyboardInterrupt:
+            self._progress.cancel()
+            thread.join()
+
+        if "error" in outcome:
+            raise outcome["error"]
+
+        self._store_results(outcome["res"])
 
-        # Now we can safely call the C++ function
-        res = ctrw_fractal(
+        counts = self.progress()
+        self.cancelled_ = counts["stage"] != "done"
+
+        if self.cancelled_:
+            # Later stages were skipped, so only keep what is complete
+            if counts["stage"] in ("neighbours", "permutation", "percolation"):
+                self.walks_ = None
+                self.backbone_ = None
+            elif counts["stage"] == "walks" and self.walks_ is not None:
+                if self.switch_rates is not None or self.exclusion:
+                    self.walks_ = self.walks_[:, : counts["steps"] // self.n_walks_]
+                else:
+                    self.walks_ = self.walks_[: counts["walks"]]
+
+            if counts["stage"] in ("neighbours", "permutation", "percolation", "walks"):
+                self.backbone_fraction_ = None
+
+            if counts["stage"] != "thresholds":
+                self.analysis_ = None
+
+            self.threshold_walks_ = None
+            self.threshold_analysis_ = None
+            self._walk_state = None
+
+            warnings.warn(
+                f"Run cancelled during the {counts['stage']} stage: results are partial",
+                RuntimeWarning,
+            )
+
+        return self
+
+    def progress(self):
+        """Progress of the current (or last) run.
+
+        Safe to call from any thread while ``run`` is in progress.
+
+        Parameters
+        ----------
+        None
+
+        Returns
+        -------
+        dict
+            The current ``stage`` (one of "neighbours", "permutation",
+            "percolation", "walks", "noise", "analysis", "thresholds" or
+            "done"), and the number of ``sites`` (or bonds) percolated,
+            ``walks`` and walk ``steps`` simulated, ``lags`` of the
+            TAMSD analysed, and the number of times a buffer of the
+            reusable walk workspace grew (``allocations``), which stops
+            after the first walk.
+
+        """
+        progress = getattr(self, "_progress", None)
+        if progress is None:
+            return None
+        return progress.counts()
+
+    def cancel(self):
+        """Ask a running simulation to stop at the next chunk of work.
+
+        Parameters
+        ----------
+        None
+
+        Returns
+        -------
+        None
+
+        """
+        progress = getattr(self, "_progress", None)
+        if progress is not None:
+            progress.cancel()
+
+    def _call(self, progress):
+        """Call the C++ code with the checked arguments."""
+        return ctrw_fractal(
             grid_size=self.grid_size,
             n_walks=self.n_walks_,
             n_steps=self.n_steps_,
             threshold=self.threshold_,
+            sweep=self.sweep,
             beta=self.beta_,
             tau0=self.tau0_,
             noise=self.noise_,
+            accelerate=self.accelerate,
+            walk_thresholds=self.walk_thresholds_,
+            switch_on=self.switch_rates_[0],
+            switch_off=self.switch_rates_[1],
+            dynamic_clusters=self.dynamic_clusters,
+            exclusion=self.exclusion,
+            backbone=self.backbone,
+            extendable=self.extendable,
+            output=self.output,
+            memory_limit=self.memory_limit_,
             lattice_type=self.lattice_type_,
+            percolation_type=self.percolation_type_,
             walk_type=self.walk_type_,
             random_seed=self.random_seed_,
             n_jobs=self.n_jobs_,
+            progress=progress,
         )
 
+    def _store_results(self, res):
+        """Store the output of the C++ code in the object attributes.
+
+        Parameters
+        ----------
+        res : tuple
+            The arrays returned by ``ctrw_fractal``, in order: clusters,
+            lattice, walks, analysis, sweep, threshold walks, threshold
+            analysis and, if ``backbone`` is True, the backbone labels
+            and the fraction of each walk on the backbone, then, if
+            ``extendable`` is True, the saved state of the walks.
+
+        Returns
+        -------
+        self : object
+            Returns the instance itself.
+
+        """
         self.clusters_ = res[0]
         self.lattice_ = res[1]
 
         if self.n_walks_ > 0 and self.n_steps_ > 0:
             self.walks_ = res[2]
-            self.analysis_ = self._analysis_to_df(res[3])
+            self.analysis_ = self._make_analysis(res[3])
         else:
             self.walks_ = None
             self.analysis_ = None
 
+        self.sweep_ = res[4] if self.sweep else None
+
+        if self.walks_ is not None and self.walk_thresholds_.size > 0:
+            self.threshold_walks_ = res[5].reshape(
+                self.walk_thresholds_.size, self.n_walks_, self.n_steps_, 2
+            )
+            self.threshold_analysis_ = [self._make_analysis(a) for a in res[6]]
+        else:
+            self.threshold_walks_ = None
+            self.threshold_analysis_ = None
+
+        if self.backbone and len(res) > 8:
+            self.backbone_ = res[7]
+            self.backbone_fraction_ = res[8] if self.walks_ is not None else None
+        else:
+            self.backbone_ = None
+            self.backbone_fraction_ = None
+
+        if self.extendable and len(res) > 9 and self.walks_ is not None:
+            self._walk_state = res[9]
+        else:
+            self._walk_state = None
+
+        # Empty sites are labelled with -(n_sites + 1)
         self.occupied_fraction_ = (
-            np.sum(self.clusters_ > self.clusters_.min()) / self.clusters_.size
+            np.sum(self.clusters_ > -self.clusters_.size - 1) / self.clusters_.size
         )
 
         self._has_run = True
 
         return self
 
+    def memory_plan(self):
+        """Bytes held by each buffer of the simulation, without running it.
+
+        Buffers of different stages are counted as if they coexisted,
+        so the total is an upper bound on the peak memory use. If
+        ``memory_limit`` is set, the plan is the one that fits within
+        it, and a ``RuntimeError`` is raised if none does.
+
+        Parameters
+        ----------
+        None
+
+        Returns
+        -------
+        pd.Series
+            Bytes for each named buffer, indexed by name.
+
+        """
+        self._check_arguments()
+
+        plan = ctrw_memory_plan(
+            grid_size=self.grid_size,
+            lattice_type=self.lattice_type_,
+            percolation_type=self.percolation_type_,
+            threshold=self.threshold_,
+            sweep=self.sweep,
+            walk_type=self.walk_type_,
+            n_walks=self.n_walks_,
+            n_steps=self.n_steps_,
+            beta=self.beta_,
+            tau0=self.tau0_,
+            noise=self.noise_,
+            accelerate=self.accelerate,
+            walk_thresholds=self.walk_thresholds_,
+            switch_on=self.switch_rates_[0],
+            switch_off=self.switch_rates_[1],
+            dynamic_clusters=self.dynamic_clusters,
+            exclusion=self.exclusion,
+            backbone=self.backbone,
+            extendable=self.extendable,
+            memory_limit=self.memory_limit_,
+        )
+
+        return pd.Series(plan, name="Bytes", dtype=np.int64)
+
+    def percolation_curve(self, p):
+        """Estimate percolation observables at any occupation probability.
+
+        Uses the binomial convolution described in [New2001]_ over the
+        sweep of added sites (or bonds), so a single run with ``sweep=True``
+        gives the observables for every value of ``p``.
+
+        Parameters
+        ----------
+        p : float or array-like
+            Occupation probabilities between 0 and 1.
+
+        Returns
+        -------
+        pd.DataFrame
+            Fraction of sites in the largest cluster and the mean
+            cluster size, indexed by ``p``.
+
+        """
+        if not self._has_run:
+            self.run()
+
+        if self.sweep_ is None:
+            raise ValueError("No percolation sweep available: run with sweep=True")
+
+        p = np.atleast_1d(np.asarray(p, dtype=float))
+        n_sites = self.clusters_.size
+        n_order = self.sweep_.shape[0]
+
+        # Observables after n = 0, 1, ..., n_order additions
+        initial = [0.0, 0.0] if self.percolation_type_ == 0 else [1.0, 1.0]
+        observables = np.vstack([initial, self.sweep_])
+        observables[:, 0] /= n_sites
+
+        n = np.arange(n_order + 1)
+        log_fact = np.concatenate(([0.0], np.cumsum(np.log(np.arange(1, n_order + 1)))))
+        log_binom = log_fact[-1] - log_fact - log_fact[::-1]
+
+        curve = np.zeros((p.size, 2))
+        with np.errstate(divide="ignore", invalid="ignore"):
+            for i, pi in enumerate(p):
+                log_w = (
+                    log_binom
+                    + np.where(n == 0, 0.0, n * np.log(pi))
+                    + np.where(n == n_order, 0.0, (n_order - n) * np.log1p(-pi))
+                )
+                w = np.exp(log_w - log_w.max())
+                curve[i] = w @ observables / w.sum()
+
+        return pd.DataFrame(
+            curve, index=p, columns=["LargestClusterFraction", "MeanClusterSize"]
+        )
+
+    def extend(self, n_steps):
+        """Carry the walks of an extendable run on to more steps.
+
+        Each walk resumes from where it stopped, on its own random number
+        stream, and the TAMSD sums kept from the run only gain the new
+        displacements, so ``walks_`` and ``analysis_`` are identical to
+        those of a single run with ``n_steps`` and the same
+        ``random_seed_``, without simulating the first steps again. The
+        lattice is rebuilt from the seed. Can be called repeatedly.
+
+        Parameters
+        ----------
+        n_steps : int
+            The new length of the walks, greater than the current one.
+
+        Returns
+        -------
+        self : object
+            Returns the instance itself.
+
+        """
+        if getattr(self, "_walk_state", None) is None:
+            raise ValueError(
+                "No walks to extend: run with extendable=True, n_walks > 0 and "
+                "n_steps > 0 to completion first"
+            )
+
+        if n_steps <= self.n_steps_:
+            raise ValueError(
+                f"Invalid n_steps parameter: got '{n_steps}' "
+                f"instead of an int > {self.n_steps_}"
+            )
+
+        walk_state, next_jump, lag_sums = self._walk_state
+        walks, analysis, state, residence = ctrw_extend(
+            self.walks_,
+            walk_state,
+            next_jump,
+            lag_sums,
+            residence=self.backbone_fraction_ if self.backbone else None,
+            n_steps=n_steps,
+            grid_size=self.grid_size,
+            lattice_type=self.lattice_type_,
+            percolation_type=self.percolation_type_,
+            threshold=self.threshold_,
+            walk_type=self.walk_type_,
+            beta=self.beta_,
+            tau0=self.tau0_,
+            backbone=self.backbone,
+            memory_limit=self.memory_limit_,
+            random_seed=self.random_seed_,
+            n_jobs=self.n_jobs_,
+        )
+
+        self.n_steps = n_steps
+        self.n_steps_ = n_steps
+        self.walks_ = walks
+        self.analysis_ = self._make_analysis(analysis)
+        self._walk_state = state
+        if self.backbone:
+            self.backbone_fraction_ = residence
+
+        return self
+
+    def van_hove_tail(self, levels, n_clones=4, bins=None):
+        """Tail of the displacement distribution by multilevel splitting.
+
+        Estimates the distribution of the distance ``|r|`` between the
+        first and last positions of the walks, after ``n_steps - 1``
+        steps, far into its tail. The ``n_walks`` walks are the lazy walks
+        of a run with ``accelerate=True`` and the same ``random_seed_``,
+        on the same lattice, but the first time a walker gets further from
+        its start than the next of ``levels``, it is split into
+        ``n_clones`` walkers, each with a fork of its random number stream
+        and ``1 / n_clones`` of its weight. The weighted estimates stay
+        unbiased, while far more walkers reach the tail than in plain
+        Monte Carlo, which ``n_clones=1`` gives back.
+
+        The levels are best spaced so that about one walker in
+        ``n_clones`` reaching a level goes on to the next, which keeps the
+        number of walkers at each level close to ``n_walks``; the
+        ``Reached`` column shows how many did. A walk can end as up to
+        ``n_clones ** len(levels)`` walkers, which is limited to 2**20.
+        The walkers of each walk run in parallel with the others, and the
+        result does not depend on ``n_jobs``.
+
+        Parameters
+        ----------
+        levels : array-like
+            Increasing displacements at which the walkers are split.
+        n_clones : int, default=4
+            Number of walkers a walker is split into at each level.
+        bins : None or array-like, default=None
+            Increasing edges of the bins of ``|r|``. If None, the bins
+            run from 0 through each of ``levels`` to infinity.
+
+        Returns
+        -------
+        tails : pd.DataFrame
+            For each level, the probability that ``|r|`` is at least the
+            level, its standard error over the ``n_walks`` walks, and the
+            number of walkers that crossed the level.
+        distribution : pd.DataFrame
+            The probability of ``|r|`` in each bin, and per unit length.
+
+        """
+        self._check_arguments()
+
+        if self.n_walks_ < 1 or self.n_steps_ < 2:
+            raise ValueError("No walks to split: set n_walks > 0 and n_steps > 1")
+
+        if self.noise_ > 0.0 or self.switch_rates is not None or self.exclusion:
+            raise ValueError(
+                "Splitting is not supported together with noise, "
+                "switch_rates or exclusion"
+            )
+
+        levels = np.atleast_1d(np.asarray(levels, dtype=float))
+        if levels.ndim != 1 or levels.size == 0 or np.any(np.diff(levels) <= 0.0):
+            raise ValueError(
+                f"Invalid levels parameter: got '{levels}' "
+                f"instead of an increasing array of displacements"
+            )
+
+        if n_clones < 1:
+            raise ValueError(
+                f"Invalid n_clones parameter: got '{n_clones}' instead of an int >= 1"
+            )
+
+        if bins is None:
+            bins = np.concatenate(([0.0], levels[levels > 0.0], [np.inf]))
+        bins = np.asarray(bins, dtype=float)
+        if bins.ndim != 1 or bins.size < 2 or np.any(np.diff(bins) <= 0.0):
+            raise ValueError(
+                f"Invalid bins parameter: got '{bins}' "
+                f"instead of None or increasing bin edges"
+            )
+
+        tails, density = ctrw_split(
+            levels,
+            bins,
+            n_clones=n_clones,
+            grid_size=self.grid_size,
+            lattice_type=self.lattice_type_,
+            percolation_type=self.percolation_type_,
+            threshold=self.threshold_,
+            walk_type=self.walk_type_,
+            n_walks=self.n_walks_,
+            n_steps=self.n_steps_,
+            beta=self.beta_,
+            tau0=self.tau0_,
+            random_seed=self.random_seed_,
+            n_jobs=self.n_jobs_,
+        )
+
+        tails = pd.DataFrame(
+            {
+                "Level": tails[0],
+                "Probability": tails[1],
+                "StdError": tails[2],
+                "Reached": tails[3].astype(np.int64),
+            }
+        )
+        distribution = pd.DataFrame(
+            {
+                "Lower": bins[:-1],
+                "Upper": bins[1:],
+                "Probability": density,
+                "Density": density / np.diff(bins),
+            }
+        )
+
+        return tails, distribution
+
+    def ageing_tamsd(self, ageing_times, window_lengths, lags=None):
+        """Ageing-resolved TAMSD of the walks; see ``ageing_tamsd``."""
+        if not self._has_run:
+            self.run()
+
+        if self.walks_ is None:
+            raise ValueError("No walks available: run with n_walks > 0 and n_steps > 0")
+
+        return ageing_tamsd(
+            self.walks_, ageing_times, window_lengths, lags=lags, n_jobs=self.n_jobs_
+        )
+
+    def detect_dwells(self, penalty=None, t_min=2, n_bins=20):
+        """Dwells and jumps of the walks, at the known noise; see ``detect_dwells``."""
+        if not self._has_run:
+            self.run()
+
+        if self.walks_ is None:
+            raise ValueError("No walks available: run with n_walks > 0 and n_steps > 0")
+
+        return detect_dwells(
+            self.walks_,
+            noise=self.noise_,
+            penalty=penalty,
+            t_min=t_min,
+            n_bins=n_bins,
+            n_jobs=self.n_jobs_,
+        )
+
     def plot_lattice(self, ax=None):
         if not self._has_run:
             self.run()
@@ -282,3 +1048,809 @@ class CTRWfractal:
     def plot_walks(self, ax=None):
         if not self._has_run:
             self.run()
+
+
+def run_sweep(
+    grid_size=32,
+    threshold=None,
+    random_seed=None,
+    beta=None,
+    tau0=None,
+    noise=None,
+    n_steps=None,
+    lattice_type="square",
+    percolation_type="site",
+    walk_type="all",
+    n_walks=None,
+    accelerate=False,
+    memory_limit=None,
+    analysis_format="dataframe",
+    n_jobs=None,
+):
+    """Run every combination of a set of parameters, sharing common stages.
+
+    Each of ``grid_size``, ``threshold``, ``random_seed``, ``beta``,
+    ``tau0``, ``noise`` and ``n_steps`` may be a single value or a list
+    of values, and the simulation is run at every point of their
+    Cartesian product. The stages of a run (neighbours, permutation,
+    percolation, walks, noise, analysis) are only repeated when their
+    parameters change: all the points with the same ``grid_size`` and
+    ``random_seed`` share one lattice and permutation, each threshold is
+    percolated once, and the clean walks are shared between noise levels.
+    The results are identical to running each point on its own.
+
+    Parameters
+    ----------
+    grid_size, threshold, random_seed, beta, tau0, noise, n_steps : scalar or list
+        Swept parameters, as described in ``CTRWfractal``. If
+        ``random_seed`` is None, a single seed is drawn and shared by
+        every point, and recorded in each result.
+    lattice_type, percolation_type, walk_type, n_walks, accelerate, analysis_format
+        Fixed parameters, as described in ``CTRWfractal``.
+    memory_limit : None or int, default=None
+        If not None, the number of bytes that the stages of the sweep
+        may hold at once, which limits how many lattices are simulated
+        in parallel. The returned results are not counted. Points that
+        do not fit on their own are handled as for ``memory_limit`` in
+        ``CTRWfractal``.
+    n_jobs : None or int, default=None
+        The number of threads. Distinct lattices are run in parallel if
+        there are enough of them, otherwise the threads are used for
+        the analysis of each one in turn.
+
+    Returns
+    -------
+    list of CTRWfractal
+        One run per point, in the order of ``itertools.product`` over
+        (grid_size, threshold, random_seed, beta, tau0, noise, n_steps).
+
+    """
+    if random_seed is None:
+        random_seed = int(np.random.SeedSequence().entropy % 2 ** 63)
+
+    axes = [
+        list(np.atleast_1d(np.asarray(v, dtype=object)))
+        for v in (grid_size, threshold, random_seed, beta, tau0, noise, n_steps)
+    ]
+
+    points = [
+        CTRWfractal(
+            grid_size=g,
+            lattice_type=lattice_type,
+            percolation_type=percolation_type,
+            threshold=p,
+            walk_type=walk_type,
+            n_walks=n_walks,
+            n_steps=k,
+            beta=b,
+            tau0=t,
+            noise=n,
+            accelerate=accelerate,
+            analysis_format=analysis_format,
+            random_seed=s,
+            n_jobs=n_jobs,
+        )
+        for g, p, s, b, t, n, k in itertools.product(*axes)
+    ]
+
+    for point in points:
+        point._check_arguments()
+
+        if point.random_seed_ < 0:
+            raise ValueError(
+                f"Invalid random_seed parameter: got '{point.random_seed_}' "
+                f"instead of None or an int >= 0"
+            )
+
+    if memory_limit is not None and memory_limit <= 0:
+        raise ValueError(
+            f"Invalid memory_limit parameter: got '{memory_limit}' "
+            f"instead of None or an int > 0"
+        )
+
+    first = points[0]
+    clusters, lattices, walks, analyses, lattice_index, _ = ctrw_sweep(
+        grid_sizes=[pt.grid_size for pt in points],
+        thresholds=[pt.threshold_ for pt in points],
+        random_seeds=[pt.random_seed_ for pt in points],
+        betas=[pt.beta_ for pt in points],
+        tau0s=[pt.tau0_ for pt in points],
+        noises=[pt.noise_ for pt in points],
+        n_steps=[pt.n_steps_ for pt in points],
+        lattice_type=first.lattice_type_,
+        percolation_type=first.percolation_type_,
+        walk_type=first.walk_type_,
+        n_walks=first.n_walks_,
+        accelerate=accelerate,
+        memory_limit=0 if memory_limit is None else memory_limit,
+        n_jobs=first.n_jobs_,
+    )
+
+    for i, point in enumerate(points):
+        q = lattice_index[i]
+        has_walks = point.n_walks_ > 0 and point.n_steps_ > 0
+
+        # Lattices are shared between points, and are (2, n_sites) with walks
+        lattice = lattices[q].T if has_walks else lattices[q]
+        point._store_results(
+            (clusters[q], lattice, walks[i], analyses[i], None, None, None)
+        )
+        point.cancelled_ = False
+
+    return points
+
+
+def _prior_bounds(name, prior):
+    """Bounds of a uniform prior given as a value or a pair (low, high)."""
+    low, high = (prior, prior) if np.ndim(prior) == 0 else tuple(prior)
+    if low > high:
+        raise ValueError(
+            f"Invalid {name} parameter: got '{prior}' "
+            f"instead of a float or a pair (low, high) with low <= high"
+        )
+    return low, high
+
+
+def generate_dataset(
+    path,
+    n_tracks,
+    n_steps=100,
+    beta=(0.0, 1.0),
+    threshold=None,
+    noise=0.0,
+    tau0=None,
+    grid_size=64,
+    lattice_type="square",
+    percolation_type="site",
+    walk_type="all",
+    tracks_per_lattice=100,
+    tracks_per_shard=10000,
+    random_seed=None,
+    n_jobs=None,
+):
+    """Write a dataset of short trajectories labelled with their parameters.
+
+    Each track has its own ``beta`` and ``noise``, drawn uniformly from
+    their priors, and each run of ``tracks_per_lattice`` tracks shares
+    one lattice, with ``threshold`` drawn in the same way. The walks are
+    simulated as with ``accelerate=True`` and are not analysed. Shards
+    are generated in parallel and written to ``path`` as
+
+    - ``walks-XXXXX.npy``, float64 of shape (tracks, n_steps, 2), and
+    - ``labels-XXXXX.npy``, float64 of shape (tracks, 4), with columns
+      beta, threshold, noise and the index of the lattice,
+
+    along with the parameters in ``dataset.json``. The files only depend
+    on the parameters and ``random_seed``, not on ``n_jobs``.
+
+    Parameters
+    ----------
+    path : str
+        Directory to write to, created if needed.
+    n_tracks : int
+        Total number of tracks.
+    n_steps : int, default=100
+        Length of each track.
+    beta, threshold, noise : float or (float, float)
+        A fixed value, or the bounds of a uniform prior. If ``threshold``
+        is None, the critical value of the lattice is used.
+    tau0, grid_size, lattice_type, percolation_type, walk_type
+        Fixed parameters, as described in ``CTRWfractal``.
+    tracks_per_lattice : int, default=100
+        Number of tracks sharing each lattice.
+    tracks_per_shard : int, default=10000
+        Number of tracks in each file.
+    random_seed : None or int, default=None
+        Master seed. If None, one is drawn and recorded in ``dataset.json``.
+    n_jobs : None or int, default=None
+        The number of threads, one shard each.
+
+    Returns
+    -------
+    dict
+        The contents of ``dataset.json``.
+
+    """
+    if random_seed is None:
+        random_seed = int(np.random.SeedSequence().entropy % 2 ** 63)
+
+    priors = {
+        "beta": _prior_bounds("beta", beta),
+        "threshold": (None, None)
+        if threshold is None
+        else _prior_bounds("threshold", threshold),
+        "noise": _prior_bounds("noise", noise),
+    }
+
+    # The bounds of each prior are checked as single runs would be
+    checks = [
+        CTRWfractal(
+            grid_size=grid_size,
+            lattice_type=lattice_type,
+            percolation_type=percolation_type,
+            threshold=priors["threshold"][k],
+            walk_type=walk_type,
+            n_steps=n_steps,
+            beta=priors["beta"][k],
+            tau0=tau0,
+            noise=priors["noise"][k],
+            random_seed=random_seed,
+            n_jobs=n_jobs,
+        )
+        for k in range(2)
+    ]
+    for check in checks:
+        check._check_arguments()
+    priors["threshold"] = (checks[0].threshold_, checks[1].threshold_)
+    est = checks[0]  # For the parameters that both bounds share
+
+    for name, value in [
+        ("n_tracks", n_tracks),
+        ("n_steps", n_steps),
+        ("tracks_per_lattice", tracks_per_lattice),
+        ("tracks_per_shard", tracks_per_shard),
+    ]:
+        if value < 1:
+            raise ValueError(
+                f"Invalid {name} parameter: got '{value}' instead of an int >= 1"
+            )
+
+    os.makedirs(path, exist_ok=True)
+
+    n_shards = ctrw_dataset(
+        path,
+        n_tracks=n_tracks,
+        n_steps=n_steps,
+        tracks_per_shard=tracks_per_shard,
+        tracks_per_lattice=tracks_per_lattice,
+        beta_low=priors["beta"][0],
+        beta_high=priors["beta"][1],
+        threshold_low=priors["threshold"][0],
+        threshold_high=priors["threshold"][1],
+        noise_low=priors["noise"][0],
+        noise_high=priors["noise"][1],
+        tau0=est.tau0_,
+        grid_size=grid_size,
+        lattice_type=est.lattice_type_,
+        percolation_type=est.percolation_type_,
+        walk_type=est.walk_type_,
+        random_seed=random_seed,
+        n_jobs=est.n_jobs_,
+    )
+
+    meta = {
+        "n_tracks": n_tracks,
+        "n_steps": n_steps,
+        "n_shards": n_shards,
+        "priors": {k: list(v) for k, v in priors.items()},
+        "labels": ["beta", "threshold", "noise", "lattice"],
+        "tau0": est.tau0_,
+        "grid_size": grid_size,
+        "lattice_type": lattice_type,
+        "percolation_type": percolation_type,
+        "walk_type": walk_type,
+        "tracks_per_lattice": tracks_per_lattice,
+        "tracks_per_shard": tracks_per_shard,
+        "random_seed": random_seed,
+    }
+    with open(os.path.join(path, "dataset.json"), "w") as f:
+        json.dump(meta, f, indent=2)
+
+    return meta
+
+
+def fit_abc(
+    tracks,
+    beta=(0.0, 1.0),
+    threshold=None,
+    noise=None,
+    tau0=None,
+    n_walks=None,
+    n_particles=200,
+    n_rounds=5,
+    quantile=0.5,
+    min_acceptance=0.01,
+    grid_size=64,
+    lattice_type="square",
+    percolation_type="site",
+    walk_type="all",
+    random_seed=None,
+    n_jobs=None,
+):
+    """Fit beta and the threshold to observed tracks by approximate Bayesian computation.
+
+    Runs sequential Monte Carlo ABC [Bea2009]_ natively, with uniform
+    priors on ``beta`` and ``threshold``. Each simulation percolates a
+    lattice, runs ``n_walks`` walks as with ``accelerate=True``, and
+    summarises them as they are simulated by
+
+    - the slope of log EATAMSD against log lag,
+    - the ergodicity breaking parameter at lag 1,
+    - the log widths of the van Hove distribution at the shortest and
+      longest lags, and
+    - the non-Gaussian parameter at lag 1,
+
+    over log-spaced lags up to a quarter of the track length. Particles
+    are accepted when these are within a tolerance of the observed ones,
+    each scaled by its spread under the prior, and the tolerance shrinks
+    from round to round. Simulations run in parallel, and the result only
+    depends on ``random_seed``, not on ``n_jobs``.
+
+    Parameters
+    ----------
+    tracks : array-like, shape (n_tracks, n_steps, 2)
+        Observed tracks, in units of the lattice spacing and sampled at
+        unit time intervals.
+    beta, threshold : float or (float, float)
+        Bounds of the uniform priors, or a fixed value. If ``threshold``
+        is None, the prior spans the critical value of the lattice to 1.
+    noise, tau0, grid_size, lattice_type, percolation_type, walk_type
+        Fixed parameters, as described in ``CTRWfractal``.
+    n_walks : None or int, default=None
+        Walks per simulation. If None, as many as the observed tracks.
+    n_particles : int, default=200
+        Size of the population.
+    n_rounds : int, default=5
+        Maximum number of rounds, counting the first one from the prior.
+    quantile : float, default=0.5
+        Quantile of the distances of a round used as the next tolerance.
+    min_acceptance : float, default=0.01
+        Stop, keeping the last population, when a round would accept
+        fewer than this fraction of its proposals.
+    random_seed : None or int, default=None
+        Master seed. If None, one is drawn.
+    n_jobs : None or int, default=None
+        The number of threads.
+
+    Returns
+    -------
+    posterior : pd.DataFrame
+        Columns beta, threshold, weight and distance, one row per
+        particle. The weights sum to one.
+    history : pd.DataFrame
+        Tolerance, acceptance rate and number of simulations per round.
+    statistics : pd.DataFrame
+        The observed summary statistics and the scale of each.
+
+    References
+    ----------
+    .. [Bea2009] M. A. Beaumont, J.-M. Cornuet, J.-M. Marin and C. P. Robert,
+                 "Adaptive approximate Bayesian computation", Biometrika
+                 96(4), 983 (2009).
+
+    """
+    tracks = np.asarray(tracks, dtype=float)
+    if tracks.ndim != 3 or tracks.shape[2] != 2 or tracks.shape[1] < 2:
+        raise ValueError(
+            f"Invalid tracks parameter: got shape {tracks.shape} "
+            f"instead of (n_tracks, n_steps >= 2, 2)"
+        )
+
+    if random_seed is None:
+        random_seed = int(np.random.SeedSequence().entropy % 2 ** 63)
+
+    n_walks = tracks.shape[0] if n_walks is None else n_walks
+    priors = {
+        "beta": _prior_bounds("beta", beta),
+        "threshold": (None, 1.0)
+        if threshold is None
+        else _prior_bounds("threshold", threshold),
+    }
+
+    # The bounds of each prior are checked as single runs would be
+    checks = [
+        CTRWfractal(
+            grid_size=grid_size,
+            lattice_type=lattice_type,
+            percolation_type=percolation_type,
+            threshold=priors["threshold"][k],
+            walk_type=walk_type,
+            n_walks=n_walks,
+            n_steps=tracks.shape[1],
+            beta=priors["beta"][k],
+            tau0=tau0,
+            noise=noise,
+            random_seed=random_seed,
+            n_jobs=n_jobs,
+        )
+        for k in range(2)
+    ]
+    for check in checks:
+        check._check_arguments()
+    priors["threshold"] = (checks[0].threshold_, checks[1].threshold_)
+    est = checks[0]  # For the parameters that both bounds share
+
+    if n_walks < 1 or n_particles < 2 or n_rounds < 1:
+        raise ValueError(
+            f"Invalid ABC parameters: got n_walks={n_walks}, "
+            f"n_particles={n_particles} and n_rounds={n_rounds} instead of "
+            f"n_walks >= 1, n_particles >= 2 and n_rounds >= 1"
+        )
+
+    if not 0.0 < quantile <= 1.0 or not 0.0 < min_acceptance <= 1.0:
+        raise ValueError(
+            f"Invalid ABC parameters: got quantile={quantile} and "
+            f"min_acceptance={min_acceptance} instead of floats in (0.0, 1.0]"
+        )
+
+    particles, history, statistics = ctrw_abc(
+        tracks,
+        n_walks=n_walks,
+        n_particles=n_particles,
+        n_rounds=n_rounds,
+        quantile=quantile,
+        min_acceptance=min_acceptance,
+        beta_low=priors["beta"][0],
+        beta_high=priors["beta"][1],
+        threshold_low=priors["threshold"][0],
+        threshold_high=priors["threshold"][1],
+        noise=est.noise_,
+        tau0=est.tau0_,
+        grid_size=grid_size,
+        lattice_type=est.lattice_type_,
+        percolation_type=est.percolation_type_,
+        walk_type=est.walk_type_,
+        random_seed=random_seed,
+        n_jobs=est.n_jobs_,
+    )
+
+    posterior = pd.DataFrame(
+        particles, columns=["beta", "threshold", "weight", "distance"]
+    )
+    history = pd.DataFrame(history, columns=["Tolerance", "Acceptance", "Simulations"])
+    history["Simulations"] = history["Simulations"].astype(np.int64)
+    statistics = pd.DataFrame(
+        statistics,
+        index=["Observed", "Scale"],
+        columns=[
+            "TAMSDSlope",
+            "ErgodicityBreaking",
+            "VanHoveWidthShort",
+            "VanHoveWidthLong",
+            "NonGaussianity",
+        ],
+    ).T
+
+    return posterior, history, statistics
+
+
+def ageing_tamsd(walks, ageing_times, window_lengths, lags=None, n_jobs=None):
+    """Time-averaged MSD of each walk over a grid of ageing times and windows.
+
+    For an ageing time ``t_a`` and a window length ``T``,
+
+        TAMSD(lag; t_a, T) = sum_{t=t_a}^{t_a+T-lag-1} |r(t+lag) - r(t)|^2 / (T - lag),
+
+    so that ``t_a=0`` and ``T=n_steps`` give the TAMSD of ``analysis_``.
+    For each lag, a single pass over a walk builds the prefix sums of its
+    squared increments, and every window is the difference of two of them,
+    so the whole surface costs about as much as the TAMSD over the full walk.
+
+    Parameters
+    ----------
+    walks : array-like, shape (n_walks, n_steps, 2)
+        The walks, for example ``CTRWfractal.walks_``.
+    ageing_times : int or array-like of int
+        Steps discarded at the start of each walk.
+    window_lengths : int or array-like of int
+        Lengths of the measurement window, in steps.
+    lags : None or array-like of int, default=None
+        The lags, in steps. If None, 1 to ``max(window_lengths) - 1``.
+    n_jobs : None or int, default=None
+        The number of threads.
+
+    Returns
+    -------
+    array-like, shape (n_walks, n_ageing, n_windows, n_lags)
+        The TAMSD, or NaN where the window does not fit in the walk or is
+        not longer than the lag.
+
+    """
+    walks = np.asarray(walks, dtype=float)
+    if walks.ndim != 3 or walks.shape[2] != 2:
+        raise ValueError(
+            f"Invalid walks parameter: got shape {walks.shape} "
+            f"instead of (n_walks, n_steps, 2)"
+        )
+
+    ageing_times = np.atleast_1d(np.asarray(ageing_times, dtype=np.int64))
+    window_lengths = np.atleast_1d(np.asarray(window_lengths, dtype=np.int64))
+    if lags is None:
+        lags = np.arange(1, max(window_lengths.max(initial=1), 2), dtype=np.int64)
+    lags = np.atleast_1d(np.asarray(lags, dtype=np.int64))
+
+    if (
+        ageing_times.ndim != 1
+        or window_lengths.ndim != 1
+        or lags.ndim != 1
+        or np.any(ageing_times < 0)
+        or np.any(window_lengths < 1)
+        or np.any(lags < 1)
+    ):
+        raise ValueError(
+            "Invalid ageing parameters: expected 1D arrays of ageing times >= 0, "
+            "and window lengths and lags >= 1"
+        )
+
+    return ctrw_ageing(
+        walks,
+        ageing_times,
+        window_lengths,
+        lags,
+        n_jobs=0 if n_jobs is None else n_jobs,
+    )
+
+
+def detect_dwells(walks, noise=None, penalty=None, t_min=2, n_bins=20, n_jobs=None):
+    """Split walks into dwells and jumps, and fit the tail of the dwell times.
+
+    Each walk is partitioned into segments of constant mean position under
+    Gaussian noise, minimising the sum of squared deviations over
+    ``noise ** 2`` plus ``penalty`` per segment, by optimal partitioning with
+    PELT pruning [Kil2012]_. Without noise, the dwells are the runs of equal
+    positions. The first and last segments are cut off by the ends of the
+    walk, so only the others count as dwells. For waiting times with
+    ``P(t > x) ~ x^-beta``, the maximum-likelihood Pareto exponent of the
+    dwell times estimates ``beta``, where a dwell of ``t`` steps stands for
+    waiting times between ``t - 1/2`` and ``t + 1/2`` (compare the discrete
+    estimator of [Cla2009]_). Walks run in parallel.
+
+    Parameters
+    ----------
+    walks : array-like, shape (n_walks, n_steps, 2)
+        The walks, for example ``CTRWfractal.walks_``, in units of the
+        lattice spacing and sampled at unit time intervals.
+    noise : None or float, default=None
+        Standard deviation of the noise on each coordinate. If None, it is
+        estimated for each walk from the median squared increment, or taken
+        as zero if any position repeats exactly.
+    penalty : None or float, default=None
+        Cost of each segment. If None, ``3 ln(n_steps)``.
+    t_min : int, default=2
+        Shortest dwell time, in steps, in the Pareto fit. The shortest
+        dwells are the most affected by sampling at unit intervals.
+    n_bins : int, default=20
+        Number of log-spaced bins of the dwell-time histogram.
+    n_jobs : None or int, default=None
+        The number of threads.
+
+    Returns
+    -------
+    segments : array-like, shape (n_walks, n_steps)
+        Index of the segment of each step, so that jumps are where it changes.
+    histogram : pd.DataFrame
+        Lower and upper edges of each bin of dwell times, in steps, with the
+        upper edge excluded, and the number of dwells in it over the ensemble
+        and for each walk.
+    exponents : pd.DataFrame
+        Number of dwells of at least ``t_min`` steps, Pareto exponent, its
+        standard error and the noise, for each walk and the ensemble.
+
+    References
+    ----------
+    .. [Kil2012] R. Killick, P. Fearnhead and I. A. Eckley, "Optimal detection
+                 of changepoints with a linear computational cost", J. Am.
+                 Stat. Assoc. 107(500), 1590 (2012).
+    .. [Cla2009] A. Clauset, C. R. Shalizi and M. E. J. Newman, "Power-law
+                 distributions in empirical data", SIAM Rev. 51(4), 661 (2009).
+
+    """
+    walks = np.asarray(walks, dtype=float)
+    if walks.ndim != 3 or walks.shape[2] != 2:
+        raise ValueError(
+            f"Invalid walks parameter: got shape {walks.shape} "
+            f"instead of (n_walks, n_steps, 2)"
+        )
+
+    if (
+        (noise is not None and not noise >= 0.0)
+        or (penalty is not None and not penalty >= 0.0)
+        or t_min < 1
+        or n_bins < 1
+    ):
+        raise ValueError(
+            f"Invalid dwell parameters: got noise={noise}, penalty={penalty}, "
+            f"t_min={t_min} and n_bins={n_bins} instead of noise, penalty >= 0.0 "
+            f"and t_min, n_bins >= 1"
+        )
+
+    segments, histogram, exponents = ctrw_dwell(
+        walks,
+        noise=-1.0 if noise is None else noise,
+        penalty=-1.0 if penalty is None else penalty,
+        t_min=t_min,
+        n_bins=n_bins,
+        n_jobs=0 if n_jobs is None else n_jobs,
+    )
+
+    columns = ["Lower", "Upper", "Ensemble"]
+    columns.extend([f"Walk{i}" for i in range(walks.shape[0])])
+    histogram = pd.DataFrame(histogram.T, columns=columns)
+    for column in columns:
+        histogram[column] = histogram[column].astype(np.int64)
+
+    index = [f"Walk{i}" for i in range(walks.shape[0])] + ["Ensemble"]
+    exponents = pd.DataFrame(
+        exponents, index=index, columns=["Dwells", "Exponent", "StdError", "Noise"]
+    )
+    exponents["Dwells"] = exponents["Dwells"].astype(np.int64)
+
+    return segments, histogram, exponents
+
+
+def analyse_tracks(
+    path,
+    file_format="csv",
+    delimiter=",",
+    max_lag=None,
+    analysis_format="dataframe",
+    n_jobs=None,
+):
+    """Read a table of experimental tracks natively and analyse them.
+
+    The file has one row per observation, (track id, frame, x, y), either
+    as text or as binary little-endian records of (int64, int64, float64,
+    float64). It is memory-mapped and parsed in chunks on several threads,
+    the rows are grouped by track id, and the tracks go straight into the
+    same statistics as ``CTRWfractal.analysis_``, without passing through
+    Python objects.
+
+    Tracks may have different lengths and missing frames. Each statistic
+    at a lag averages over the pairs of observed frames that far apart,
+    and the ensemble statistics over the tracks that have any.
+
+    Parameters
+    ----------
+    path : str or path-like
+        The track table.
+    file_format : {"csv", "binary"}, default="csv"
+        For text, blank lines, lines starting with ``#``, a header line
+        and any columns after the fourth are skipped.
+    delimiter : str, default=","
+        Field separator of a text table. A space stands for any run of
+        spaces and tabs.
+    max_lag : None or int, default=None
+        The longest lag, in frames. If None, one less than the longest track.
+    analysis_format : {"dataframe", "numpy", "arrow"}, default="dataframe"
+        As described in ``CTRWfractal``, with the TAMSD of a track NaN
+        at lags longer than it.
+    n_jobs : None or int, default=None
+        The number of threads.
+
+    Returns
+    -------
+    analysis : pd.DataFrame, WalkAnalysis or pyarrow.Table
+        Ensemble MSD, ensemble time-averaged MSD, ergodicity breaking
+        parameter and the TAMSD of each track, at lags 1 to ``max_lag``.
+    tracks : pd.DataFrame
+        Id, first frame, number of frames spanned and number of frames
+        observed of each track, in the order of the analysis.
+
+    """
+    if not os.path.isfile(path):
+        raise FileNotFoundError(f"No track table at {path}")
+
+    file_formats = {"csv": False, "binary": True}
+    analysis_formats = ("dataframe", "numpy", "arrow")
+    if (
+        file_format not in file_formats
+        or not isinstance(delimiter, str)
+        or len(delimiter) != 1
+        or analysis_format not in analysis_formats
+        or (max_lag is not None and max_lag < 1)
+    ):
+        raise ValueError(
+            f"Invalid track parameters: got file_format='{file_format}', "
+            f"delimiter={delimiter!r}, max_lag={max_lag} and "
+            f"analysis_format='{analysis_format}' instead of a file_format in "
+            f"{tuple(file_formats)}, a single-character delimiter, max_lag >= 1 "
+            f"and an analysis_format in {analysis_formats}"
+        )
+
+    analysis, ids, first_frames, lengths, observed = ctrw_tracks(
+        path,
+        binary=file_formats[file_format],
+        delimiter=delimiter,
+        max_lag=0 if max_lag is None else max_lag,
+        n_jobs=0 if n_jobs is None else n_jobs,
+    )
+
+    tracks = pd.DataFrame(
+        {
+            "TrackId": ids,
+            "FirstFrame": first_frames,
+            "Frames": lengths,
+            "Observed": observed,
+        }
+    )
+
+    return _format_analysis(analysis, analysis_format), tracks
+
+
+def laplacian_spectrum(
+    grid_size=64,
+    lattice_type="square",
+    percolation_type="site",
+    threshold=None,
+    n_probes=16,
+    n_lanczos=150,
+    n_bins=40,
+    fit_max=1.0,
+    random_seed=None,
+    n_jobs=None,
+):
+    """Density of states of the graph Laplacian of the largest cluster.
+
+    Percolates a lattice as ``CTRWfractal`` does with the same seed, and
+    estimates the spectrum of ``L = D - A`` on its largest cluster by
+    stochastic Lanczos quadrature: each of ``n_probes`` random vectors,
+    orthogonal to the zero mode, gives ``n_lanczos`` Ritz values and
+    weights from a sparse three-term recurrence. The probes run in
+    parallel, and the result only depends on ``random_seed``.
+
+    At low eigenvalues, the integrated density of states goes as
+    ``N(lambda) ~ lambda^(d_s / 2)``, so the spectral dimension ``d_s`` is
+    twice the slope of log N against log lambda up to ``fit_max``. It is 2
+    on a full 2D lattice, and about 4/3 on the incipient percolation
+    cluster, where it also sets the return probability of the walks.
+
+    Parameters
+    ----------
+    grid_size, lattice_type, percolation_type, threshold, random_seed
+        As described in ``CTRWfractal``.
+    n_probes : int, default=16
+        Number of random probe vectors.
+    n_lanczos : int, default=150
+        Lanczos steps per probe, i.e. quadrature nodes.
+    n_bins : int, default=40
+        Number of log-spaced bins, between the smallest and the largest
+        nonzero Ritz values.
+    fit_max : float, default=1.0
+        Largest eigenvalue in the fit of the spectral dimension.
+    n_jobs : None or int, default=None
+        The number of threads.
+
+    Returns
+    -------
+    dos : pd.DataFrame
+        Eigenvalue at the centre of each bin, density of states per site,
+        and the integrated density of states up to the end of the bin.
+    spectral_dimension : float
+        The fitted d_s, or NaN if fewer than two bins are below ``fit_max``.
+
+    """
+    est = CTRWfractal(
+        grid_size=grid_size,
+        lattice_type=lattice_type,
+        percolation_type=percolation_type,
+        threshold=threshold,
+        random_seed=random_seed,
+        n_jobs=n_jobs,
+    )
+    est._check_arguments()
+
+    if n_probes < 1 or n_lanczos < 1 or n_bins < 1 or not fit_max > 0.0:
+        raise ValueError(
+            f"Invalid spectrum parameters: got n_probes={n_probes}, "
+            f"n_lanczos={n_lanczos}, n_bins={n_bins} and fit_max={fit_max} "
+            f"instead of n_probes, n_lanczos, n_bins >= 1 and fit_max > 0.0"
+        )
+
+    dos, spectral_dimension = ctrw_spectrum(
+        grid_size=grid_size,
+        lattice_type=est.lattice_type_,
+        percolation_type=est.percolation_type_,
+        threshold=est.threshold_,
+        n_probes=n_probes,
+        n_lanczos=n_lanczos,
+        n_bins=n_bins,
+        fit_max=fit_max,
+        random_seed=est.random_seed_,
+        n_jobs=est.n_jobs_,
+    )
+
+    dos = pd.DataFrame(
+        {"Eigenvalue": dos[0], "Density": dos[1], "Cumulative": dos[2]}
+    )
+
+    return dos, spectral_dimension
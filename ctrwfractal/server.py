@@ -0,0 +1,409 @@
+# Copyright 2016-2020 Tom Furnival
+#
+# This file is part of ctrwfractal.
+#
+# ctrwfractal is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# ctrwfractal is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Persistent local simulation server.
+
+The server keeps the extension loaded and the percolated lattices in
+memory, so that repeated small requests only pay for the random walks.
+It listens on a UNIX socket. Each message is a fixed binary header
+(magic ``b"CTRW"``, protocol version and payload length, as
+little-endian uint32) followed by a UTF-8 JSON payload. The arrays of a
+reply are not sent over the socket: they are written to a shared-memory
+file, which the client maps and unlinks. Files that no client takes,
+because the reply could not be sent or the client never attached, are
+unlinked by the server.
+
+Run with ``python -m ctrwfractal.server PATH``.
+"""
+
+import argparse
+import json
+import mmap
+import os
+import socket
+import socketserver
+import struct
+import tempfile
+import threading
+import uuid
+from collections import OrderedDict
+
+import numpy as np
+
+from ._ctrwfractal import LatticeCache
+from .ctrwfractal import CTRWfractal
+
+MAGIC = b"CTRW"
+VERSION = 1
+
+_HEADER = struct.Struct("<4sII")
+_SHM_DIR = "/dev/shm" if os.path.isdir("/dev/shm") else tempfile.gettempdir()
+_ALIGN = 64
+
+_LATTICE_PARAMS = (
+    "grid_size",
+    "lattice_type",
+    "percolation_type",
+    "threshold",
+    "walk_type",
+    "accelerate",
+    "random_seed",
+)
+_WALK_PARAMS = ("n_walks", "n_steps", "beta", "tau0", "noise")
+_ERRORS = {"ValueError": ValueError, "MemoryError": MemoryError}
+
+
+def _send(sock, message):
+    payload = json.dumps(message).encode()
+    sock.sendall(_HEADER.pack(MAGIC, VERSION, len(payload)) + payload)
+
+
+def _recv_exact(sock, n_bytes):
+    buf = bytearray()
+    while len(buf) < n_bytes:
+        chunk = sock.recv(n_bytes - len(buf))
+        if not chunk:
+            return None
+        buf += chunk
+    return bytes(buf)
+
+
+def _recv(sock):
+    """Read one message, or return None if the peer has closed the socket."""
+    header = _recv_exact(sock, _HEADER.size)
+    if header is None:
+        return None
+
+    magic, version, n_bytes = _HEADER.unpack(header)
+    if magic != MAGIC or version != VERSION:
+        raise ConnectionError(
+            f"Unrecognised message: got magic {magic!r} and version {version}"
+        )
+
+    payload = _recv_exact(sock, n_bytes)
+    if payload is None:
+        return None
+    return json.loads(payload.decode())
+
+
+def _share(arrays):
+    """Write named arrays to a new shared-memory file and describe them."""
+    layout = []
+    offset = 0
+    for name, arr in arrays:
+        arr = np.ascontiguousarray(arr)
+        layout.append(
+            {
+                "name": name,
+                "dtype": arr.dtype.str,
+                "shape": list(arr.shape),
+                "offset": offset,
+            }
+        )
+        offset += -(-arr.nbytes // _ALIGN) * _ALIGN
+
+    path = os.path.join(_SHM_DIR, f"ctrwfractal-{uuid.uuid4().hex}")
+    fd = os.open(path, os.O_CREAT | os.O_EXCL | os.O_RDWR, 0o600)
+    try:
+        os.ftruncate(fd, max(offset, 1))
+        with mmap.mmap(fd, max(offset, 1)) as mm:
+            for (_, arr), entry in zip(arrays, layout):
+                arr = np.ascontiguousarray(arr)
+                mm[entry["offset"] : entry["offset"] + arr.nbytes] = arr.tobytes()
+    except BaseException:
+        os.unlink(path)
+        raise
+    finally:
+        os.close(fd)
+
+    return {"shm": path, "size": max(offset, 1), "arrays": layout}
+
+
+def _attach(reply):
+    """Map the arrays of a reply and unlink the file, which lives on in the mapping."""
+    fd = os.open(reply["shm"], os.O_RDWR)
+    try:
+        mm = mmap.mmap(fd, reply["size"])
+    finally:
+        os.close(fd)
+        os.unlink(reply["shm"])
+
+    arrays = {}
+    for entry in reply["arrays"]:
+        dtype = np.dtype(entry["dtype"])
+        count = int(np.prod(entry["shape"], dtype=np.int64))
+        arrays[entry["name"]] = np.frombuffer(
+            mm, dtype=dtype, count=count, offset=entry["offset"]
+        ).reshape(entry["shape"])
+    return arrays
+
+
+class _Entry:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.cache = None
+
+
+class _Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        while True:
+            request = _recv(self.request)
+            if request is None:
+                return
+
+            try:
+                seed, arrays = self.server.simulate(request.get("params", {}))
+                reply = self.server.share(arrays)
+                reply.update(ok=True, random_seed=seed)
+            except Exception as e:  # Reported to the client, the server carries on
+                reply = {"ok": False, "error": type(e).__name__, "message": str(e)}
+
+            try:
+                _send(self.request, reply)
+            except OSError:  # The client is gone, and will never unlink the file
+                if "shm" in reply:
+                    self.server.unshare(reply["shm"])
+                return
+
+
+class SimulationServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    """Serve random walks on cached lattices over a UNIX socket.
+
+    Each connection is handled in its own thread. Requests for the same
+    lattice (``grid_size``, ``lattice_type``, ``percolation_type``,
+    ``threshold``, ``walk_type``, ``accelerate`` and ``random_seed``)
+    wait for one build and then run in turn on it; requests for
+    different lattices run in parallel, as the simulation releases the
+    GIL. Results are identical to ``CTRWfractal(...).run()``.
+
+    Concurrent requests for the same lattice are not batched into one
+    set of walks: the walks of a run start from the same random streams
+    whatever its ``n_walks``, and its analysis averages over all of
+    them, so merging requests would change their results. Each set of
+    walks uses ``n_jobs`` threads instead.
+
+    Parameters
+    ----------
+    path : str
+        Path of the UNIX socket.
+    max_lattices : int, default=8
+        Number of lattices kept, least recently used first out.
+    n_jobs : None or int, default=None
+        Threads used by each simulation, as in ``CTRWfractal``.
+
+    """
+
+    daemon_threads = True
+
+    def __init__(self, path, max_lattices=8, n_jobs=None):
+        self.max_lattices = max_lattices
+        self.n_jobs = n_jobs
+        self._lattices = OrderedDict()
+        self._lock = threading.Lock()
+        self._shared = set()  # Shared-memory files not yet known to be unlinked
+
+        if os.path.exists(path):  # Replace a stale socket, but not a live server
+            probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                probe.connect(path)
+            except (ConnectionRefusedError, FileNotFoundError):
+                os.unlink(path)
+            else:
+                raise OSError(f"A server is already listening on {path}")
+            finally:
+                probe.close()
+
+        super().__init__(path, _Handler)
+
+    def server_close(self):
+        super().server_close()
+        if os.path.exists(self.server_address):
+            os.unlink(self.server_address)
+
+        with self._lock:
+            leftover, self._shared = self._shared, set()
+        for path in leftover:  # Replies that no client attached
+            self.unshare(path)
+
+    def share(self, arrays):
+        """Write arrays to shared memory, keeping the file until it is unlinked."""
+        reply = _share(arrays)
+        with self._lock:
+            if len(self._shared) >= 256:  # Forget the files clients have taken
+                self._shared = {p for p in self._shared if os.path.exists(p)}
+            self._shared.add(reply["shm"])
+        return reply
+
+    def unshare(self, path):
+        """Unlink a shared-memory file, unless a client already has."""
+        with self._lock:
+            self._shared.discard(path)
+        try:
+            os.unlink(path)
+        except FileNotFoundError:
+            pass
+
+    def _entry(self, key):
+        with self._lock:
+            entry = self._lattices.get(key)
+            if entry is None:
+                entry = self._lattices[key] = _Entry()
+            self._lattices.move_to_end(key)
+            while len(self._lattices) > self.max_lattices:
+                self._lattices.popitem(last=False)  # Still usable by a running request
+        return entry
+
+    def simulate(self, params):
+        unknown = set(params) - set(_LATTICE_PARAMS + _WALK_PARAMS)
+        if unknown:
+            raise ValueError(
+                f"Invalid parameters for the server: got {sorted(unknown)}, "
+                f"only {list(_LATTICE_PARAMS + _WALK_PARAMS)} are supported"
+            )
+
+        est = CTRWfractal(n_jobs=self.n_jobs, **params)
+        est._check_arguments()
+
+        seed = est.random_seed_
+        if seed < 0:  # Draw a seed, so the lattice can be cached and the run repeated
+            seed = int(np.random.SeedSequence().entropy % 2 ** 63)
+
+        key = (
+            est.grid_size,
+            est.lattice_type_,
+            est.percolation_type_,
+            est.threshold_,
+            est.walk_type_,
+            bool(est.accelerate),
+            seed,
+        )
+
+        entry = self._entry(key)
+        with entry.lock:
+            if entry.cache is None:
+                entry.cache = LatticeCache(
+                    grid_size=est.grid_size,
+                    lattice_type=est.lattice_type_,
+                    percolation_type=est.percolation_type_,
+                    threshold=est.threshold_,
+                    walk_type=est.walk_type_,
+                    accelerate=est.accelerate,
+                    random_seed=seed,
+                    n_jobs=est.n_jobs_,
+                )
+            res = entry.cache.walk(
+                n_walks=est.n_walks_,
+                n_steps=est.n_steps_,
+                beta=est.beta_,
+                tau0=est.tau0_,
+                noise=est.noise_,
+            )
+
+        return seed, list(zip(("clusters", "lattice", "walks", "analysis"), res))
+
+
+def serve(path, max_lattices=8, n_jobs=None):
+    """Run a ``SimulationServer`` on ``path`` until interrupted."""
+    with SimulationServer(path, max_lattices=max_lattices, n_jobs=n_jobs) as server:
+        try:
+            server.serve_forever()
+        except KeyboardInterrupt:
+            pass
+
+
+class Client:
+    """Client for a ``SimulationServer``.
+
+    Parameters
+    ----------
+    path : str
+        Path of the server's UNIX socket.
+
+    Examples
+    --------
+    >>> with Client("/tmp/ctrwfractal.sock") as client:
+    ...     est = client.run(grid_size=64, n_walks=10, n_steps=100, random_seed=1)
+
+    """
+
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(path)
+
+    def run(self, **params):
+        """Simulate on the server.
+
+        Parameters
+        ----------
+        **params
+            Any of ``grid_size``, ``lattice_type``, ``percolation_type``,
+            ``threshold``, ``walk_type``, ``accelerate``, ``random_seed``,
+            ``n_walks``, ``n_steps``, ``beta``, ``tau0`` and ``noise``.
+
+        Returns
+        -------
+        CTRWfractal
+            An estimator holding the results, as if ``run`` had been
+            called on it. The arrays are backed by shared memory.
+
+        """
+        _send(self._sock, {"params": params})
+        reply = _recv(self._sock)
+        if reply is None:
+            raise ConnectionError("The server closed the connection")
+
+        if not reply["ok"]:
+            raise _ERRORS.get(reply["error"], RuntimeError)(reply["message"])
+
+        arrays = _attach(reply)
+
+        params["random_seed"] = reply["random_seed"]
+        est = CTRWfractal(**params)
+        est._check_arguments()
+        est._store_results(
+            (
+                arrays["clusters"],
+                arrays["lattice"],
+                arrays["walks"],
+                arrays["analysis"],
+                None,
+                None,
+                None,
+            )
+        )
+        est.cancelled_ = False
+
+        return est
+
+    def close(self):
+        self._sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("path", help="path of the UNIX socket")
+    parser.add_argument("--max-lattices", type=int, default=8)
+    parser.add_argument("--n-jobs", type=int, default=None)
+    args = parser.parse_args()
+
+    serve(args.path, max_lattices=args.max_lattices, n_jobs=args.n_jobs)
@@ -0,0 +1,120 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Counts the heap allocations made while the walks are simulated, which
+  must not grow with the number of walks. The glibc allocator is
+  interposed in this executable, so every malloc, operator new and
+  Armadillo allocation is seen. Built and run by test_ctrwfractal.py.
+
+***************************************************************************/
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+#include "_ctrw.hpp"
+
+static std::atomic<bool> counting(false);
+static std::atomic<uint64_t> allocations(0);
+
+static inline void Count()
+{
+  if (counting.load(std::memory_order_relaxed))
+  {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+extern "C"
+{
+  void *__libc_malloc(size_t n);
+  void *__libc_calloc(size_t n, size_t size);
+  void *__libc_realloc(void *ptr, size_t n);
+  void *__libc_memalign(size_t alignment, size_t n);
+
+  void *malloc(size_t n)
+  {
+    Count();
+    return __libc_malloc(n);
+  }
+
+  void *calloc(size_t n, size_t size)
+  {
+    Count();
+    return __libc_calloc(n, size);
+  }
+
+  void *realloc(void *ptr, size_t n)
+  {
+    Count();
+    return __libc_realloc(ptr, n);
+  }
+
+  void *aligned_alloc(size_t alignment, size_t n)
+  {
+    Count();
+    return __libc_memalign(alignment, n);
+  }
+
+  int posix_memalign(void **ptr, size_t alignment, size_t n)
+  {
+    Count();
+    *ptr = __libc_memalign(alignment, n);
+    return (*ptr != nullptr || n == 0) ? 0 : ENOMEM;
+  }
+}
+
+// Allocations made by RandomWalks alone, on the same lattice whatever
+// the number of walks
+uint64_t WalkAllocations(const uint64_t nWalks, const double beta, const bool accelerate)
+{
+  CTRWfractal<double> sim(16, 0, 0, 0.7, false, 0, nWalks, 50, beta, 0.5, 0., accelerate,
+                          arma::Col<double>(), 0., 0., false, false, 0, 123, 0);
+  sim.SetVerbose(false);
+  sim.FindNeighbours();
+  sim.Permute();
+  sim.Percolate();
+  sim.BuildLattice();
+  sim.GroupClusters();
+
+  allocations.store(0);
+  counting.store(true);
+  sim.RandomWalks();
+  counting.store(false);
+  return allocations.load();
+}
+
+int main()
+{
+  int failures = 0;
+  for (const bool accelerate : {false, true})
+  {
+    for (const double beta : {0., 0.8})
+    {
+      const uint64_t one = WalkAllocations(1, beta, accelerate);
+      const uint64_t many = WalkAllocations(30, beta, accelerate);
+      std::cout << "accelerate=" << accelerate << " beta=" << beta << ": " << one
+                << " allocations for 1 walk, " << many << " for 30" << std::endl;
+      failures += (many != one);
+    }
+  }
+  return failures;
+}
@@ -16,12 +16,50 @@
 # along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
 
 import hashlib
+import inspect
+import json
+import os
+import shutil
+import subprocess
+import sys
+import threading
+import zlib
 
 import numpy as np
 import pandas as pd
 import pytest
 
-from ctrwfractal import CTRWfractal
+from ctrwfractal import (
+    CTRWfractal,
+    ageing_tamsd,
+    analyse_tracks,
+    detect_dwells,
+    fit_abc,
+    generate_dataset,
+    laplacian_spectrum,
+    run_sweep,
+)
+import ctrwfractal.server as server_module
+from ctrwfractal.server import Client, SimulationServer
+
+
+def _run_cpp_test(name, tmp_path):
+    """Build one of the C++ tests next to this file against the headers
+    of the source tree, with the flags of setup.py, and run it."""
+    here = os.path.dirname(os.path.abspath(__file__))
+    include = os.path.dirname(here)
+    compiler = shutil.which(os.environ.get("CXX", "c++"))
+    if compiler is None or not os.path.exists(os.path.join(include, "_ctrw.hpp")):
+        pytest.skip("Needs a C++ compiler and the source tree")
+
+    exe = str(tmp_path / name)
+    subprocess.run(
+        [compiler, "-O3", "-Wall", "-pthread", "-std=c++11", "-I", include]
+        + [os.path.join(here, name + ".cpp"), "-o", exe]
+        + ["-lopenblas", "-llapack", "-larmadillo", "-lz"],
+        check=True,
+    )
+    return subprocess.run([exe], capture_output=True, text=True)
 
 
 def _hash_ndarray(arr, n_char=-1):
@@ -29,6 +67,23 @@ def _hash_ndarray(arr, n_char=-1):
     return hashlib.sha256(arr.data.tobytes()).hexdigest()[:n_char]
 
 
+def _read_zarr(path):
+    """Simple reader for a Zarr v2 array chunked along one axis."""
+    meta = json.loads((path / ".zarray").read_text())
+    shape, chunks, order = meta["shape"], meta["chunks"], meta["order"]
+    axis = 0 if order == "C" else len(shape) - 1
+
+    blocks = []
+    for c in range(-(-shape[axis] // chunks[axis])):
+        key = ".".join(str(c) if k == axis else "0" for k in range(len(shape)))
+        data = zlib.decompress((path / key).read_bytes())
+        blocks.append(
+            np.frombuffer(data, dtype=meta["dtype"]).reshape(chunks, order=order)
+        )
+
+    return np.concatenate(blocks, axis=axis).take(range(shape[axis]), axis=axis)
+
+
 class TestSquare:
     def setup_method(self, method):
         self.seed = 123
@@ -161,6 +216,1086 @@ class TestHoneycomb:
         assert s.analysis_.shape == (n_steps - 1, n_walks + 3)
 
 
+class TestAnalysis:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize("n_walks", [1, 3])
+    def test_analysis_independent_of_n_jobs(self, n_walks):
+        kwargs = dict(
+            grid_size=self.grid_size, n_walks=n_walks, n_steps=200, random_seed=self.seed
+        )
+        s = CTRWfractal(n_jobs=None, **kwargs).run()
+        t = CTRWfractal(n_jobs=4, **kwargs).run()
+
+        np.testing.assert_array_equal(s.walks_, t.walks_)
+        pd.testing.assert_frame_equal(s.analysis_, t.analysis_)
+
+    @pytest.mark.parametrize("lattice_type", ["square", "honeycomb"])
+    def test_lattice_analysis_exact(self, lattice_type):
+        s = CTRWfractal(
+            grid_size=8,
+            lattice_type=lattice_type,
+            n_walks=2,
+            n_steps=300,
+            analysis_format="numpy",
+            random_seed=self.seed,
+        ).run()
+
+        # Noise-free walks are analysed in integer lattice coordinates
+        scale = [1.0, 1.0] if lattice_type == "square" else [0.5, np.sqrt(3) / 2]
+        cells = np.rint(s.walks_ / scale).astype(np.int64)
+        np.testing.assert_allclose(cells * scale, s.walks_, atol=1e-9)
+
+        weight = np.array([1, 1] if lattice_type == "square" else [1, 3])
+        for lag in [1, 7, 299]:
+            sums = np.sum((cells[:, lag:] - cells[:, :-lag]) ** 2 @ weight, axis=1)
+            expected = sums / (4 if lattice_type == "honeycomb" else 1) / (300 - lag)
+            np.testing.assert_array_equal(s.analysis_.tamsd[:, lag - 1], expected)
+
+    @pytest.mark.parametrize("lattice_type", ["square", "honeycomb"])
+    @pytest.mark.parametrize("grid_size", [6, 8])
+    def test_grid_size(self, lattice_type, grid_size):
+        # Power-of-two grids take the shift-and-mask path, others the generic one
+        s = CTRWfractal(
+            grid_size=grid_size,
+            lattice_type=lattice_type,
+            random_seed=self.seed,
+        ).run()
+
+        sites = np.arange(s.lattice_.shape[0])
+        col, row = sites // grid_size, sites % grid_size
+        if lattice_type == "square":
+            assert s.lattice_.shape == (grid_size ** 2, 2)
+            np.testing.assert_array_equal(s.lattice_, np.column_stack([col, row]))
+        else:
+            assert s.lattice_.shape == (4 * grid_size ** 2, 2)
+            x = 3 * (col // 4) + np.array([0.0, 0.5, 1.5, 2.0])[col % 4]
+            y = (grid_size - row - 1 + 0.5 * np.isin(col % 4, [0, 3])) * np.sqrt(3)
+            np.testing.assert_allclose(s.lattice_, np.column_stack([x, y]))
+
+    def test_grid_neighbours(self, tmp_path):
+        # Neighbour tables at power-of-two and other sizes, against the old loops
+        res = _run_cpp_test("test_grid", tmp_path)
+        assert res.returncode == 0, res.stdout + res.stderr
+
+
+class TestAnalysisFormat:
+    def setup_method(self, method):
+        self.kwargs = dict(grid_size=32, n_walks=4, n_steps=50, random_seed=123)
+
+    def test_numpy(self):
+        s = CTRWfractal(**self.kwargs).run()
+        t = CTRWfractal(analysis_format="numpy", **self.kwargs).run()
+
+        assert t.analysis_.tamsd.shape == (4, 49)
+        np.testing.assert_array_equal(t.analysis_.lags, np.arange(1, 50))
+        np.testing.assert_array_equal(t.analysis_.eamsd, s.analysis_["EnsembleMSD"])
+        np.testing.assert_array_equal(
+            t.analysis_.ergodicity, s.analysis_["ErgodicityBreaking"]
+        )
+        np.testing.assert_array_equal(t.analysis_.tamsd, s.analysis_.values[:, 3:].T)
+        assert np.shares_memory(t.analysis_.tamsd, t.analysis_.eatamsd)
+        pd.testing.assert_frame_equal(t.analysis_.to_frame(), s.analysis_)
+
+    def test_arrow(self):
+        pytest.importorskip("pyarrow")
+        s = CTRWfractal(analysis_format="numpy", **self.kwargs).run()
+        t = CTRWfractal(analysis_format="arrow", **self.kwargs).run()
+
+        table = t.analysis_.to_pandas()
+        assert len(table) == 7 * 49
+        assert table["walk"].isna().sum() == 3 * 49
+
+        tamsd = table[table["quantity"] == "TimeAveragedMSD"]
+        np.testing.assert_array_equal(tamsd["walk"], np.repeat(np.arange(4), 49))
+        np.testing.assert_array_equal(tamsd["lag"], np.tile(np.arange(1, 50), 4))
+        np.testing.assert_array_equal(tamsd["value"], s.analysis_.tamsd.ravel())
+
+
+class TestAgeing:
+    def setup_method(self, method):
+        self.est = CTRWfractal(
+            grid_size=32, n_walks=3, n_steps=50, analysis_format="numpy", random_seed=123
+        ).run()
+
+    def test_full_window_matches_analysis(self):
+        out = self.est.ageing_tamsd(0, 50)
+
+        assert out.shape == (3, 1, 1, 49)
+        np.testing.assert_allclose(out[:, 0, 0], self.est.analysis_.tamsd)
+
+    def test_ageing(self):
+        ageing_times, window_lengths, lags = [0, 10, 30], [5, 20, 40], [1, 4, 19]
+        out = ageing_tamsd(self.est.walks_, ageing_times, window_lengths, lags, n_jobs=2)
+
+        assert out.shape == (3, 3, 3, 3)
+        for (i, a, w, k), value in np.ndenumerate(out):
+            ta, window, lag = ageing_times[a], window_lengths[w], lags[k]
+            if lag >= window or ta + window > 50:
+                assert np.isnan(value)
+                continue
+            walk = self.est.walks_[i, ta : ta + window]
+            expected = np.mean(np.sum((walk[lag:] - walk[:-lag]) ** 2, axis=1))
+            np.testing.assert_allclose(value, expected)
+
+    def test_ageing_error(self):
+        with pytest.raises(ValueError, match="Invalid ageing parameters"):
+            ageing_tamsd(self.est.walks_, -1, 10)
+
+
+class TestDwell:
+    def setup_method(self, method):
+        self.est = CTRWfractal(
+            grid_size=32, n_walks=4, n_steps=500, beta=0.5, random_seed=123
+        ).run()
+
+    def test_noise_free(self):
+        segments, histogram, exponents = self.est.detect_dwells(t_min=1)
+
+        jumps = np.any(np.diff(self.est.walks_, axis=1) != 0.0, axis=2)
+        np.testing.assert_array_equal(np.diff(segments, axis=1) == 1, jumps)
+        np.testing.assert_array_equal(
+            histogram.Ensemble, histogram.filter(like="Walk").sum(axis=1)
+        )
+        assert histogram.Ensemble.sum() == exponents.Dwells["Ensemble"]
+        assert exponents.Dwells["Ensemble"] == np.sum(np.maximum(segments[:, -1] - 1, 0))
+        assert np.all(exponents.Noise == 0.0)
+
+    def test_noisy(self):
+        rng = np.random.default_rng(123)
+        noisy = self.est.walks_ + rng.normal(0.0, 0.05, self.est.walks_.shape)
+        clean = detect_dwells(self.est.walks_)
+        known = detect_dwells(noisy, noise=0.05, n_jobs=2)
+        estimated = detect_dwells(noisy, n_jobs=2)
+
+        np.testing.assert_array_equal(known[0], clean[0])
+        pd.testing.assert_frame_equal(known[1], clean[1])
+        np.testing.assert_allclose(estimated[2].Noise, 0.05, rtol=0.3)
+
+    def test_pareto_exponent(self):
+        # Dwells at 0 and 1 with waiting times P(t > x) = x^-beta
+        rng = np.random.default_rng(123)
+        beta = 0.8
+        times = np.cumsum(np.exp(rng.exponential(1.0 / beta, 100000)))
+        times = times[times < 10 ** 6]
+        positions = np.searchsorted(times, np.arange(10 ** 6)) % 2
+        walks = np.stack([positions, np.zeros_like(positions)], axis=-1)[None]
+
+        _, _, exponents = detect_dwells(walks, noise=0.0)
+        value, error = exponents.loc["Ensemble", ["Exponent", "StdError"]]
+        assert abs(value - beta) < 4 * error + 0.02
+
+    def test_dwell_error(self):
+        with pytest.raises(ValueError, match="Invalid dwell parameters"):
+            detect_dwells(self.est.walks_, t_min=0)
+
+
+class TestTracks:
+    def write_table(self, path, walks, ids, shuffle=True):
+        n_walks, n_steps, _ = walks.shape
+        table = np.column_stack(
+            [
+                np.repeat(ids, n_steps),
+                np.tile(np.arange(n_steps) + 5, n_walks),
+                walks.reshape(-1, 2),
+            ]
+        )
+        if shuffle:
+            table = table[np.random.default_rng(123).permutation(len(table))]
+        np.savetxt(path, table, fmt=["%d", "%d", "%.17g", "%.17g"], delimiter=",",
+                   header="track,frame,x,y", comments="")
+        return table
+
+    def test_matches_analysis(self, tmp_path):
+        est = CTRWfractal(
+            grid_size=32, n_walks=5, n_steps=100, noise=0.1, analysis_format="numpy", random_seed=123
+        ).run()
+        path = tmp_path / "tracks.csv"
+        table = self.write_table(path, est.walks_, [30, 7, 12, 99, 41])
+
+        analysis, tracks = analyse_tracks(path, analysis_format="numpy", n_jobs=3)
+        order = np.argsort([30, 7, 12, 99, 41])
+
+        np.testing.assert_array_equal(tracks.TrackId, [7, 12, 30, 41, 99])
+        np.testing.assert_array_equal(tracks.FirstFrame, 5)
+        np.testing.assert_array_equal(tracks.Frames, 100)
+        np.testing.assert_array_equal(tracks.Observed, 100)
+        np.testing.assert_allclose(analysis.eamsd, est.analysis_.eamsd)
+        np.testing.assert_allclose(analysis.eatamsd, est.analysis_.eatamsd)
+        np.testing.assert_allclose(analysis.ergodicity, est.analysis_.ergodicity)
+        np.testing.assert_allclose(analysis.tamsd, est.analysis_.tamsd[order])
+
+        binary = tmp_path / "tracks.bin"
+        records = np.zeros(len(table), dtype=[("track", "<i8"), ("frame", "<i8"), ("x", "<f8"), ("y", "<f8")])
+        for name, column in zip(records.dtype.names, table.T):
+            records[name] = column
+        records.tofile(binary)
+        lean, _ = analyse_tracks(binary, file_format="binary", analysis_format="numpy")
+        np.testing.assert_array_equal(lean.data, analysis.data)
+
+    def test_ragged(self, tmp_path):
+        path = tmp_path / "tracks.txt"
+        path.write_text("# id frame x y\n1 0 0.0 0.0\n1 1 1.0 0.0\n1 3 1.0 2.0\n\n2 4 5.0 5.0\n2 5 5.0 6.0\n")
+
+        analysis, tracks = analyse_tracks(path, delimiter=" ", max_lag=2, analysis_format="numpy")
+
+        np.testing.assert_array_equal(tracks.Frames, [4, 2])
+        np.testing.assert_array_equal(tracks.Observed, [3, 2])
+        assert analysis.tamsd.shape == (2, 2)
+        np.testing.assert_allclose(analysis.tamsd[0], [1.0, 4.0])
+        np.testing.assert_allclose(analysis.tamsd[1], [1.0, np.nan])
+        np.testing.assert_allclose(analysis.eamsd, [0.0, 0.0])
+
+    def test_tracks_error(self, tmp_path):
+        path = tmp_path / "tracks.csv"
+        path.write_text("1,0,0.0,0.0\n1,0,1.0,0.0\n")
+        with pytest.raises(RuntimeError, match="more than one row"):
+            analyse_tracks(path)
+
+        path.write_text("1,0,0.0,0.0\n1,x,1.0,0.0\n")
+        with pytest.raises(RuntimeError, match="Unable to parse"):
+            analyse_tracks(path)
+
+        with pytest.raises(ValueError, match="Invalid track parameters"):
+            analyse_tracks(path, delimiter=";;")
+
+        with pytest.raises(FileNotFoundError):
+            analyse_tracks(tmp_path / "missing.csv")
+
+
+class TestOutput:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize("noise", [None, 0.1])
+    def test_output(self, tmp_path, noise):
+        output = tmp_path / "run.zarr"
+        s = CTRWfractal(
+            grid_size=self.grid_size,
+            n_walks=5,
+            n_steps=30,
+            noise=noise,
+            sweep=True,
+            output=str(output),
+            random_seed=self.seed,
+        )
+        s.run()
+
+        attrs = json.loads((output / ".zattrs").read_text())
+        assert attrs["random_seed"] == self.seed
+        assert attrs["n_walks"] == 5
+
+        np.testing.assert_array_equal(_read_zarr(output / "walks"), s.walks_)
+        np.testing.assert_array_equal(_read_zarr(output / "clusters"), s.clusters_)
+        np.testing.assert_array_equal(_read_zarr(output / "sweep"), s.sweep_)
+        np.testing.assert_array_equal(
+            _read_zarr(output / "analysis"), s.analysis_.values
+        )
+
+    def test_output_attributes(self, tmp_path):
+        output = tmp_path / "run.zarr"
+        s = CTRWfractal(
+            grid_size=self.grid_size,
+            lattice_type="honeycomb",
+            percolation_type="bond",
+            threshold=0.7,
+            sweep=True,
+            walk_type="largest",
+            n_walks=4,
+            n_steps=40,
+            beta=0.8,
+            tau0=0.5,
+            walk_thresholds=[0.6, 0.8],
+            switch_rates=(0.1, 0.2),
+            dynamic_clusters=True,
+            memory_limit=1 << 30,
+            output=str(output),
+            random_seed=self.seed,
+            n_jobs=1,
+        ).run()
+
+        # Every argument that changes the run is stored, under its own name
+        attrs = json.loads((output / ".zattrs").read_text())
+        params = inspect.signature(CTRWfractal).parameters
+        assert set(attrs) == set(params) - {"output", "analysis_format"}
+
+        t = CTRWfractal(**attrs).run()
+        np.testing.assert_array_equal(t.lattice_, s.lattice_)
+        np.testing.assert_array_equal(t.clusters_, s.clusters_)
+        np.testing.assert_array_equal(t.walks_, s.walks_)
+        np.testing.assert_array_equal(t.sweep_, s.sweep_)
+
+
+class TestAccelerate:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize("lattice_type", ["square", "honeycomb"])
+    @pytest.mark.parametrize("beta, tau0", [(None, None), (1.5, 0.5)])
+    def test_accelerate(self, lattice_type, beta, tau0):
+        kwargs = dict(
+            grid_size=self.grid_size,
+            lattice_type=lattice_type,
+            threshold=1.0,
+            n_walks=500,
+            n_steps=50,
+            beta=beta,
+            tau0=tau0,
+            random_seed=self.seed,
+        )
+        s = CTRWfractal(accelerate=True, **kwargs).run()
+        t = CTRWfractal(accelerate=False, **kwargs).run()
+
+        assert s.walks_.shape == t.walks_.shape
+
+        # Same statistics as the full pipeline
+        np.testing.assert_allclose(
+            s.analysis_["EnsembleMSD"].iloc[-1],
+            t.analysis_["EnsembleMSD"].iloc[-1],
+            rtol=0.3,
+        )
+
+
+class TestExtend:
+    def setup_method(self, method):
+        self.kwargs = dict(
+            grid_size=16,
+            n_walks=5,
+            beta=0.7,
+            tau0=0.5,
+            accelerate=True,
+            extendable=True,
+            random_seed=123,
+        )
+
+    @pytest.mark.parametrize("lattice_type", ["square", "honeycomb"])
+    def test_extend(self, lattice_type):
+        s = CTRWfractal(n_steps=100, lattice_type=lattice_type, **self.kwargs).run()
+        s.extend(250).extend(400)
+        t = CTRWfractal(n_steps=400, lattice_type=lattice_type, **self.kwargs).run()
+
+        assert s.walks_.shape == (5, 400, 2)
+        np.testing.assert_array_equal(s.walks_, t.walks_)
+        pd.testing.assert_frame_equal(s.analysis_, t.analysis_)
+
+    def test_extend_backbone(self):
+        s = CTRWfractal(n_steps=50, threshold=0.7, backbone=True, **self.kwargs).run()
+        t = CTRWfractal(n_steps=120, threshold=0.7, backbone=True, **self.kwargs).run()
+
+        np.testing.assert_array_equal(s.extend(120).walks_, t.walks_)
+        np.testing.assert_array_equal(s.backbone_fraction_, t.backbone_fraction_)
+
+    def test_extend_invalid(self):
+        with pytest.raises(ValueError, match="extendable"):
+            CTRWfractal(n_walks=2, n_steps=10, extendable=True).run()
+
+        with pytest.raises(ValueError, match="No walks"):
+            CTRWfractal(n_walks=2, n_steps=10, accelerate=True).run().extend(20)
+
+        s = CTRWfractal(n_steps=10, **self.kwargs).run()
+        with pytest.raises(ValueError, match="n_steps"):
+            s.extend(10)
+
+
+class TestSplitting:
+    def setup_method(self, method):
+        self.kwargs = dict(grid_size=32, threshold=1.0, n_steps=100, random_seed=123)
+        self.levels = [4.5, 8.5, 12.5, 16.5]
+
+    def test_plain(self):
+        # Without clones, the walks are those of an accelerate run
+        est = CTRWfractal(n_walks=200, accelerate=True, **self.kwargs)
+        tails, _ = est.van_hove_tail(self.levels, n_clones=1)
+
+        walks = est.run().walks_
+        r = np.linalg.norm(walks[:, -1] - walks[:, 0], axis=1)
+        expected = [np.mean(r >= level) for level in self.levels]
+        np.testing.assert_allclose(tails["Probability"], expected, atol=1e-12)
+
+    def test_unbiased(self):
+        plain, _ = CTRWfractal(n_walks=4000, **self.kwargs).van_hove_tail(
+            self.levels, n_clones=1
+        )
+        split, distribution = CTRWfractal(n_walks=400, **self.kwargs).van_hove_tail(
+            self.levels, n_clones=3
+        )
+
+        error = np.sqrt(plain["StdError"] ** 2 + split["StdError"] ** 2)
+        assert np.all(np.abs(plain["Probability"] - split["Probability"]) < 4 * error)
+        assert split["Reached"].iloc[-1] > plain["Reached"].iloc[-1] * 400 / 4000
+
+        # The default bins run from 0 to infinity through the levels
+        np.testing.assert_allclose(distribution["Probability"].sum(), 1.0)
+        np.testing.assert_allclose(
+            distribution["Probability"].iloc[1:].sum(), split["Probability"].iloc[0]
+        )
+
+    def test_split_invalid(self):
+        est = CTRWfractal(n_walks=10, **self.kwargs)
+        with pytest.raises(ValueError, match="levels"):
+            est.van_hove_tail([5.0, 2.0])
+
+        with pytest.raises(ValueError, match="n_clones"):
+            est.van_hove_tail(self.levels, n_clones=0)
+
+        with pytest.raises(ValueError, match="No walks"):
+            CTRWfractal(grid_size=32).van_hove_tail(self.levels)
+
+        with pytest.raises(ValueError, match="walkers per walk"):
+            est.van_hove_tail(np.arange(1.0, 12.0), n_clones=4)
+
+
+class TestWalkThresholds:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize("percolation_type", ["site", "bond"])
+    @pytest.mark.parametrize("walk_type", ["all", "largest"])
+    def test_walk_thresholds(self, percolation_type, walk_type):
+        thresholds = [0.6, 0.8, 1.0]
+        s = CTRWfractal(
+            grid_size=self.grid_size,
+            percolation_type=percolation_type,
+            walk_type=walk_type,
+            n_walks=3,
+            n_steps=20,
+            walk_thresholds=thresholds,
+            random_seed=self.seed,
+            n_jobs=2,
+        )
+        s.run()
+
+        assert s.threshold_walks_.shape == (3, 3, 20, 2)
+        assert len(s.threshold_analysis_) == 3
+        for df in s.threshold_analysis_:
+            assert df.shape == s.analysis_.shape
+
+        # Reproducible for a given seed, whatever the number of threads
+        t = CTRWfractal(
+            grid_size=self.grid_size,
+            percolation_type=percolation_type,
+            walk_type=walk_type,
+            n_walks=3,
+            n_steps=20,
+            walk_thresholds=thresholds,
+            random_seed=self.seed,
+            n_jobs=1,
+        )
+        t.run()
+        np.testing.assert_array_equal(s.threshold_walks_, t.threshold_walks_)
+
+    @pytest.mark.parametrize(
+        "percolation_type, thresholds", [("site", [0.5, 0.6]), ("bond", [0.4, 0.5])]
+    )
+    @pytest.mark.parametrize("walk_type", ["all", "largest"])
+    def test_walk_thresholds_occupancy(
+        self, percolation_type, thresholds, walk_type
+    ):
+        s = CTRWfractal(
+            grid_size=self.grid_size,
+            percolation_type=percolation_type,
+            walk_type=walk_type,
+            n_walks=20,
+            n_steps=200,
+            walk_thresholds=thresholds,
+            random_seed=self.seed,
+        ).run()
+
+        g = self.grid_size
+        empty = -(g * g) - 1  # Occupied sites hold minus the size of their cluster
+        for p, walks in zip(thresholds, s.threshold_walks_):
+            # The percolation order is shared, so a run at p has the same occupancy
+            clusters = CTRWfractal(
+                grid_size=g,
+                percolation_type=percolation_type,
+                threshold=p,
+                random_seed=self.seed,
+            ).run().clusters_
+
+            cells = np.rint(walks).astype(np.int64)
+            sites = (cells[..., 0] % g) * g + cells[..., 1] % g
+            assert np.all(clusters[sites] != empty)
+            if walk_type == "largest":
+                assert np.all(clusters[sites] == clusters[clusters != empty].min())
+
+            # Each step stays put or hops to a neighbour in the same cluster,
+            # so a bond is never crossed unless it is open at p
+            hops = np.abs(np.diff(cells, axis=1)).sum(axis=-1)
+            assert np.all(hops <= 1)
+            assert np.all(clusters[sites[:, 1:]] == clusters[sites[:, :-1]])
+            assert np.any(hops == 1)
+
+    def test_no_walk_thresholds(self):
+        s = CTRWfractal(grid_size=self.grid_size, n_walks=1, n_steps=10)
+        s.run()
+        assert s.threshold_walks_ is None
+        assert s.threshold_analysis_ is None
+
+
+class TestDynamic:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize("percolation_type", ["site", "bond"])
+    @pytest.mark.parametrize("dynamic_clusters", [False, True])
+    def test_dynamic(self, percolation_type, dynamic_clusters):
+        kwargs = dict(
+            grid_size=self.grid_size,
+            percolation_type=percolation_type,
+            n_walks=2,
+            n_steps=50,
+            random_seed=self.seed,
+        )
+        s = CTRWfractal(
+            switch_rates=(0.5, 0.5), dynamic_clusters=dynamic_clusters, **kwargs
+        )
+        s.run()
+        t = CTRWfractal(**kwargs)
+        t.run()
+
+        assert s.walks_.shape == (2, 50, 2)
+        assert s.analysis_.shape == (49, 5)
+
+        # Clusters are only relabelled when requested
+        if dynamic_clusters:
+            assert not np.array_equal(s.clusters_, t.clusters_)
+        else:
+            np.testing.assert_array_equal(s.clusters_, t.clusters_)
+
+        # The walkers start on the initial configuration, which is that of the
+        # static run, and then stay put or hop to a neighbour at each step
+        g = self.grid_size
+        cells = np.rint(s.walks_).astype(np.int64)
+        starts = (cells[:, 0, 0] % g) * g + cells[:, 0, 1] % g
+        assert np.all(t.clusters_[starts] > -t.clusters_.size - 1)
+        assert np.all(np.abs(np.diff(cells, axis=1)).sum(axis=-1) <= 1)
+        assert not np.array_equal(s.walks_, t.walks_)
+
+    def test_relaxation(self):
+        # With the walks lasting many switching times, each site is occupied
+        # with probability k_on / (k_on + k_off) at the end, whatever the
+        # threshold it started from
+        k_on, k_off = 0.2, 0.6
+        s = CTRWfractal(
+            grid_size=64,
+            n_walks=1,
+            n_steps=100,
+            switch_rates=(k_on, k_off),
+            dynamic_clusters=True,
+            random_seed=self.seed,
+        ).run()
+
+        expected = k_on / (k_on + k_off)
+        error = np.sqrt(expected * (1.0 - expected) / s.clusters_.size)
+        assert abs(s.occupied_fraction_ - expected) < 5 * error
+
+
+class TestBackbone:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 16
+
+    @pytest.mark.parametrize("accelerate", [False, True])
+    @pytest.mark.parametrize("exclusion", [False, True])
+    def test_backbone(self, accelerate, exclusion):
+        g = self.grid_size
+        s = CTRWfractal(
+            grid_size=g,
+            threshold=0.65,
+            walk_type="largest",
+            n_walks=5,
+            n_steps=200,
+            accelerate=accelerate,
+            exclusion=exclusion,
+            backbone=True,
+            random_seed=self.seed,
+        ).run()
+
+        labels = s.backbone_
+        assert set(np.unique(labels)) <= {-1, 0, 1}
+        assert np.any(labels == 1) and np.any(labels == 0)
+
+        # Every backbone site has at least two backbone neighbours
+        grid = (labels == 1).reshape(g, g)
+        count = sum(
+            np.roll(grid, shift, axis) for shift in (1, -1) for axis in (0, 1)
+        )
+        assert np.all(count[grid] >= 2)
+
+        # The walks start on the largest cluster, and their time on the
+        # backbone follows from the sites they visit
+        sites = np.mod(np.rint(s.walks_).astype(np.int64), g)
+        sites = sites[..., 0] * g + sites[..., 1]
+        assert np.all(labels[sites] >= 0)
+        np.testing.assert_allclose(
+            s.backbone_fraction_, np.mean(labels[sites] == 1, axis=1)
+        )
+
+    def test_backbone_full_lattice(self):
+        s = CTRWfractal(
+            grid_size=self.grid_size, threshold=1.0, backbone=True, random_seed=self.seed
+        ).run()
+
+        np.testing.assert_array_equal(s.backbone_, 1)
+        assert s.backbone_fraction_ is None
+
+    def test_no_backbone(self):
+        s = CTRWfractal(grid_size=self.grid_size, random_seed=self.seed).run()
+
+        assert s.backbone_ is None
+
+
+class TestSpectrum:
+    def test_full_lattice(self):
+        grid_size = 32
+        dos, spectral_dimension = laplacian_spectrum(
+            grid_size=grid_size, threshold=1.0, random_seed=123
+        )
+
+        # Eigenvalues of the periodic square lattice
+        k = 4.0 * np.sin(np.pi * np.arange(grid_size) / grid_size) ** 2
+        eigenvalues = np.sort((k[:, None] + k[None, :]).ravel())[1:]
+        edges = np.sqrt(dos.Eigenvalue * dos.Eigenvalue.shift(-1)).to_numpy()[:-1]
+        expected = np.searchsorted(eigenvalues, edges, side="right") / grid_size ** 2
+
+        assert dos.shape == (40, 3)
+        assert dos.Eigenvalue.min() > 0.0 and dos.Eigenvalue.max() < 8.0
+        assert np.all(np.diff(dos.Cumulative) >= 0.0)
+        np.testing.assert_allclose(dos.Cumulative.iloc[-1], 1.0 - 1.0 / grid_size ** 2)
+        np.testing.assert_allclose(dos.Cumulative.to_numpy()[:-1], expected, atol=0.05)
+        assert abs(spectral_dimension - 2.0) < 0.2
+
+    def test_n_jobs(self):
+        dos1, d1 = laplacian_spectrum(grid_size=32, random_seed=123, n_jobs=1)
+        dos2, d2 = laplacian_spectrum(grid_size=32, random_seed=123, n_jobs=4)
+
+        pd.testing.assert_frame_equal(dos1, dos2)
+        assert d1 == d2 or (np.isnan(d1) and np.isnan(d2))
+
+    def test_spectrum_error(self):
+        with pytest.raises(ValueError, match="Invalid spectrum parameters"):
+            laplacian_spectrum(grid_size=32, n_probes=0)
+
+
+class TestExclusion:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize("beta", [None, 0.8])
+    def test_exclusion(self, beta):
+        n_walks = 300
+        s = CTRWfractal(
+            grid_size=self.grid_size,
+            threshold=0.8,
+            n_walks=n_walks,
+            n_steps=40,
+            beta=beta,
+            exclusion=True,
+            random_seed=self.seed,
+        )
+        s.run()
+
+        assert s.walks_.shape == (n_walks, 40, 2)
+
+        # No two particles share a site at any step
+        sites = np.round(np.mod(s.walks_, self.grid_size)).astype(np.int64)
+        sites = sites[..., 0] * self.grid_size + sites[..., 1]
+        for j in range(sites.shape[1]):
+            assert np.unique(sites[:, j]).size == n_walks
+
+    def test_too_many_particles(self):
+        s = CTRWfractal(
+            grid_size=8, n_walks=100, n_steps=10, exclusion=True, random_seed=self.seed
+        )
+        with pytest.raises(RuntimeError, match="free start site"):
+            s.run()
+
+
+class TestBond:
+    def setup_method(self, method):
+        self.seed = 123
+        self.grid_size = 32
+
+    @pytest.mark.parametrize(
+        "lattice_type, n_sites, n_bonds",
+        [("square", 32 * 32, 2 * 32 * 32), ("honeycomb", 4 * 32 * 32, 6 * 32 * 32)],
+    )
+    @pytest.mark.parametrize("walk_type", ["all", "largest"])
+    def test_bond_with_walks(self, lattice_type, n_sites, n_bonds, walk_type):
+        s = CTRWfractal(
+            grid_size=self.grid_size,
+            lattice_type=lattice_type,
+            percolation_type="bond",
+            sweep=True,
+            walk_type=walk_type,
+            n_walks=2,
+            n_steps=25,
+            random_seed=self.seed,
+        )
+        s.run()
+
+        # All sites are present for bond percolation
+        assert s.clusters_.shape == (n_sites,)
+        np.testing.assert_allclose(s.occupied_fraction_, 1.0)
+
+        assert s.walks_.shape == (2, 25, 2)
+        assert s.sweep_.shape == (n_bonds, 2)
+
+        # Largest cluster grows monotonically to the full lattice
+        assert np.all(np.diff(s.sweep_[:, 0]) >= 0)
+        assert s.sweep_[-1, 0] == n_sites
+
+    def test_sweep_matches_threshold(self):
+        s = CTRWfractal(grid_size=self.grid_size, random_seed=self.seed, sweep=True)
+        s.run()
+
+        # Sweeping beyond the threshold must not change the clusters
+        t = CTRWfractal(grid_size=self.grid_size, random_seed=self.seed)
+        t.run()
+        np.testing.assert_array_equal(s.clusters_, t.clusters_)
+        assert t.sweep_ is None
+
+        curve = s.percolation_curve([0.0, 0.3, 0.9, 1.0])
+        assert curve.shape == (4, 2)
+        np.testing.assert_allclose(curve.iloc[0], [0.0, 0.0])
+        np.testing.assert_allclose(curve.iloc[-1], [1.0, s.clusters_.size])
+        assert curve["LargestClusterFraction"].is_monotonic_increasing
+
+
+class TestSweep:
+    def setup_method(self, method):
+        self.seed = 123
+
+    @pytest.mark.parametrize("n_jobs", [None, -1])
+    def test_sweep_matches_runs(self, n_jobs):
+        params = dict(
+            grid_size=[16, 24],
+            threshold=[0.6, 0.7],
+            random_seed=[self.seed, self.seed + 1],
+            beta=[None, 1.5],
+            noise=[None, 0.1],
+            n_steps=10,
+        )
+        res = run_sweep(n_walks=5, n_jobs=n_jobs, **params)
+        assert len(res) == 32
+
+        for s in res:
+            t = CTRWfractal(
+                grid_size=s.grid_size,
+                threshold=s.threshold,
+                random_seed=s.random_seed,
+                beta=s.beta,
+                noise=s.noise,
+                n_walks=5,
+                n_steps=10,
+            ).run()
+
+            np.testing.assert_array_equal(s.clusters_, t.clusters_)
+            np.testing.assert_array_equal(s.lattice_, t.lattice_)
+            np.testing.assert_array_equal(s.walks_, t.walks_)
+            pd.testing.assert_frame_equal(s.analysis_, t.analysis_)
+
+    def test_sweep_without_walks(self):
+        res = run_sweep(grid_size=16, threshold=[0.5, 0.6], random_seed=self.seed)
+        t = CTRWfractal(grid_size=16, threshold=0.6, random_seed=self.seed).run()
+
+        assert res[1].walks_ is None
+        np.testing.assert_array_equal(res[1].clusters_, t.clusters_)
+        np.testing.assert_array_equal(res[1].lattice_, t.lattice_)
+
+    def test_sweep_memory_limit(self):
+        with pytest.raises(RuntimeError, match="memory limit"):
+            run_sweep(n_walks=10, n_steps=100, random_seed=self.seed, memory_limit=1)
+
+
+class TestMemory:
+    def setup_method(self, method):
+        self.kwargs = dict(grid_size=16, n_walks=20, n_steps=50, random_seed=123)
+
+    def test_memory_plan(self):
+        plan = CTRWfractal(**self.kwargs).memory_plan()
+
+        assert plan["walksCoords"] == 2 * 50 * 20 * 8
+        assert plan["taMSD"] == 49 * 20 * 8
+        assert plan["nn"] == 4 * 16 ** 2 * 8
+
+    def test_memory_limit_accumulates(self):
+        plan = CTRWfractal(**self.kwargs).memory_plan()
+        limit = plan.sum() - plan["taMSD"]
+
+        lean = CTRWfractal(memory_limit=limit, **self.kwargs)
+        assert "taMSD" not in lean.memory_plan()
+        assert lean.memory_plan().sum() <= limit
+
+        s = lean.run()
+        t = CTRWfractal(**self.kwargs).run()
+
+        np.testing.assert_array_equal(s.walks_, t.walks_)
+        np.testing.assert_allclose(s.analysis_, t.analysis_, rtol=1e-10, atol=1e-12)
+
+    def test_memory_limit_error(self):
+        with pytest.raises(RuntimeError, match="memory limit"):
+            CTRWfractal(memory_limit=1000, **self.kwargs).run()
+
+
+class TestParallelFill:
+    def test_parallel_fill(self, tmp_path):
+        # Both overloads, around the serial cutoff, for any number of threads
+        res = _run_cpp_test("test_parallel_fill", tmp_path)
+        assert res.returncode == 0, res.stdout + res.stderr
+
+
+class TestProgress:
+    def setup_method(self, method):
+        self.seed = 123
+
+    def test_progress(self):
+        s = CTRWfractal(grid_size=16, n_walks=10, n_steps=50, random_seed=self.seed)
+        calls = []
+        s.run(callback=calls.append, interval=0.001)
+        counts = s.progress()
+
+        assert not s.cancelled_
+        assert counts["stage"] == "done"
+        assert counts["walks"] == 10
+        assert counts["steps"] == 10 * 50
+        assert counts["lags"] == 10 * 49
+        assert {c["stage"] for c in calls} <= {
+            "neighbours",
+            "permutation",
+            "percolation",
+            "walks",
+            "noise",
+            "analysis",
+            "done",
+        }
+
+    def test_cancel(self):
+        s = CTRWfractal(
+            grid_size=128, n_walks=2000, n_steps=2000, random_seed=self.seed
+        )
+        with pytest.warns(RuntimeWarning, match="cancelled"):
+            s.run(callback=lambda counts: True, interval=0.01)
+
+        assert s.cancelled_
+        assert s.analysis_ is None
+        assert s.progress()["stage"] != "done"
+
+    def test_cancel_walks(self):
+        # Only the walks completed before the cancellation are kept
+        s = CTRWfractal(
+            grid_size=64,
+            n_walks=5000,
+            n_steps=2000,
+            backbone=True,
+            random_seed=self.seed,
+        )
+        def during_walks(counts):
+            return counts["stage"] == "walks" and counts["walks"] > 0
+
+        with pytest.warns(RuntimeWarning, match="cancelled"):
+            s.run(callback=during_walks, interval=0.001)
+        counts = s.progress()
+
+        assert counts["stage"] == "walks"
+        assert 0 < counts["walks"] < 5000
+        assert s.walks_.shape == (counts["walks"], 2000, 2)
+        assert s.backbone_ is not None
+        assert s.backbone_fraction_ is None
+
+    @pytest.mark.skipif(
+        not sys.platform.startswith("linux"), reason="Interposes the glibc allocator"
+    )
+    def test_allocations(self, tmp_path):
+        # Every heap allocation made by RandomWalks is counted: the walk
+        # loop reuses its buffers, so there are as many for 30 walks as for 1
+        res = _run_cpp_test("test_allocations", tmp_path)
+        assert res.returncode == 0, res.stdout + res.stderr
+
+
+class TestDataset:
+    def setup_method(self, method):
+        self.seed = 123
+        self.kwargs = dict(
+            n_tracks=250,
+            n_steps=20,
+            beta=(0.2, 0.8),
+            threshold=(0.6, 0.7),
+            noise=(0.0, 0.1),
+            grid_size=16,
+            tracks_per_lattice=30,
+            tracks_per_shard=100,
+            random_seed=self.seed,
+        )
+
+    def test_dataset(self, tmp_path):
+        meta = generate_dataset(str(tmp_path), **self.kwargs)
+        assert meta["n_shards"] == 3
+        assert json.loads((tmp_path / "dataset.json").read_text()) == meta
+
+        walks = [np.load(tmp_path / f"walks-{s:05d}.npy") for s in range(3)]
+        labels = [np.load(tmp_path / f"labels-{s:05d}.npy") for s in range(3)]
+        assert [w.shape for w in walks] == [(100, 20, 2), (100, 20, 2), (50, 20, 2)]
+        assert [lb.shape for lb in labels] == [(100, 4), (100, 4), (50, 4)]
+
+        labels = np.concatenate(labels)
+        assert np.all((labels[:, 0] >= 0.2) & (labels[:, 0] <= 0.8))
+        assert np.all((labels[:, 1] >= 0.6) & (labels[:, 1] <= 0.7))
+        assert np.all((labels[:, 2] >= 0.0) & (labels[:, 2] <= 0.1))
+
+        # Each run of tracks_per_lattice tracks in a shard shares a lattice
+        lattice = labels[:100, 3]
+        np.testing.assert_array_equal(lattice, np.arange(100) // 30)
+        assert len(np.unique(labels[:, 3])) == 4 + 4 + 2
+
+    def test_dataset_independent_of_n_jobs(self, tmp_path):
+        generate_dataset(str(tmp_path / "a"), n_jobs=None, **self.kwargs)
+        generate_dataset(str(tmp_path / "b"), n_jobs=-1, **self.kwargs)
+
+        for name in ["walks-00000.npy", "labels-00002.npy"]:
+            np.testing.assert_array_equal(
+                np.load(tmp_path / "a" / name), np.load(tmp_path / "b" / name)
+            )
+
+    def test_dataset_prior_error(self, tmp_path):
+        with pytest.raises(ValueError, match="Invalid beta parameter"):
+            generate_dataset(str(tmp_path), n_tracks=10, beta=(1.0, 0.5))
+        with pytest.raises(ValueError, match="Invalid threshold parameter"):
+            generate_dataset(str(tmp_path), n_tracks=10, threshold=(0.5, 1.5))
+
+
+class TestABC:
+    def setup_method(self, method):
+        self.seed = 123
+        self.tracks = (
+            CTRWfractal(
+                grid_size=32,
+                threshold=0.7,
+                n_walks=20,
+                n_steps=100,
+                beta=0.6,
+                accelerate=True,
+                random_seed=self.seed,
+            )
+            .run()
+            .walks_
+        )
+        self.kwargs = dict(
+            beta=(0.2, 1.0),
+            threshold=(0.6, 0.9),
+            n_particles=20,
+            n_rounds=3,
+            grid_size=32,
+            random_seed=self.seed,
+        )
+
+    def test_abc(self):
+        posterior, history, statistics = fit_abc(self.tracks, **self.kwargs)
+
+        assert posterior.shape == (20, 4)
+        np.testing.assert_allclose(posterior["weight"].sum(), 1.0)
+        assert posterior["beta"].between(0.2, 1.0).all()
+        assert posterior["threshold"].between(0.6, 0.9).all()
+        assert (posterior["distance"] <= history["Tolerance"].iloc[-1]).all()
+
+        assert 1 <= len(history) <= 3
+        assert history["Tolerance"].is_monotonic_decreasing
+        assert list(statistics.columns) == ["Observed", "Scale"]
+        assert (statistics["Scale"] > 0).all()
+
+    def test_abc_independent_of_n_jobs(self):
+        s, _, _ = fit_abc(self.tracks, n_jobs=None, **self.kwargs)
+        t, _, _ = fit_abc(self.tracks, n_jobs=-1, **self.kwargs)
+
+        pd.testing.assert_frame_equal(s, t)
+
+    def test_abc_tracks_error(self):
+        with pytest.raises(ValueError, match="Invalid tracks parameter"):
+            fit_abc(self.tracks[..., 0])
+
+
+class TestServer:
+    def setup_method(self, method):
+        self.seed = 123
+
+    @pytest.fixture
+    def server(self, tmp_path):
+        server = SimulationServer(str(tmp_path / "ctrw.sock"), max_lattices=2)
+        thread = threading.Thread(target=server.serve_forever, daemon=True)
+        thread.start()
+        yield server
+        server.shutdown()
+        server.server_close()
+
+    @pytest.mark.parametrize("beta", [None, 1.5])
+    def test_server_matches_run(self, server, beta):
+        params = dict(
+            grid_size=16, n_walks=5, n_steps=10, beta=beta, random_seed=self.seed
+        )
+        t = CTRWfractal(**params).run()
+
+        with Client(server.server_address) as client:
+            for _ in range(2):  # The second run reuses the cached lattice
+                s = client.run(**params)
+
+                np.testing.assert_array_equal(s.clusters_, t.clusters_)
+                np.testing.assert_array_equal(s.lattice_, t.lattice_)
+                np.testing.assert_array_equal(s.walks_, t.walks_)
+                pd.testing.assert_frame_equal(s.analysis_, t.analysis_)
+
+        assert len(server._lattices) == 1
+
+    def test_server_errors(self, server):
+        with Client(server.server_address) as client:
+            with pytest.raises(ValueError, match="Invalid parameters"):
+                client.run(grid_size=16, sweep=True)
+            with pytest.raises(ValueError, match="Invalid beta parameter"):
+                client.run(grid_size=16, beta=-1)
+
+            s = client.run(grid_size=16)  # The connection survives errors
+            assert s.walks_ is None
+
+    def test_server_unlinks_unsent(self, server, monkeypatch):
+        send = server_module._send
+        shared = []
+
+        def fail_reply(sock, message):
+            if "shm" in message:
+                shared.append(message["shm"])
+                raise BrokenPipeError
+            send(sock, message)
+
+        monkeypatch.setattr(server_module, "_send", fail_reply)
+        with Client(server.server_address) as client:
+            with pytest.raises(ConnectionError, match="closed the connection"):
+                client.run(grid_size=16, n_walks=2, n_steps=10)
+
+        assert len(shared) == 1
+        assert not os.path.exists(shared[0])
+
+    def test_server_close_unlinks(self, tmp_path):
+        server = SimulationServer(str(tmp_path / "close.sock"))
+        thread = threading.Thread(target=server.serve_forever, daemon=True)
+        thread.start()
+
+        # A reply that is received, but never attached
+        with Client(server.server_address) as client:
+            server_module._send(client._sock, {"params": dict(grid_size=16)})
+            reply = server_module._recv(client._sock)
+        assert os.path.exists(reply["shm"])
+
+        server.shutdown()
+        server.server_close()
+        assert not os.path.exists(reply["shm"])
+
+
 class TestErrors:
     def setup_method(self, method):
         self.seed = 123
@@ -175,6 +1310,11 @@ class TestErrors:
         with pytest.raises(ValueError, match="Invalid lattice_type parameter"):
             s.run()
 
+    def test_percolation_type_error(self):
+        s = CTRWfractal(grid_size=self.grid_size, percolation_type="continuum")
+        with pytest.raises(ValueError, match="Invalid percolation_type parameter"):
+            s.run()
+
     def test_walk_type_error(self):
         s = CTRWfractal(grid_size=self.grid_size, walk_type=None)
         with pytest.raises(ValueError, match="Invalid walk_type parameter"):
@@ -189,6 +1329,28 @@ class TestErrors:
         with pytest.raises(ValueError, match="Invalid threshold parameter"):
             s.run()
 
+    def test_walk_thresholds_error(self):
+        s = CTRWfractal(grid_size=self.grid_size, walk_thresholds=[0.5, 1.2])
+        with pytest.raises(ValueError, match="Invalid walk_thresholds parameter"):
+            s.run()
+
+    def test_switch_rates_error(self):
+        s = CTRWfractal(grid_size=self.grid_size, switch_rates=(0.1, -0.1))
+        with pytest.raises(ValueError, match="Invalid switch_rates parameter"):
+            s.run()
+
+    def test_exclusion_error(self):
+        s = CTRWfractal(
+            grid_size=self.grid_size, exclusion=True, switch_rates=(0.1, 0.1)
+        )
+        with pytest.raises(ValueError, match="Invalid exclusion parameter"):
+            s.run()
+
+    def test_backbone_error(self):
+        s = CTRWfractal(grid_size=2, backbone=True)
+        with pytest.raises(ValueError, match="Invalid backbone parameter"):
+            s.run()
+
     def test_beta_error(self):
         s = CTRWfractal(grid_size=self.grid_size, beta=-0.2)
         with pytest.raises(ValueError, match="Invalid beta parameter"):
@@ -203,3 +1365,13 @@ class TestErrors:
         s = CTRWfractal(grid_size=self.grid_size, noise=-0.2)
         with pytest.raises(ValueError, match="Invalid noise parameter"):
             s.run()
+
+    def test_analysis_format_error(self):
+        s = CTRWfractal(grid_size=self.grid_size, analysis_format="parquet")
+        with pytest.raises(ValueError, match="Invalid analysis_format parameter"):
+            s.run()
+
+    def test_memory_limit_error(self):
+        s = CTRWfractal(grid_size=self.grid_size, memory_limit=0)
+        with pytest.raises(ValueError, match="Invalid memory_limit parameter"):
+            s.run()
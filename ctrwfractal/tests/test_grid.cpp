@@ -0,0 +1,202 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Checks the neighbour tables built with the grid index arithmetic,
+  which uses PowerOfTwoGrid for power-of-two sizes and GenericGrid
+  otherwise, against the modulo and row-list loops they replaced, and
+  the two grids against each other. Built and run by
+  test_ctrwfractal.py.
+
+***************************************************************************/
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <armadillo>
+
+#include "_ctrw.hpp"
+
+static int failures = 0;
+
+static void Check(const bool ok, const std::string &what)
+{
+  if (!ok)
+  {
+    std::cout << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+// The square lattice neighbours, by modulo arithmetic on the site index
+static arma::imat ReferenceSquare(const int64_t gridSize)
+{
+  const int64_t N = gridSize * gridSize;
+  arma::imat nn(4, N);
+  for (int64_t i = 0; i < N; i++)
+  {
+    nn(0, i) = (i + 1) % N;
+    nn(1, i) = (i + N - 1) % N;
+    nn(2, i) = (i + gridSize) % N;
+    nn(3, i) = (i + N - gridSize) % N;
+    if (i % gridSize == 0)
+    {
+      nn(1, i) = i + gridSize - 1;
+    }
+    if ((i + 1) % gridSize == 0)
+    {
+      nn(0, i) = i - gridSize + 1;
+    }
+  }
+  return nn;
+}
+
+// The honeycomb lattice neighbours, by looking each site up in the lists
+// of first and last rows, and counting the columns
+static arma::imat ReferenceHoneycomb(const int64_t gridSize)
+{
+  const int64_t N = 4 * gridSize * gridSize;
+  arma::ivec firstRow(2 * gridSize), lastRow(2 * gridSize);
+  for (int64_t i = 1; i <= 2 * gridSize; i++)
+  {
+    firstRow(i - 1) = 1 - 0.5 * (3 * gridSize) + 0.5 * (std::pow(-1, i) * gridSize) + 2 * i * gridSize - 1;
+    lastRow(i - 1) = 0.5 * gridSize * (4 * i + std::pow(-1, i + 1) - 1) - 1;
+  }
+
+  arma::imat nn(3, N);
+  int64_t currentCol = 0;
+  int64_t count = 0;
+  for (int64_t i = 0; i < N; i++)
+  {
+    const bool first = arma::any(firstRow == i);
+    const bool last = arma::any(lastRow == i);
+    if (i == 0)
+    {
+      nn(0, i) = i + gridSize;
+      nn(1, i) = i + 2 * gridSize - 1;
+      nn(2, i) = i + N - gridSize;
+    }
+    else if (i == N - gridSize)
+    {
+      nn(0, i) = i - 1;
+      nn(1, i) = i - gridSize;
+      nn(2, i) = i - N + gridSize;
+    }
+    else if (i == N - gridSize - 1)
+    {
+      nn(0, i) = i - gridSize;
+      nn(1, i) = i + gridSize;
+      nn(2, i) = i + 1;
+    }
+    else if (i < gridSize)
+    {
+      nn(0, i) = i + gridSize - 1;
+      nn(1, i) = i + gridSize;
+      nn(2, i) = i + N - gridSize;
+    }
+    else if (i > (N - gridSize))
+    {
+      nn(0, i) = i - gridSize - 1;
+      nn(1, i) = i - gridSize;
+      nn(2, i) = i - N + gridSize;
+    }
+    else if (currentCol == 0)
+    {
+      nn(0, i) = i - gridSize;
+      nn(1, i) = first ? i + gridSize : i + gridSize - 1;
+      nn(2, i) = first ? i + 2 * gridSize - 1 : i + gridSize;
+    }
+    else if (currentCol == 1)
+    {
+      nn(0, i) = i - gridSize;
+      nn(1, i) = last ? i + gridSize : i - gridSize + 1;
+      nn(2, i) = last ? i - 2 * gridSize + 1 : i + gridSize;
+    }
+    else if (currentCol == 2)
+    {
+      nn(0, i) = i - gridSize;
+      nn(1, i) = i + gridSize;
+      nn(2, i) = last ? i + 1 : i + gridSize + 1;
+    }
+    else
+    {
+      nn(0, i) = first ? i - 1 : i - gridSize - 1;
+      nn(1, i) = i - gridSize;
+      nn(2, i) = i + gridSize;
+    }
+
+    if ((i + 1) % gridSize == 0)
+    {
+      count++;
+      currentCol = count % 4;
+    }
+  }
+  return nn;
+}
+
+static void CheckNeighbours(const uint64_t latticeType, const uint64_t gridSize)
+{
+  CTRWfractal<double> sim(gridSize, latticeType, 0, 0.5, false, 0, 0, 0, 0., 1., 0., false,
+                          arma::Col<double>(), 0., 0., false, false, 0, 1, 0);
+  sim.SetVerbose(false);
+  sim.FindNeighbours();
+
+  const arma::imat expected = (latticeType == 1) ? ReferenceHoneycomb(gridSize) : ReferenceSquare(gridSize);
+  const arma::imat &nn = sim.Neighbours();
+  Check(nn.n_rows == expected.n_rows && nn.n_cols == expected.n_cols && arma::all(arma::vectorise(nn == expected)),
+        std::string((latticeType == 1) ? "honeycomb" : "square") + " neighbours at gridSize=" + std::to_string(gridSize));
+}
+
+static void CheckGrids(const uint64_t gridSize, const uint64_t nSites)
+{
+  const GenericGrid generic(gridSize, nSites);
+  const PowerOfTwoGrid power(gridSize, nSites);
+  bool ok = true;
+  for (uint64_t i = 0; i < nSites; i++)
+  {
+    ok = ok && generic.Column(i) == power.Column(i) && generic.Row(i) == power.Row(i);
+    ok = ok && generic.Site(generic.Column(i), generic.Row(i)) == power.Site(power.Column(i), power.Row(i));
+    ok = ok && generic.WrapSite(i + nSites) == power.WrapSite(i + nSites);
+  }
+  for (uint64_t row = 0; row < 2 * gridSize; row++)
+  {
+    ok = ok && generic.WrapRow(row) == power.WrapRow(row);
+  }
+  Check(ok, "grid arithmetic at gridSize=" + std::to_string(gridSize) + ", nSites=" + std::to_string(nSites));
+}
+
+int main()
+{
+  for (const uint64_t gridSize : {4, 8, 16, 32, 64})
+  {
+    Check(IsPowerOfTwo(gridSize), "power of two " + std::to_string(gridSize));
+    CheckGrids(gridSize, gridSize * gridSize);
+    CheckGrids(gridSize, 4 * gridSize * gridSize);
+  }
+
+  // Power-of-two sizes take the shift and mask path, the others the
+  // generic one, and both must give the same tables as the old loops
+  for (const uint64_t gridSize : {4, 5, 6, 8, 12, 16, 32, 64})
+  {
+    CheckNeighbours(0, gridSize);
+    CheckNeighbours(1, gridSize);
+  }
+
+  return failures;
+}
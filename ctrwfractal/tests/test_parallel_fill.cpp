@@ -0,0 +1,141 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Checks both overloads of ParallelFill around the serial cutoff and the
+  chunk size, for any number of threads, including the in-place index
+  fill of part of a buffer done by Permute. Built and run by
+  test_ctrwfractal.py. With --benchmark, it also times a serial and a
+  parallel first touch of a large buffer, and a parallel read of each,
+  which is the comparison to make on a multi-socket machine.
+
+***************************************************************************/
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <armadillo>
+
+#include "utils/utils.hpp"
+
+static int failures = 0;
+
+static void Check(const bool ok, const std::string &what)
+{
+  if (!ok)
+  {
+    std::cout << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+static void CheckIndexFill(const uint64_t n, const int nJobs)
+{
+  // As in Permute: the first n elements of a longer buffer get their
+  // index, and the rest are left alone
+  const int64_t untouched = -7;
+  arma::Col<int64_t> buffer(n + 1000);
+  buffer.fill(untouched);
+  ParallelFill(buffer.memptr(), n, [](uint64_t i) { return static_cast<int64_t>(i); }, nJobs);
+
+  bool ok = true;
+  for (uint64_t i = 0; i < buffer.n_elem; i++)
+  {
+    ok = ok && (buffer(i) == ((i < n) ? static_cast<int64_t>(i) : untouched));
+  }
+  Check(ok, "index fill of " + std::to_string(n) + " elements with nJobs=" + std::to_string(nJobs));
+}
+
+static void CheckObjectFill(const int nJobs)
+{
+  arma::Mat<double> mat(1000, 3000); // 24 MB, above the serial cutoff
+  ParallelFill(mat, 2.5, nJobs);
+  Check(arma::all(arma::vectorise(mat) == 2.5), "Mat fill with nJobs=" + std::to_string(nJobs));
+
+  arma::Cube<double> cube(2, 1000, 1500);
+  ParallelFill(cube, -1., nJobs);
+  Check(arma::all(arma::vectorise(cube) == -1.), "Cube fill with nJobs=" + std::to_string(nJobs));
+
+  arma::Col<uint8_t> mask(100); // Below the cutoff
+  ParallelFill(mask, static_cast<uint8_t>(3), nJobs);
+  Check(arma::all(mask == 3), "small Col fill with nJobs=" + std::to_string(nJobs));
+
+  arma::Col<int64_t> empty;
+  ParallelFill(empty, static_cast<int64_t>(1), nJobs);
+  Check(empty.n_elem == 0, "empty fill with nJobs=" + std::to_string(nJobs));
+}
+
+static void Benchmark(const uint64_t nBytes)
+{
+  const uint64_t n = nBytes / sizeof(double);
+  const uint64_t nThreads = NumThreads(-1);
+
+  for (const int nJobs : {0, -1})
+  {
+    double *ptr = static_cast<double *>(std::malloc(nBytes)); // Fresh pages, not yet placed
+    auto t0 = GetTime();
+    ParallelFill(ptr, n, [](uint64_t) { return 1.; }, nJobs);
+    auto t1 = GetTime();
+
+    std::vector<double> sums(nThreads, 0.);
+    auto &&read = [&](uint64_t t) {
+      double sum = 0.;
+      for (uint64_t i = n * t / nThreads; i < n * (t + 1) / nThreads; i++)
+      {
+        sum += ptr[i];
+      }
+      sums[t] = sum;
+    };
+    auto t2 = GetTime();
+    for (size_t r = 0; r < 10; r++)
+    {
+      parallel(read, static_cast<uint64_t>(0), nThreads, -1);
+    }
+    auto t3 = GetTime();
+
+    std::cout << ((nJobs == 0) ? "serial" : "parallel") << " first touch: fill "
+              << ElapsedSeconds(t0, t1) << " s, 10 parallel reads " << ElapsedSeconds(t2, t3)
+              << " s" << std::endl;
+    std::free(ptr);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const uint64_t chunk = hugePageBytes / sizeof(int64_t);
+  const uint64_t cutoff = parallelFillBytes / sizeof(int64_t);
+
+  for (const int nJobs : {0, 1, 3, -1})
+  {
+    for (const uint64_t n : {static_cast<uint64_t>(0), static_cast<uint64_t>(1), chunk - 1,
+                             cutoff - 1, cutoff, cutoff + 1, 5 * chunk + 123})
+    {
+      CheckIndexFill(n, nJobs);
+    }
+    CheckObjectFill(nJobs);
+  }
+
+  if (argc > 1 && std::string(argv[1]) == "--benchmark")
+  {
+    Benchmark(static_cast<uint64_t>(1) << 30);
+  }
+
+  return failures;
+}
@@ -0,0 +1,266 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Segmentation of noisy walks into dwells and jumps.
+
+***************************************************************************/
+
+#ifndef DWELL_HPP
+#define DWELL_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+class DwellDetector
+{
+  // A dwell is a stretch of a walk at one site, so the walk is split
+  // into segments of constant mean position under Gaussian noise of
+  // width sigma per coordinate. The cost of a segment is its sum of
+  // squared deviations over sigma^2, from prefix sums, and each segment
+  // pays the penalty. The optimal partition is found with the pruning
+  // of PELT [Killick et al., J. Am. Stat. Assoc. 107, 1590 (2012)],
+  // which keeps the cost close to linear in the walk length. Without
+  // noise, the dwells are simply the runs of equal positions.
+public:
+  DwellDetector(const uint64_t nSteps, const double sigma, const double penalty)
+      : nSteps(nSteps), sigma(sigma), penalty(penalty){};
+
+  // Noise from the median squared increment, |dr|^2 = 2 sigma^2 chi^2_2
+  // within a dwell, or zero if any position repeats exactly
+  template <typename E>
+  static double EstimateNoise(const E *walk, const uint64_t nSteps)
+  {
+    if (nSteps < 2)
+    {
+      return 0.;
+    }
+
+    std::vector<double> d2(nSteps - 1);
+    for (size_t i = 1; i < nSteps; i++)
+    {
+      const double dx = walk[2 * i] - walk[2 * i - 2];
+      const double dy = walk[2 * i + 1] - walk[2 * i - 1];
+      d2[i - 1] = dx * dx + dy * dy;
+      if (d2[i - 1] == 0.)
+      {
+        return 0.;
+      }
+    }
+
+    std::nth_element(d2.begin(), d2.begin() + d2.size() / 2, d2.end());
+    return std::sqrt(d2[d2.size() / 2] / (4. * std::log(2.)));
+  };
+
+  // A walk stored as 2 x nSteps, column-major. Labels each step with the
+  // index of its segment, and returns the number of segments.
+  template <typename E>
+  uint64_t Segment(const E *walk, int64_t *labels)
+  {
+    starts.clear();
+    if (nSteps == 0)
+    {
+      return 0;
+    }
+
+    if (sigma <= 0.)
+    {
+      starts.push_back(0);
+      for (size_t i = 1; i < nSteps; i++)
+      {
+        if (walk[2 * i] != walk[2 * i - 2] || walk[2 * i + 1] != walk[2 * i - 1])
+        {
+          starts.push_back(i);
+        }
+      }
+    }
+    else
+    {
+      Partition(walk);
+    }
+    starts.push_back(nSteps);
+
+    for (size_t k = 0; k + 1 < starts.size(); k++)
+    {
+      std::fill(labels + starts[k], labels + starts[k + 1], static_cast<int64_t>(k));
+    }
+
+    return starts.size() - 1;
+  };
+
+  // Lengths of the complete dwells of the last segmentation. The first
+  // and last segments are cut off by the ends of the walk, so are left out.
+  void Dwells(std::vector<uint64_t> &out) const
+  {
+    for (size_t k = 1; k + 2 < starts.size(); k++)
+    {
+      out.push_back(starts[k + 1] - starts[k]);
+    }
+  };
+
+  // Maximum-likelihood exponent of a Pareto tail P(t > x) ~ x^-beta of
+  // dwell times t >= tMin, where a dwell of t whole steps holds the
+  // waiting times in [t - 1/2, t + 1/2). The score decreases with beta,
+  // so it is solved by bisection, and the standard error comes from the
+  // observed information. Returns the number of dwells used.
+  static uint64_t ParetoExponent(std::vector<uint64_t> dwells, const uint64_t tMin,
+                                 double &exponent, double &stdError)
+  {
+    const uint64_t first = std::max(tMin, static_cast<uint64_t>(1));
+    exponent = std::numeric_limits<double>::quiet_NaN();
+    stdError = std::numeric_limits<double>::quiet_NaN();
+    dwells.erase(std::remove_if(dwells.begin(), dwells.end(), [&](uint64_t t) { return t < first; }),
+                 dwells.end());
+    const uint64_t count = dwells.size();
+    if (count == 0)
+    {
+      return 0;
+    }
+
+    // Equal dwell times share their terms
+    std::sort(dwells.begin(), dwells.end());
+    std::vector<double> la, lc, weight;
+    for (size_t i = 0; i < count; i++)
+    {
+      if (i == 0 || dwells[i] != dwells[i - 1])
+      {
+        la.push_back(std::log(dwells[i] - 0.5));
+        lc.push_back(std::log(dwells[i] + 0.5));
+        weight.push_back(0.);
+      }
+      weight.back() += 1.;
+    }
+    const double lower = std::log(first - 0.5);
+
+    // Derivatives of the log-likelihood
+    //   sum_t log((t - 1/2)^-beta - (t + 1/2)^-beta) + count beta log(tMin - 1/2),
+    // in terms of r = ((t + 1/2) / (t - 1/2))^-beta, which cannot underflow
+    auto &&score = [&](const double beta, double &information) {
+      double s = count * lower;
+      information = 0.;
+      for (size_t k = 0; k < la.size(); k++)
+      {
+        const double r = std::exp(-beta * (lc[k] - la[k]));
+        const double q = -std::expm1(-beta * (lc[k] - la[k]));
+        const double d1 = (lc[k] * r - la[k]) / q;
+        const double d2 = (la[k] * la[k] - lc[k] * lc[k] * r) / q;
+        s += weight[k] * d1;
+        information += weight[k] * (d1 * d1 - d2);
+      }
+      return s;
+    };
+
+    double information, lo = 1E-3, hi = 1E2;
+    if (score(lo, information) <= 0. || score(hi, information) >= 0.)
+    {
+      return count;
+    }
+    for (size_t i = 0; i < 100; i++)
+    {
+      const double mid = std::sqrt(lo * hi);
+      if (score(mid, information) > 0.)
+      {
+        lo = mid;
+      }
+      else
+      {
+        hi = mid;
+      }
+    }
+
+    exponent = std::sqrt(lo * hi);
+    score(exponent, information);
+    stdError = (information > 0.) ? 1. / std::sqrt(information) : std::numeric_limits<double>::quiet_NaN();
+    return count;
+  };
+
+private:
+  template <typename E>
+  void Partition(const E *walk)
+  {
+    // Prefix sums about the first position, to limit cancellation
+    const double x0 = walk[0], y0 = walk[1];
+    sx.assign(nSteps + 1, 0.);
+    sy.assign(nSteps + 1, 0.);
+    s2.assign(nSteps + 1, 0.);
+    for (size_t i = 0; i < nSteps; i++)
+    {
+      const double x = walk[2 * i] - x0;
+      const double y = walk[2 * i + 1] - y0;
+      sx[i + 1] = sx[i] + x;
+      sy[i + 1] = sy[i] + y;
+      s2[i + 1] = s2[i] + x * x + y * y;
+    }
+
+    const double scale = 1. / (sigma * sigma);
+    auto &&cost = [&](const uint64_t s, const uint64_t t) {
+      const double mx = sx[t] - sx[s];
+      const double my = sy[t] - sy[s];
+      return scale * (s2[t] - s2[s] - (mx * mx + my * my) / (t - s));
+    };
+
+    best.assign(nSteps + 1, 0.);
+    last.assign(nSteps + 1, 0);
+    best[0] = -penalty;
+    candidates.assign(1, 0);
+    for (size_t t = 1; t <= nSteps; t++)
+    {
+      values.resize(candidates.size());
+      double f = std::numeric_limits<double>::infinity();
+      for (size_t c = 0; c < candidates.size(); c++)
+      {
+        values[c] = best[candidates[c]] + cost(candidates[c], t);
+        if (values[c] + penalty < f)
+        {
+          f = values[c] + penalty;
+          last[t] = candidates[c];
+        }
+      }
+      best[t] = f;
+
+      // A start that is already worse than the best partition up to t can
+      // never be optimal later on
+      size_t kept = 0;
+      for (size_t c = 0; c < candidates.size(); c++)
+      {
+        if (values[c] <= f)
+        {
+          candidates[kept++] = candidates[c];
+        }
+      }
+      candidates.resize(kept);
+      candidates.push_back(t);
+    }
+
+    for (uint64_t t = nSteps; t > 0; t = last[t])
+    {
+      starts.push_back(last[t]);
+    }
+    std::reverse(starts.begin(), starts.end());
+  };
+
+  uint64_t nSteps;
+  double sigma, penalty;
+  std::vector<uint64_t> starts, last, candidates;
+  std::vector<double> sx, sy, s2, best, values;
+};
+
+#endif
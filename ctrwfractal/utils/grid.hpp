@@ -0,0 +1,90 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Index arithmetic for lattices stored column by column, with a
+  specialisation for power-of-two grids.
+
+***************************************************************************/
+
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include <cstdint>
+
+// The sites of a lattice are numbered down each column of gridSize
+// sites in turn, so site i is in column i / gridSize, at row
+// i % gridSize. The kernels that map between sites and their columns
+// and rows are templates on the index arithmetic, and are run with
+// PowerOfTwoGrid, which uses shifts and masks, whenever gridSize is a
+// power of two, and with GenericGrid otherwise.
+
+inline bool IsPowerOfTwo(const uint64_t n)
+{
+  return (n > 0) && ((n & (n - 1)) == 0);
+}
+
+class GenericGrid
+{
+public:
+  GenericGrid(const uint64_t gridSize, const uint64_t nSites)
+      : gridSize(gridSize), nSites(nSites){};
+
+  inline uint64_t Column(const uint64_t i) const { return i / gridSize; };
+  inline uint64_t Row(const uint64_t i) const { return i % gridSize; };
+  inline uint64_t Site(const uint64_t column, const uint64_t row) const { return column * gridSize + row; };
+
+  // Periodic wrap of a row in [0, 2 gridSize) and of a site in [0, 2 nSites)
+  inline uint64_t WrapRow(const uint64_t row) const { return row % gridSize; };
+  inline uint64_t WrapSite(const uint64_t i) const { return i % nSites; };
+
+private:
+  uint64_t gridSize, nSites;
+};
+
+class PowerOfTwoGrid
+{
+  // Both gridSize and nSites must be powers of two, which holds for the
+  // square (gridSize^2 sites) and honeycomb (4 gridSize^2) lattices
+public:
+  PowerOfTwoGrid(const uint64_t gridSize, const uint64_t nSites)
+      : shift(Log2(gridSize)), rowMask(gridSize - 1), siteMask(nSites - 1){};
+
+  inline uint64_t Column(const uint64_t i) const { return i >> shift; };
+  inline uint64_t Row(const uint64_t i) const { return i & rowMask; };
+  inline uint64_t Site(const uint64_t column, const uint64_t row) const { return (column << shift) | row; };
+
+  inline uint64_t WrapRow(const uint64_t row) const { return row & rowMask; };
+  inline uint64_t WrapSite(const uint64_t i) const { return i & siteMask; };
+
+private:
+  static uint64_t Log2(uint64_t n)
+  {
+    uint64_t k = 0;
+    while (n > 1)
+    {
+      n >>= 1;
+      k++;
+    }
+    return k;
+  };
+
+  uint64_t shift, rowMask, siteMask;
+};
+
+#endif
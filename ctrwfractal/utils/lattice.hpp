@@ -0,0 +1,113 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Noise-free walks in integer lattice coordinates, for exact displacement
+  sums.
+
+***************************************************************************/
+
+#ifndef LATTICE_HPP
+#define LATTICE_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+class LatticeWalk
+{
+  // Before noise is added, every position is a site plus a whole number
+  // of unit cells, i.e. (x, y) = (a * scaleX, b * scaleY) for integers
+  // a and b: scale (1, 1) on the square lattice, and (1/2, sqrt(3)/2)
+  // on the honeycomb lattice. Sums of squared displacements are then
+  // accumulated exactly in int64, separately for a and b, and only
+  // converted to physical units at the end, with weights equal to the
+  // squared scales (given exactly, e.g. 3/4 for sqrt(3)/2). The
+  // differences are int32, so the products vectorize as 32 x 32 -> 64
+  // bit multiplies.
+public:
+  LatticeWalk(const double scaleX, const double scaleY, const double weightX, const double weightY)
+      : scaleX(scaleX), scaleY(scaleY), weightX(weightX), weightY(weightY){};
+
+  // A walk stored as 2 x nSteps, column-major
+  template <typename E>
+  void Assign(const E *walk, const uint64_t nSteps)
+  {
+    a.resize(nSteps);
+    b.resize(nSteps);
+    for (size_t i = 0; i < nSteps; i++)
+    {
+      a[i] = static_cast<int32_t>(std::lround(walk[2 * i] / scaleX));
+      b[i] = static_cast<int32_t>(std::lround(walk[2 * i + 1] / scaleY));
+    }
+  };
+
+  // Adds |r(j) - r(k)|^2, in lattice units, to (sumA, sumB)
+  inline void Accumulate(const uint64_t j, const uint64_t k, int64_t &sumA, int64_t &sumB) const
+  {
+    const int64_t da = a[j] - a[k];
+    const int64_t db = b[j] - b[k];
+    sumA += da * da;
+    sumB += db * db;
+  };
+
+  // Sum over t of |r(t + delta) - r(t)|^2, the numerator of the TAMSD
+  double LagSum(const uint64_t delta) const
+  {
+    int64_t sumA = 0, sumB = 0;
+    AccumulateLag(delta, 0, sumA, sumB);
+    return Physical(sumA, sumB);
+  };
+
+  // Adds the terms t >= first of LagSum(delta), in lattice units, to
+  // (sumA, sumB), so that the sums of a walk can be carried on as it grows
+  void AccumulateLag(const uint64_t delta, const uint64_t first, int64_t &sumA, int64_t &sumB) const
+  {
+    const uint64_t n = (a.size() > delta) ? a.size() - delta : 0;
+    const int32_t *pa = a.data();
+    const int32_t *pb = b.data();
+    int64_t partA = 0, partB = 0;
+    for (size_t i = first; i < n; i++)
+    {
+      const int32_t da = pa[i + delta] - pa[i];
+      const int32_t db = pb[i + delta] - pb[i];
+      partA += static_cast<int64_t>(da) * da;
+      partB += static_cast<int64_t>(db) * db;
+    }
+    sumA += partA;
+    sumB += partB;
+  };
+
+  inline double SquaredDist(const uint64_t j, const uint64_t k) const
+  {
+    int64_t sumA = 0, sumB = 0;
+    Accumulate(j, k, sumA, sumB);
+    return Physical(sumA, sumB);
+  };
+
+  inline double Physical(const int64_t sumA, const int64_t sumB) const
+  {
+    return weightX * sumA + weightY * sumB;
+  };
+
+private:
+  double scaleX, scaleY, weightX, weightY;
+  std::vector<int32_t> a, b;
+};
+
+#endif
@@ -0,0 +1,68 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Minimal writer for uncompressed, C-ordered NumPy .npy files (format
+  version 1.0). See https://numpy.org/neps/nep-0001-npy-format.html
+
+***************************************************************************/
+
+#ifndef NPY_HPP
+#define NPY_HPP
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+template <typename E>
+void WriteNpy(const std::string &file, const E *data, const std::vector<uint64_t> &shape)
+{
+  std::ostringstream header;
+  header << "{'descr': '<" << (std::is_integral<E>::value ? 'i' : 'f') << sizeof(E)
+         << "', 'fortran_order': False, 'shape': (";
+  uint64_t n = 1;
+  for (size_t i = 0; i < shape.size(); i++)
+  {
+    header << shape[i] << ((shape.size() == 1 || i + 1 < shape.size()) ? ", " : "");
+    n *= shape[i];
+  }
+  header << "), }";
+
+  // Pad with spaces so that the data starts on a 64-byte boundary
+  std::string dict = header.str();
+  dict.append(63 - (10 + dict.size()) % 64, ' ');
+  dict.push_back('\n');
+
+  std::ofstream out(file, std::ios::binary | std::ios::trunc);
+  const char magic[8] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0};
+  const uint16_t headerLength = static_cast<uint16_t>(dict.size());
+  out.write(magic, 8);
+  out.put(static_cast<char>(headerLength & 0xFF));
+  out.put(static_cast<char>(headerLength >> 8));
+  out.write(dict.data(), dict.size());
+  out.write(reinterpret_cast<const char *>(data), n * sizeof(E));
+  if (!out)
+  {
+    throw std::runtime_error("Unable to write " + file);
+  }
+};
+
+#endif
@@ -0,0 +1,131 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Summary statistics of a set of walks, accumulated one walk at a time.
+
+***************************************************************************/
+
+#ifndef SUMMARY_HPP
+#define SUMMARY_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <armadillo>
+
+class WalkSummary
+{
+  // The statistics are, in order:
+  //   0. slope of log EATAMSD against log lag
+  //   1. ergodicity breaking parameter at the shortest lag
+  //   2. log width of the van Hove distribution at the shortest lag
+  //   3. log width of the van Hove distribution at the longest lag
+  //   4. non-Gaussian parameter at the shortest lag
+  // over log-spaced lags from 1 to a quarter of the walk length. Only
+  // sums over walks are kept, so the memory does not grow with them.
+public:
+  static const uint64_t nStats = 5;
+
+  WalkSummary(const uint64_t nSteps, const uint64_t maxLags = 8) : nSteps(nSteps)
+  {
+    uint64_t longest = std::max(static_cast<uint64_t>(1), nSteps / 4);
+    arma::vec spaced = arma::logspace(0, std::log10(static_cast<double>(longest)), maxLags);
+    lags = arma::unique(arma::conv_to<arma::uvec>::from(arma::round(spaced)));
+    lags = lags.elem(arma::find(lags < nSteps));
+    if (lags.n_elem == 0)
+    {
+      lags = {1};
+    }
+    Reset();
+  };
+
+  void Reset()
+  {
+    nWalks = 0;
+    tamsd.zeros(lags.n_elem);
+    tamsdSq.zeros(lags.n_elem);
+    m2.zeros(lags.n_elem);
+    m4.zeros(lags.n_elem);
+    pairs.zeros(lags.n_elem);
+  };
+
+  // A walk stored as 2 x nSteps, column-major
+  template <typename E>
+  void Add(const E *walk)
+  {
+    for (size_t k = 0; k < lags.n_elem; k++)
+    {
+      const uint64_t delta = lags(k);
+      const uint64_t n = (nSteps > delta) ? nSteps - delta : 0;
+      double s2 = 0., s4 = 0.;
+      for (size_t i = 0; i < n; i++)
+      {
+        const double dx = walk[2 * (i + delta)] - walk[2 * i];
+        const double dy = walk[2 * (i + delta) + 1] - walk[2 * i + 1];
+        const double d2 = dx * dx + dy * dy;
+        s2 += d2;
+        s4 += d2 * d2;
+      }
+      const double t = (n > 0) ? s2 / n : 0.;
+      tamsd(k) += t;
+      tamsdSq(k) += t * t;
+      m2(k) += s2;
+      m4(k) += s4;
+      pairs(k) += n;
+    }
+    nWalks++;
+  };
+
+  arma::vec Statistics() const
+  {
+    const double tiny = 1E-300;
+    const uint64_t last = lags.n_elem - 1;
+    arma::vec stats(nStats, arma::fill::zeros);
+    if (nWalks == 0)
+    {
+      return stats;
+    }
+
+    arma::vec eatamsd = tamsd / nWalks;
+    if (lags.n_elem > 1)
+    {
+      arma::vec x = arma::log(arma::conv_to<arma::vec>::from(lags));
+      arma::vec y = arma::log(arma::clamp(eatamsd, tiny, arma::datum::inf));
+      x -= arma::mean(x);
+      stats(0) = arma::dot(x, y - arma::mean(y)) / arma::dot(x, x);
+    }
+
+    const double mean = eatamsd(0);
+    stats(1) = (mean > 0.) ? (tamsdSq(0) / nWalks - mean * mean) / (mean * mean) : 0.;
+
+    const double short2 = m2(0) / std::max(pairs(0), 1.);
+    const double long2 = m2(last) / std::max(pairs(last), 1.);
+    stats(2) = 0.5 * std::log(std::max(short2 / 2., tiny)); // Per coordinate
+    stats(3) = 0.5 * std::log(std::max(long2 / 2., tiny));
+    stats(4) = (short2 > 0.) ? m4(0) / std::max(pairs(0), 1.) / (2. * short2 * short2) - 1. : 0.;
+
+    return stats;
+  };
+
+private:
+  uint64_t nSteps, nWalks;
+  arma::uvec lags;
+  arma::vec tamsd, tamsdSq, m2, m4, pairs;
+};
+
+#endif
@@ -0,0 +1,446 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Parallel reader for tables of experimental tracks, with one row
+  (track id, frame, x, y) per observation.
+
+***************************************************************************/
+
+#ifndef TRACKS_HPP
+#define TRACKS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#include "utils.hpp"
+
+class MappedFile
+{
+  // Read-only view of a whole file, memory-mapped on Linux so that pages
+  // are only read as the parsing threads reach them, and read into memory
+  // elsewhere.
+public:
+  MappedFile(const std::string &path)
+  {
+#if defined(__linux__)
+    fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+      Close();
+      throw std::runtime_error("Unable to read " + path);
+    }
+    size = st.st_size;
+    if (size > 0)
+    {
+      void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr == MAP_FAILED)
+      {
+        Close();
+        throw std::runtime_error("Unable to map " + path);
+      }
+      madvise(ptr, size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(ptr);
+    }
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+      throw std::runtime_error("Unable to read " + path);
+    }
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    size = buffer.size();
+    data = buffer.data();
+#endif
+  };
+
+  ~MappedFile() { Close(); };
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data = nullptr;
+  uint64_t size = 0;
+
+private:
+  void Close()
+  {
+#if defined(__linux__)
+    if (data != nullptr)
+    {
+      munmap(const_cast<char *>(data), size);
+      data = nullptr;
+    }
+    if (fd >= 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+#endif
+  };
+
+#if defined(__linux__)
+  int fd = -1;
+#else
+  std::vector<char> buffer;
+#endif
+};
+
+class TrackTable
+{
+  // The rows come either as text, one per line with fields separated by
+  // the delimiter (a space stands for any run of blanks), or as binary
+  // little-endian records of (int64 track, int64 frame, double x,
+  // double y). Blank lines, lines starting with '#', a header before
+  // the first row and any columns after the fourth are skipped. The file
+  // is split at line boundaries into a few chunks per thread, which are
+  // parsed independently.
+  //
+  // The rows are then grouped by track id, in increasing order, into a
+  // ragged array over frames: track k holds frames firstFrame[k] to
+  // firstFrame[k] + Length(k) - 1, as (x, y) column-major from Track(k),
+  // with NaN for the frames that were not observed.
+public:
+  TrackTable(const std::string &path, const bool binary, const char delimiter, const int nJobs)
+  {
+    MappedFile file(path);
+    const uint64_t nChunks = (nJobs == 0) ? 1 : 4 * static_cast<uint64_t>(NumThreads(nJobs));
+    std::vector<std::vector<Row>> chunks(nChunks);
+
+    if (binary)
+    {
+      const uint64_t record = 2 * sizeof(int64_t) + 2 * sizeof(double);
+      if (file.size % record != 0)
+      {
+        throw std::runtime_error("The size of " + path + " is not a whole number of 32-byte records");
+      }
+      const uint64_t nRecords = file.size / record;
+      auto &&func = [&](uint64_t c) {
+        const uint64_t first = nRecords * c / nChunks;
+        const uint64_t last = nRecords * (c + 1) / nChunks;
+        chunks[c].resize(last - first);
+        for (uint64_t i = first; i < last; i++)
+        {
+          Row &row = chunks[c][i - first];
+          const char *p = file.data + i * record;
+          std::memcpy(&row.track, p, sizeof(int64_t));
+          std::memcpy(&row.frame, p + 8, sizeof(int64_t));
+          std::memcpy(&row.x, p + 16, sizeof(double));
+          std::memcpy(&row.y, p + 24, sizeof(double));
+        }
+      };
+      parallel(func, static_cast<uint64_t>(0), nChunks, nJobs);
+    }
+    else
+    {
+      // Each chunk starts after the first newline at or past its nominal
+      // start, so that every line belongs to exactly one chunk
+      std::vector<uint64_t> starts(nChunks + 1, file.size);
+      starts[0] = 0;
+      for (uint64_t c = 1; c < nChunks; c++)
+      {
+        const char *end = file.data + file.size;
+        const char *p = std::find(file.data + std::max(file.size * c / nChunks, starts[c - 1]), end, '\n');
+        starts[c] = (p == end) ? file.size : (p - file.data) + 1;
+      }
+
+      std::vector<std::string> errors(nChunks);
+      auto &&func = [&](uint64_t c) {
+        const char *p = file.data + starts[c];
+        const char *end = file.data + starts[c + 1];
+        bool header = (c == 0); // Only the first line of the file can be a header
+        while (p < end && errors[c].empty())
+        {
+          const char *eol = std::find(p, end, '\n');
+          Row row;
+          const int status = ParseLine(p, eol, delimiter, row);
+          if (status == 1)
+          {
+            chunks[c].push_back(row);
+          }
+          else if (status < 0 && !header)
+          {
+            errors[c] = "Unable to parse the line '" + std::string(p, eol) + "' of " + path;
+          }
+          header = header && (status == 0);
+          p = eol + 1;
+        }
+      };
+      parallel(func, static_cast<uint64_t>(0), nChunks, nJobs);
+
+      for (auto &error : errors)
+      {
+        if (!error.empty())
+        {
+          throw std::runtime_error(error);
+        }
+      }
+    }
+
+    Group(chunks, nJobs);
+  };
+
+  uint64_t Count() const { return ids.size(); };
+  uint64_t Length(const uint64_t k) const { return offsets[k + 1] - offsets[k]; };
+  const double *Track(const uint64_t k) const { return coords.data() + 2 * offsets[k]; };
+
+  std::vector<int64_t> ids, firstFrame;
+  std::vector<uint64_t> offsets, observed;
+  std::vector<double> coords;
+
+private:
+  struct Row
+  {
+    int64_t track, frame;
+    double x, y;
+  };
+
+  // Returns 1 for a row, 0 for a line to skip and -1 for anything else
+  static int ParseLine(const char *p, const char *eol, const char delimiter, Row &row)
+  {
+    if (eol > p && eol[-1] == '\r')
+    {
+      eol--;
+    }
+    while (p < eol && (*p == ' ' || *p == '\t'))
+    {
+      p++;
+    }
+    if (p == eol || *p == '#')
+    {
+      return 0;
+    }
+
+    double values[4];
+    for (size_t f = 0; f < 4; f++)
+    {
+      const char *q = p;
+      if (delimiter == ' ')
+      {
+        while (q < eol && *q != ' ' && *q != '\t')
+        {
+          q++;
+        }
+      }
+      else
+      {
+        q = std::find(p, eol, delimiter);
+      }
+
+      // strtod needs a terminated string, which the mapped file is not
+      char field[64];
+      const uint64_t n = q - p;
+      if (n == 0 || n >= sizeof(field))
+      {
+        return -1;
+      }
+      std::memcpy(field, p, n);
+      field[n] = '\0';
+      char *parsed;
+      values[f] = std::strtod(field, &parsed);
+      while (*parsed == ' ' || *parsed == '\t')
+      {
+        parsed++;
+      }
+      if (parsed == field || *parsed != '\0')
+      {
+        return -1;
+      }
+
+      p = q;
+      if (f < 3)
+      {
+        if (p == eol)
+        {
+          return -1;
+        }
+        p++;
+        while (p < eol && (*p == ' ' || *p == '\t'))
+        {
+          p++;
+        }
+      }
+    }
+
+    const double limit = 9007199254740992.; // 2^53, beyond which not every integer is a double
+    for (size_t f = 0; f < 2; f++)
+    {
+      if (values[f] != std::floor(values[f]) || std::fabs(values[f]) > limit)
+      {
+        return -1;
+      }
+    }
+
+    row.track = static_cast<int64_t>(values[0]);
+    row.frame = static_cast<int64_t>(values[1]);
+    row.x = values[2];
+    row.y = values[3];
+    return 1;
+  };
+
+  void Group(const std::vector<std::vector<Row>> &chunks, const int nJobs)
+  {
+    // Every pass over the rows runs per chunk. Each chunk sorts its own
+    // track ids and keeps the first and last frame and the number of
+    // rows of each, so only these short lists are merged across chunks.
+    const uint64_t nChunks = chunks.size();
+    const int64_t lowest = std::numeric_limits<int64_t>::lowest();
+    const int64_t highest = std::numeric_limits<int64_t>::max();
+
+    std::vector<std::vector<int64_t>> local(nChunks), localFirst(nChunks), localLast(nChunks);
+    std::vector<std::vector<uint64_t>> localCount(nChunks), index(nChunks);
+    auto &&summarise = [&](uint64_t c) {
+      const std::vector<Row> &chunk = chunks[c];
+      local[c].resize(chunk.size());
+      for (size_t i = 0; i < chunk.size(); i++)
+      {
+        local[c][i] = chunk[i].track;
+      }
+      std::sort(local[c].begin(), local[c].end());
+      local[c].erase(std::unique(local[c].begin(), local[c].end()), local[c].end());
+
+      localFirst[c].assign(local[c].size(), highest);
+      localLast[c].assign(local[c].size(), lowest);
+      localCount[c].assign(local[c].size(), 0);
+      index[c].resize(chunk.size());
+      for (size_t i = 0; i < chunk.size(); i++)
+      {
+        const uint64_t j = std::lower_bound(local[c].begin(), local[c].end(), chunk[i].track) - local[c].begin();
+        localFirst[c][j] = std::min(localFirst[c][j], chunk[i].frame);
+        localLast[c][j] = std::max(localLast[c][j], chunk[i].frame);
+        localCount[c][j]++;
+        index[c][i] = j; // Into the ids of the chunk until they are matched to all ids
+      }
+    };
+    parallel(summarise, static_cast<uint64_t>(0), nChunks, nJobs);
+
+    // Pairwise merges of the sorted ids, a round of them at a time
+    std::vector<std::vector<int64_t>> runs(local);
+    for (uint64_t width = 1; width < nChunks; width *= 2)
+    {
+      auto &&merge = [&](uint64_t m) {
+        const uint64_t a = 2 * width * m;
+        const uint64_t b = a + width;
+        if (b < nChunks)
+        {
+          std::vector<int64_t> both;
+          both.reserve(runs[a].size() + runs[b].size());
+          std::set_union(runs[a].begin(), runs[a].end(), runs[b].begin(), runs[b].end(), std::back_inserter(both));
+          runs[a].swap(both);
+          std::vector<int64_t>().swap(runs[b]);
+        }
+      };
+      parallel(merge, static_cast<uint64_t>(0), (nChunks + 2 * width - 1) / (2 * width), nJobs);
+    }
+    ids.swap(runs[0]);
+    const uint64_t nTracks = ids.size();
+
+    std::vector<std::vector<uint64_t>> global(nChunks);
+    auto &&match = [&](uint64_t c) {
+      global[c].resize(local[c].size());
+      auto it = ids.begin();
+      for (size_t j = 0; j < local[c].size(); j++)
+      {
+        it = std::lower_bound(it, ids.end(), local[c][j]);
+        global[c][j] = it - ids.begin();
+      }
+      for (auto &j : index[c])
+      {
+        j = global[c][j];
+      }
+    };
+    parallel(match, static_cast<uint64_t>(0), nChunks, nJobs);
+
+    // Each block of tracks gathers its frames and counts from every chunk
+    const uint64_t nBlocks = std::min(nTracks, nChunks);
+    std::vector<int64_t> lastFrame(nTracks, lowest);
+    firstFrame.assign(nTracks, highest);
+    observed.assign(nTracks, 0);
+    auto &&reduce = [&](uint64_t b) {
+      const uint64_t k0 = nTracks * b / nBlocks;
+      const uint64_t k1 = nTracks * (b + 1) / nBlocks;
+      for (size_t c = 0; c < nChunks; c++)
+      {
+        for (size_t j = std::lower_bound(local[c].begin(), local[c].end(), ids[k0]) - local[c].begin();
+             j < local[c].size() && global[c][j] < k1; j++)
+        {
+          const uint64_t k = global[c][j];
+          firstFrame[k] = std::min(firstFrame[k], localFirst[c][j]);
+          lastFrame[k] = std::max(lastFrame[k], localLast[c][j]);
+          observed[k] += localCount[c][j];
+        }
+      }
+    };
+    parallel(reduce, static_cast<uint64_t>(0), nBlocks, nJobs);
+
+    offsets.assign(nTracks + 1, 0);
+    for (size_t k = 0; k < nTracks; k++)
+    {
+      offsets[k + 1] = offsets[k] + static_cast<uint64_t>(lastFrame[k] - firstFrame[k]) + 1;
+    }
+
+    // Rows of different chunks can only meet in a slot if a frame is
+    // repeated, which the atomic flags catch
+    coords.assign(2 * offsets[nTracks], std::numeric_limits<double>::quiet_NaN());
+    std::vector<std::atomic<bool>> seen(offsets[nTracks]);
+    std::vector<std::string> errors(nChunks);
+    auto &&scatter = [&](uint64_t c) {
+      for (size_t i = 0; i < chunks[c].size(); i++)
+      {
+        const Row &row = chunks[c][i];
+        const uint64_t k = index[c][i];
+        const uint64_t slot = offsets[k] + static_cast<uint64_t>(row.frame - firstFrame[k]);
+        if (seen[slot].exchange(true, std::memory_order_relaxed))
+        {
+          errors[c] = "Track " + std::to_string(row.track) + " has more than one row for frame " +
+                      std::to_string(row.frame);
+          return;
+        }
+        coords[2 * slot] = row.x;
+        coords[2 * slot + 1] = row.y;
+      }
+    };
+    parallel(scatter, static_cast<uint64_t>(0), nChunks, nJobs);
+
+    for (auto &error : errors)
+    {
+      if (!error.empty())
+      {
+        throw std::runtime_error(error);
+      }
+    }
+  };
+};
+
+#endif
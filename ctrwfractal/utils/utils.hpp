@@ -22,6 +22,8 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include <atomic>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <iomanip>
@@ -30,6 +32,11 @@
 #include <utility>
 #include <armadillo>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 template <typename Arg, typename... Args>
 void Print(std::ostream &out, Arg &&arg, Args &&... args)
 {
@@ -55,6 +62,95 @@ double ElapsedSeconds(std::chrono::high_resolution_clock::time_point t0,
     return static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() * 1E-6);
 }
 
+// Number of set bits in, and position of the k-th set bit of,
+// a 4-bit neighbour mask. Used to pick an accessible neighbour
+// without building a temporary list of candidates.
+const uint8_t maskCount[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+const uint8_t maskSlot[16][4] = {{0, 0, 0, 0}, {0, 0, 0, 0}, {1, 0, 0, 0}, {0, 1, 0, 0},
+                                 {2, 0, 0, 0}, {0, 2, 0, 0}, {1, 2, 0, 0}, {0, 1, 2, 0},
+                                 {3, 0, 0, 0}, {0, 3, 0, 0}, {1, 3, 0, 0}, {0, 1, 3, 0},
+                                 {2, 3, 0, 0}, {0, 2, 3, 0}, {1, 2, 3, 0}, {0, 1, 2, 3}};
+
+// Bit-packed boolean arrays, one bit per site (or bond)
+inline bool GetBit(const std::vector<uint64_t> &bits, const uint64_t e)
+{
+    return (bits[e >> 6] >> (e & 63)) & 1;
+}
+
+inline void FlipBit(std::vector<uint64_t> &bits, const uint64_t e)
+{
+    bits[e >> 6] ^= (static_cast<uint64_t>(1) << (e & 63));
+}
+
+// Counters and a cancellation flag shared with the caller while a
+// simulation runs. Loops add to the counters once per chunk of work
+// (a walk, a tile, a block of sites) and stop at the next chunk once
+// cancelled, so the overhead is a few relaxed atomics per chunk.
+struct Progress
+{
+    enum Stage
+    {
+        NEIGHBOURS,
+        PERMUTATION,
+        PERCOLATION,
+        WALKING,
+        NOISE,
+        ANALYSIS,
+        THRESHOLDS,
+        DONE
+    };
+
+    enum Counter
+    {
+        STAGE,
+        SITES,
+        WALKS,
+        STEPS,
+        LAGS,
+        ALLOCATIONS,
+        N_COUNTERS
+    };
+
+    static const uint64_t blockSize = 65536; // Sites (or bonds) between checks
+
+    Progress()
+    {
+        for (auto &c : counts)
+        {
+            c.store(0);
+        }
+        cancelled.store(false);
+    }
+
+    inline void Add(const Counter which, const uint64_t n)
+    {
+        counts[which].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    inline void Set(const Counter which, const uint64_t n)
+    {
+        counts[which].store(n, std::memory_order_relaxed);
+    }
+
+    uint64_t Get(const int which) const
+    {
+        return counts[which].load(std::memory_order_relaxed);
+    }
+
+    void Cancel()
+    {
+        cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    inline bool Cancelled() const
+    {
+        return cancelled.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts[N_COUNTERS];
+    std::atomic<bool> cancelled;
+};
+
 inline double SquaredDist(const double &x1, const double &x2,
                           const double &y1, const double &y2)
 {
@@ -77,6 +173,11 @@ inline double TAMSD(const arma::mat &walk, const uint64_t t, const uint64_t delt
     return integral / diff;
 };
 
+inline uint32_t NumThreads(const int nJobs)
+{
+    return (nJobs > 0) ? nJobs : std::thread::hardware_concurrency();
+}
+
 template <typename Function, typename Integer_Type>
 void parallel(Function const &func,
               Integer_Type dimFirst,
@@ -84,7 +185,7 @@ void parallel(Function const &func,
               int nJobs = -1,
               uint32_t threshold = 1)
 {
-    uint32_t const totalCores = (nJobs > 0) ? nJobs : std::thread::hardware_concurrency();
+    uint32_t const totalCores = NumThreads(nJobs);
 
     if ((nJobs == 0) || (totalCores <= 1) || ((dimLast - dimFirst) <= threshold)) // No parallelization or small jobs
     {
@@ -141,6 +242,114 @@ void parallel(Function const &func,
     }
 };
 
+// The TAMSD is split into tiles of (walk, block of lags). Enough tiles
+// for about four per thread, without splitting the lags when there are
+// already plenty of walks.
+inline uint64_t LagBlockCount(const uint64_t nLags, const uint64_t nWalks, const int nJobs)
+{
+    uint64_t nThreads = (nJobs == 0) ? 1 : NumThreads(nJobs);
+    uint64_t nBlocks = (4 * nThreads + nWalks - 1) / nWalks;
+    return std::max(static_cast<uint64_t>(1), std::min(nBlocks, nLags));
+}
+
+// Lag j of a walk of nSteps costs (nSteps - j), so cut the lags
+// 1, ..., nLags where the cumulative cost passes each multiple of
+// total / nBlocks
+inline arma::uvec LagBlockEdges(const uint64_t nSteps, const uint64_t nLags, const uint64_t nBlocks)
+{
+    arma::uvec edges(nBlocks + 1);
+    double total = static_cast<double>(nLags) * nSteps - 0.5 * static_cast<double>(nLags) * (nLags + 1);
+    double cost = 0.;
+    uint64_t b = 1;
+
+    edges(0) = 1;
+    for (size_t j = 1; j <= nLags && b < nBlocks; j++)
+    {
+        cost += nSteps - j;
+        if (cost >= b * total / nBlocks)
+        {
+            edges(b++) = j + 1;
+        }
+    }
+    for (; b <= nBlocks; b++)
+    {
+        edges(b) = nLags + 1;
+    }
+    return edges;
+}
+
+const uint64_t hugePageBytes = 2 << 20;
+const uint64_t parallelFillBytes = 8 << 20; // Smaller buffers are not worth starting threads for
+
+// Ask the kernel to back a large buffer with transparent huge pages,
+// which cuts TLB misses for random access over big lattices. Only the
+// whole pages inside the buffer are advised; a no-op off Linux.
+inline void AdviseHugePages(void *ptr, const uint64_t nBytes)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (nBytes < hugePageBytes)
+    {
+        return;
+    }
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t first = (reinterpret_cast<uintptr_t>(ptr) + page - 1) / page * page;
+    uintptr_t last = (reinterpret_cast<uintptr_t>(ptr) + nBytes) / page * page;
+    if (last > first)
+    {
+        madvise(reinterpret_cast<void *>(first), last - first, MADV_HUGEPAGE); // Advisory, so errors are ignored
+    }
+#else
+    (void)ptr;
+    (void)nBytes;
+#endif
+}
+
+// Fill a freshly allocated buffer with value(i), dealing it out to the
+// threads in huge-page sized chunks, round-robin. A page is placed on the
+// NUMA node of the thread that first touches it, so this spreads big
+// arrays over the sockets instead of putting them all on the node of the
+// main thread. The threads are not pinned, so the placement is best
+// effort: the scheduler decides which node each one runs on. Buffers
+// below parallelFillBytes are filled serially.
+template <typename E, typename Func>
+void ParallelFill(E *ptr, const uint64_t n, Func &&value, const int nJobs)
+{
+    AdviseHugePages(ptr, n * sizeof(E));
+
+    if (nJobs == 0 || n * sizeof(E) < parallelFillBytes)
+    {
+        for (uint64_t i = 0; i < n; i++)
+        {
+            ptr[i] = value(i);
+        }
+        return;
+    }
+
+    const uint64_t chunk = std::max(static_cast<uint64_t>(1), hugePageBytes / sizeof(E));
+    const uint64_t nChunks = (n + chunk - 1) / chunk;
+    const uint64_t nThreads = std::min(static_cast<uint64_t>(NumThreads(nJobs)), nChunks);
+
+    auto &&func = [&](uint64_t t) {
+        for (uint64_t c = t; c < nChunks; c += nThreads)
+        {
+            const uint64_t last = std::min(n, (c + 1) * chunk);
+            for (uint64_t i = c * chunk; i < last; i++)
+            {
+                ptr[i] = value(i);
+            }
+        }
+    };
+
+    parallel(func, static_cast<uint64_t>(0), nThreads, nJobs);
+}
+
+// Parallel first-touch fill of an Armadillo object with a constant
+template <typename A>
+void ParallelFill(A &m, const typename A::elem_type value, const int nJobs)
+{
+    ParallelFill(m.memptr(), m.n_elem, [value](uint64_t) { return value; }, nJobs);
+}
+
 template <typename T>
 void SetMemState(T &t, int state)
 {
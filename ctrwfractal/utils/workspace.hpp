@@ -0,0 +1,120 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Reusable, cache-aligned buffers for simulating one walk at a time.
+
+***************************************************************************/
+
+#ifndef WORKSPACE_HPP
+#define WORKSPACE_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+template <typename E>
+class AlignedBuffer
+{
+  // Uninitialised storage on a cache-line boundary. Reserve only
+  // reallocates when the buffer has to grow, so a buffer that is reused
+  // for every walk allocates once, for the first.
+public:
+  static const uint64_t alignment = 64;
+
+  AlignedBuffer() : ptr(nullptr), capacity(0){};
+  ~AlignedBuffer() { Release(); };
+
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+  // Returns the number of allocations made, 0 or 1. The contents are
+  // not kept when the buffer grows.
+  uint64_t Reserve(const uint64_t n)
+  {
+    if (n <= capacity)
+    {
+      return 0;
+    }
+
+    Release();
+    void *mem = nullptr;
+    if (posix_memalign(&mem, alignment, n * sizeof(E)) != 0)
+    {
+      throw std::bad_alloc();
+    }
+    ptr = static_cast<E *>(mem);
+    capacity = n;
+    return 1;
+  };
+
+  void Release()
+  {
+    std::free(ptr);
+    ptr = nullptr;
+    capacity = 0;
+  };
+
+  inline E &operator[](const uint64_t i) { return ptr[i]; };
+  inline const E &operator[](const uint64_t i) const { return ptr[i]; };
+  inline E *data() { return ptr; };
+  uint64_t Capacity() const { return capacity; };
+
+private:
+  E *ptr;
+  uint64_t capacity;
+};
+
+class WalkWorkspace
+{
+  // Everything the full CTRW pipeline needs for one walk: the sites and
+  // boundary crossings of its hops on the fractal, the cumulative CTRW
+  // times of the hops, and the site and crossing at each observed step.
+  // A thread keeps one workspace and reserves it before every walk, which
+  // only allocates until it has grown to the longest walk.
+public:
+  // Returns the number of buffers that had to be allocated
+  uint64_t Reserve(const uint64_t simLength, const uint64_t nSteps)
+  {
+    return sites.Reserve(simLength) + crossings.Reserve(simLength) + times.Reserve(simLength) +
+           observedSites.Reserve(nSteps) + observedCrossings.Reserve(nSteps);
+  };
+
+  void Release()
+  {
+    sites.Release();
+    crossings.Release();
+    times.Release();
+    observedSites.Release();
+    observedCrossings.Release();
+  };
+
+  // Bytes for a walk of simLength hops observed at nSteps steps
+  static uint64_t Bytes(const uint64_t simLength, const uint64_t nSteps)
+  {
+    return simLength * (sizeof(int64_t) + sizeof(uint8_t) + sizeof(double)) +
+           nSteps * (sizeof(int64_t) + sizeof(uint8_t));
+  };
+
+  AlignedBuffer<int64_t> sites, observedSites;
+  AlignedBuffer<uint8_t> crossings, observedCrossings;
+  AlignedBuffer<double> times;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/***************************************************************************
+
+  Copyright 2016-2020 Tom Furnival
+
+  This file is part of ctrwfractal.
+
+  ctrwfractal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ctrwfractal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ctrwfractal.  If not, see <http://www.gnu.org/licenses/>.
+
+  Minimal writer for the Zarr v2 directory format with zlib-compressed
+  chunks. See https://zarr.readthedocs.io/en/stable/spec/v2.html
+
+***************************************************************************/
+
+#ifndef ZARR_HPP
+#define ZARR_HPP
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <zlib.h>
+
+class ZarrWriter
+{
+public:
+  // Chunks are compressed and written by a background thread. At most
+  // maxPending chunks are queued (double-buffering by default), so the
+  // simulation only blocks if it gets more than a chunk ahead of the disk.
+  ZarrWriter(const std::string &path,
+             const std::string &attributes,
+             const int level = 1,
+             const size_t maxPending = 2) : path(path),
+                                            level(level),
+                                            maxPending(maxPending)
+  {
+    MakeDirectory(path);
+    WriteFile(path + "/.zgroup", "{\"zarr_format\": 2}");
+    WriteFile(path + "/.zattrs", attributes);
+    worker = std::thread(&ZarrWriter::Run, this);
+  };
+
+  ~ZarrWriter()
+  {
+    try
+    {
+      Close();
+    }
+    catch (...) // Errors are reported by an explicit Close()
+    {
+    }
+  };
+
+  void CreateArray(const std::string &name,
+                   const std::vector<uint64_t> &shape,
+                   const std::vector<uint64_t> &chunks,
+                   const std::string &dtype,
+                   const char order = 'C')
+  {
+    std::ostringstream meta;
+    meta << "{\"zarr_format\": 2, \"shape\": " << JSONList(shape)
+         << ", \"chunks\": " << JSONList(chunks)
+         << ", \"dtype\": \"" << dtype << "\""
+         << ", \"compressor\": {\"id\": \"zlib\", \"level\": " << level << "}"
+         << ", \"fill_value\": 0, \"order\": \"" << order << "\""
+         << ", \"filters\": null}";
+
+    MakeDirectory(path + "/" + name);
+    WriteFile(path + "/" + name + "/.zarray", meta.str());
+  };
+
+  void WriteChunk(const std::string &name,
+                  const std::vector<uint64_t> &index,
+                  const void *data,
+                  const size_t nBytes,
+                  const size_t chunkBytes)
+  {
+    // Partial edge chunks are padded with the fill value to the full size
+    Job job;
+    job.file = path + "/" + name + "/" + ChunkKey(index);
+    job.buffer.assign(chunkBytes, 0);
+    std::memcpy(job.buffer.data(), data, nBytes);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    spaceAvailable.wait(lock, [&]() { return pending.size() < maxPending || !error.empty(); });
+    CheckError();
+    pending.push_back(std::move(job));
+    jobAvailable.notify_one();
+  };
+
+  void Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (finished)
+      {
+        return;
+      }
+      finished = true;
+    }
+    jobAvailable.notify_one();
+    worker.join();
+    CheckError();
+  };
+
+private:
+  struct Job
+  {
+    std::string file;
+    std::vector<char> buffer;
+  };
+
+  std::string path;
+  int level;
+  size_t maxPending;
+
+  std::deque<Job> pending;
+  std::mutex mutex;
+  std::condition_variable jobAvailable, spaceAvailable;
+  std::thread worker;
+  std::string error;
+  bool finished = false;
+
+  void Run()
+  {
+    while (true)
+    {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobAvailable.wait(lock, [&]() { return !pending.empty() || finished; });
+        if (pending.empty())
+        {
+          return;
+        }
+        job = std::move(pending.front());
+        pending.pop_front();
+      }
+      spaceAvailable.notify_one();
+
+      try
+      {
+        uLongf nCompressed = compressBound(job.buffer.size());
+        std::vector<char> compressed(nCompressed);
+        if (compress2(reinterpret_cast<Bytef *>(compressed.data()), &nCompressed,
+                      reinterpret_cast<const Bytef *>(job.buffer.data()), job.buffer.size(),
+                      level) != Z_OK)
+        {
+          throw std::runtime_error("Failed to compress " + job.file);
+        }
+        WriteFile(job.file, std::string(compressed.data(), nCompressed));
+      }
+      catch (const std::exception &e)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = e.what();
+        pending.clear();
+        spaceAvailable.notify_all();
+        return;
+      }
+    }
+  };
+
+  void CheckError()
+  {
+    if (!error.empty())
+    {
+      throw std::runtime_error(error);
+    }
+  };
+
+  static void MakeDirectory(const std::string &dir)
+  {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+      throw std::runtime_error("Unable to create directory " + dir);
+    }
+  };
+
+  static void WriteFile(const std::string &file, const std::string &contents)
+  {
+    std::ofstream out(file, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size());
+    if (!out)
+    {
+      throw std::runtime_error("Unable to write " + file);
+    }
+  };
+
+  static std::string JSONList(const std::vector<uint64_t> &values)
+  {
+    std::ostringstream out;
+    out << "[";
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      out << ((i > 0) ? ", " : "") << values[i];
+    }
+    out << "]";
+    return out.str();
+  };
+
+  static std::string ChunkKey(const std::vector<uint64_t> &index)
+  {
+    std::ostringstream out;
+    for (size_t i = 0; i < index.size(); i++)
+    {
+      out << ((i > 0) ? "." : "") << index[i];
+    }
+    return out.str();
+  };
+};
+
+#endif
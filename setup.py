@@ -25,7 +25,7 @@ extensions = [
         "ctrwfractal._ctrwfractal",
         sources=["ctrwfractal/_ctrwfractal.pyx"],
         include_dirs=["ctrwfractal/", np.get_include()],
-        libraries=["openblas", "lapack", "armadillo"],
+        libraries=["openblas", "lapack", "armadillo", "z"],
         language="c++",
         extra_compile_args=[
             "-O3",
@@ -65,6 +65,7 @@ setup(
     ],
     packages=find_packages(),
     install_requires=["numpy", "pandas", "matplotlib"],
+    extras_require={"arrow": ["pyarrow"]},
     setup_requires=["cython", "wheel", "auditwheel"],
     package_data={"": ["LICENSE", "README.md"], "ctrwfractal": ["*.py"]},
     ext_modules=cythonize(extensions),